@@ -1,8 +1,183 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+// On x86 we can use TSC for benchmarks and AES-NI instructions (picked at runtime with CPUID)
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_X86
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+// io_uring for pipelined file encryption (pipe_run_uring), -DAES_NO_IO_URING leaves only thread pipeline
+#if defined(__linux__) && !defined(AES_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define AES_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 #include "s-box.h"
 
+// Build switch for round engine used by aes_encrypt_block / aes_decrypt_block
+// Default is byte engine working on state[4][4] matrix
+// Compiling with -DAES_TTABLE switches to T-table engine working on four 32-bit column words
+// Batches of blocks (CTR, CBC decryption, ECB) go through constant-time bitsliced engine by default,
+// with -DAES_TTABLE they use faster but table based T-table engine
+// All engines are always compiled, so benchmark can compare them in one binary
+// Compiling with -DAES_PROFILE adds cycle counters per round step, engine call and mode (see Profiling build)
+
+// Key sizes - AES-128 (Nk = 4 words, 10 rounds), AES-192 (Nk = 6, 12 rounds), AES-256 (Nk = 8, 14 rounds)
+#define AES_MAX_ROUNDS 14
+#define AES_MAX_WORDS (4 * (AES_MAX_ROUNDS + 1))
+
+// Compile-time specialisation of engines
+/*
+Engine bodies take number of rounds as constant argument and are forced inline,
+AES_SPECIALISE makes one copy of the body per key size (10, 12 and 14 rounds)
+Inside every copy round loop has constant length, so compiler unrolls it completely
+and the only check of key size is one switch per call, not per round
+*/
+#define AES_INLINE static inline __attribute__((always_inline))
+#define AES_SPECIALISE(fn, ...) \
+    switch(ctx->rounds){ \
+        case 10: fn(__VA_ARGS__, 10); break; \
+        case 12: fn(__VA_ARGS__, 12); break; \
+        default: fn(__VA_ARGS__, 14); break; \
+    }
+
+// Reading CPU cycle counter - on x86 it's TSC, elsewhere we fall back to nanoseconds
+u_int64_t aes_cycles(void){
+#ifdef AES_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Profiling build (-DAES_PROFILE)
+/*
+Counts cycles (TSC, on other CPUs nanoseconds) and calls of:
+- steps of byte engine - KeyExpansion, SubBytes, ShiftRows, MixColumns, AddRoundKey and their inverses
+- whole block and batch calls of the engine picked at runtime (other engines have fused rounds)
+- mode functions (CBC, CTR, GCM, XTS, IV generation) - with bytes, so cycles/byte can be shown
+Table is printed to stderr at exit
+
+Without AES_PROFILE all AES_PROF_* macros are empty, so normal build doesn't change at all
+Every timer costs one counter read and one atomic add - it's about as much as ShiftRows itself,
+so cost of one empty timer is measured at start and subtracted, but profiled build is still
+only for finding where time goes, not for benchmarks
+*/
+#ifdef AES_PROFILE
+enum {
+    AES_PROF_KEY_EXPANSION, AES_PROF_KEY_SETUP,
+    AES_PROF_SUB_BYTES, AES_PROF_SHIFT_ROWS, AES_PROF_MIX_COLUMNS,
+    AES_PROF_INV_SUB_BYTES, AES_PROF_INV_SHIFT_ROWS, AES_PROF_INV_MIX_COLUMNS,
+    AES_PROF_ADD_ROUND_KEY,
+    AES_PROF_BLOCK_ENCRYPT, AES_PROF_BLOCK_DECRYPT, AES_PROF_BLOCKS_ENCRYPT, AES_PROF_BLOCKS_DECRYPT,
+    AES_PROF_CBC_ENCRYPTION_128, AES_PROF_CBC_DECRYPT_128, AES_PROF_CBC_ENCRYPT, AES_PROF_CBC_DECRYPT,
+    AES_PROF_CTR, AES_PROF_GCM, AES_PROF_XTS, AES_PROF_GENERATE_IV,
+    AES_PROF_COUNT
+};
+
+// First entry of every group (stages, engine calls, modes) - shares are computed inside a group
+#define AES_PROF_FIRST_ENGINE AES_PROF_BLOCK_ENCRYPT
+#define AES_PROF_FIRST_MODE AES_PROF_CBC_ENCRYPTION_128
+
+const char* aes_prof_names[AES_PROF_COUNT] = {
+    "KeyExpansion", "engine key setup",
+    "SubBytes", "ShiftRows", "MixColumns",
+    "InvSubBytes", "InvShiftRows", "InvMixColumns",
+    "AddRoundKey",
+    "aes_encrypt_block", "aes_decrypt_block", "aes_encrypt_blocks", "aes_decrypt_blocks",
+    "cbc_encryption_128", "cbc_decrypt_128", "cbc_encryption_ctx", "cbc_decrypt_mt",
+    "ctr_crypt", "gcm_crypt", "xts_crypt", "generate_iv"
+};
+
+u_int64_t aes_prof_cycles[AES_PROF_COUNT], aes_prof_calls[AES_PROF_COUNT], aes_prof_bytes[AES_PROF_COUNT];
+// Cost of one empty timer (counter read + atomic adds)
+u_int64_t aes_prof_overhead = 0;
+
+// Adding time since start to counter id, returns current time so stages can be timed one after another
+u_int64_t aes_prof_lap(int id, u_int64_t start, u_int64_t bytes){
+    u_int64_t now = aes_cycles();
+    // Threads update the same counters, relaxed atomics are enough for sums read at exit
+    __atomic_fetch_add(&aes_prof_cycles[id], now - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&aes_prof_calls[id], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&aes_prof_bytes[id], bytes, __ATOMIC_RELAXED);
+    return now;
+}
+
+void aes_prof_dump(void){
+    u_int64_t total[3] = {0};
+    u_int64_t cycles[AES_PROF_COUNT];
+    for(int i = 0; i < AES_PROF_COUNT; ++i){
+        u_int64_t cost = aes_prof_calls[i] * aes_prof_overhead;
+        cycles[i] = aes_prof_cycles[i] > cost ? aes_prof_cycles[i] - cost : 0;
+        total[(i >= AES_PROF_FIRST_ENGINE) + (i >= AES_PROF_FIRST_MODE)] += cycles[i];
+    }
+
+    fprintf(stderr, "\nAES profile (%s, timer overhead %llu subtracted)\n",
+#ifdef AES_X86
+        "cycles",
+#else
+        "ns",
+#endif
+        (unsigned long long)aes_prof_overhead);
+    fprintf(stderr, "%-20s %12s %16s %12s %12s %7s\n", "counter", "calls", "total", "per call", "per byte", "share");
+    for(int i = 0; i < AES_PROF_COUNT; ++i){
+        if(aes_prof_calls[i] == 0){
+            continue;
+        }
+        int group = (i >= AES_PROF_FIRST_ENGINE) + (i >= AES_PROF_FIRST_MODE);
+        fprintf(stderr, "%-20s %12llu %16llu %12.1f ", aes_prof_names[i], (unsigned long long)aes_prof_calls[i],
+            (unsigned long long)cycles[i], (double)cycles[i] / aes_prof_calls[i]);
+        if(aes_prof_bytes[i] != 0){
+            fprintf(stderr, "%12.2f ", (double)cycles[i] / aes_prof_bytes[i]);
+        }
+        else {
+            fprintf(stderr, "%12s ", "-");
+        }
+        fprintf(stderr, "%6.1f%%\n", total[group] != 0 ? 100.0 * cycles[i] / total[group] : 0.0);
+    }
+}
+
+// Measuring timer overhead and registering table dump before main starts
+__attribute__((constructor)) void aes_prof_setup(void){
+    u_int64_t best = ~0ULL;
+    for(int i = 0; i < 1000; ++i){
+        u_int64_t start = aes_cycles();
+        u_int64_t end = aes_prof_lap(AES_PROF_KEY_EXPANSION, start, 0);
+        if(end - start < best){
+            best = end - start;
+        }
+    }
+    memset(aes_prof_cycles, 0, sizeof(aes_prof_cycles));
+    memset(aes_prof_calls, 0, sizeof(aes_prof_calls));
+    memset(aes_prof_bytes, 0, sizeof(aes_prof_bytes));
+    aes_prof_overhead = best;
+    atexit(aes_prof_dump);
+}
+
+// AES_PROF_BEGIN starts timer in current scope, AES_PROF_STAGE adds time since previous stage (or begin)
+// AES_PROF_END is for functions timed as a whole, bytes is amount of processed data (0 if it doesn't apply)
+#define AES_PROF_BEGIN() u_int64_t aes_prof_t = aes_cycles()
+#define AES_PROF_STAGE(id) aes_prof_t = aes_prof_lap(id, aes_prof_t, 0)
+#define AES_PROF_END(id, bytes) aes_prof_lap(id, aes_prof_t, bytes)
+#else
+#define AES_PROF_BEGIN()
+#define AES_PROF_STAGE(id)
+#define AES_PROF_END(id, bytes)
+#endif
+
 // xtim is a times 2 operation in Galois Field GF(2^8)
 u_int8_t xtim(u_int8_t a){
     // Multiplying number by 2
@@ -36,28 +211,51 @@ u_int8_t mE(u_int8_t a) {
     return xtim(xtim(xtim(a))) ^ xtim(xtim(a)) ^ xtim(a);
 }
 
-// Key expansion algorithm for AES-128
-void key_expansion_128(const u_int8_t* key, u_int32_t* words){
-    // Changing 128 bit key, which is composed of 16 bytes into four 32 bit words
-    words[0] = (key[0]  << 24) | (key[1]  << 16) | (key[2]  << 8) | key[3];
-    words[1] = (key[4]  << 24) | (key[5]  << 16) | (key[6]  << 8) | key[7];
-    words[2] = (key[8]  << 24) | (key[9]  << 16) | (key[10] << 8) | key[11];
-    words[3] = (key[12] << 24) | (key[13] << 16) | (key[14] << 8) | key[15];
+// Expanded key context
+// Key expansion depends only on the key, so for messages with many blocks it's done once
+// and both schedules are reused for every block
+typedef struct {
+    // Number of rounds - 10, 12 or 14 depending on key size
+    int rounds;
+    // 4 * (rounds + 1) words of round keys in encryption order (44 for AES-128)
+    u_int32_t enc_words[AES_MAX_WORDS];
+    // Rounds in decryption order (last round first, round 0 last) with InvMixColumns applied to middle round keys
+    // (equivalent inverse cipher) - byte and T-table decryption use keys in this form
+    u_int32_t dec_words_eq[AES_MAX_WORDS];
+    // Round keys for AES-NI backend as blocks of 16 bytes (decryption keys already passed through AESIMC)
+    // Filled only when CPU supports AES-NI
+    u_int8_t ni_enc_keys[16 * (AES_MAX_ROUNDS + 1)];
+    u_int8_t ni_dec_keys[16 * (AES_MAX_ROUNDS + 1)];
+    // Round keys for bitsliced engine - 8 words per round (every round key transposed into bit planes)
+    // Filled only when bitsliced engine is the batch backend (aes_bs_backend), otherwise aes_bs_init_ctx
+    // has to be called before using bitsliced functions directly
+    u_int64_t bs_keys[8 * (AES_MAX_ROUNDS + 1)];
+} aes_ctx;
+
+// Key expansion algorithm for AES-128, AES-192 and AES-256
+// nk is key length in 32-bit words (4, 6 or 8)
+void key_expansion(const u_int8_t* key, int nk, u_int32_t* words){
+    // Changing key, which is composed of 4 * nk bytes into nk 32 bit words
+    for(int i = 0; i < nk; ++i){
+        words[i] = ((u_int32_t)key[i * 4] << 24) | ((u_int32_t)key[i * 4 + 1] << 16) | ((u_int32_t)key[i * 4 + 2] << 8) | key[i * 4 + 3];
+    }
 
-    // Expanding key - for AES-128 we need 44 key words to have 11 128 bit round keys 
+    // Expanding key - we need 4 words for every round key and there are nk + 7 round keys
+    // (44 words for AES-128, 52 for AES-192, 60 for AES-256)
+    int total_words = 4 * (nk + 7);
 
     // Temporary value to store current key word
     u_int32_t tmp = {0};
     
     // Every next word is generated based on previous word (we will call it word1) 
-    // and one four places before (we will call it word2)
-    // (eg. fifth word is based on fourth and first word)
-    for(int i = 4; i < 44; ++i){
+    // and one nk places before (we will call it word2)
+    // (eg. for AES-128 fifth word is based on fourth and first word)
+    for(int i = nk; i < total_words; ++i){
         // First we take word1
         tmp = words[i-1];
 
-        // If i%4 == 0 (first word of next key) we do additional transformations
-        if(i%4 == 0){
+        // If i%nk == 0 (first word of next key) we do additional transformations
+        if(i%nk == 0){
             // Rotating current tmp value by 8 bits left 
             // Bitwise rotation is operation where any bits that would go out of range are carried on the other way
             /*
@@ -99,24 +297,147 @@ void key_expansion_128(const u_int8_t* key, u_int32_t* words){
 
             // XOR-ing temporary word value with special constant array (round constant) which contains predefined values
             // Rcon is defined in "s-box.h"
-            tmp = tmp ^ Rcon_128[i/4];
+            // i/nk is never bigger than 10, so Rcon_128 is enough for every key size
+            tmp = tmp ^ Rcon_128[i/nk];
         }  
+        // AES-256 has additional SubBytes (without rotation and Rcon) in the middle of every 8 words
+        else if(nk > 6 && i%nk == 4){
+            tmp = ((u_int32_t)s_box[(tmp >> 24) & 0xFF] << 24) | ((u_int32_t)s_box[(tmp >> 16) & 0xFF] << 16) | ((u_int32_t)s_box[(tmp >> 8) & 0xFF] << 8) | s_box[tmp & 0xFF];
+        }
         
         // Creating final word by XOR-ing current tmp with word2
-        words[i] = tmp^words[i-4];
+        words[i] = tmp^words[i-nk];
     }
 }
 
-// Encrypting one 16 bytes data block
-void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
-    // Preparing 44 32 bit words for 11 round keys (AES-128 has 11 rounds) and variables for controlling rounds
-    u_int32_t key_words[44] = {0};
+// Key expansion algorithm for AES-128
+void key_expansion_128(const u_int8_t* key, u_int32_t* words){
+    key_expansion(key, 4, words);
+}
+
+// InvMixColumns of one column stored as 32-bit word (first byte is MSB)
+u_int32_t inv_mix_column_word(u_int32_t w){
+    u_int8_t s0 = (w >> 24) & 0xFF;
+    u_int8_t s1 = (w >> 16) & 0xFF;
+    u_int8_t s2 = (w >> 8) & 0xFF;
+    u_int8_t s3 = (w) & 0xFF;
+
+    // Straight InvMixColumns equations - it's done only once per key, so speed doesn't matter here
+    u_int8_t r0 = mE(s0) ^ mB(s1) ^ mD(s2) ^ m9(s3);
+    u_int8_t r1 = m9(s0) ^ mE(s1) ^ mB(s2) ^ mD(s3);
+    u_int8_t r2 = mD(s0) ^ m9(s1) ^ mE(s2) ^ mB(s3);
+    u_int8_t r3 = mB(s0) ^ mD(s1) ^ m9(s2) ^ mE(s3);
+
+    return ((u_int32_t)r0 << 24) | ((u_int32_t)r1 << 16) | ((u_int32_t)r2 << 8) | r3;
+}
+
+// One time setup of the whole program - generating T-tables and detecting CPU features
+void aes_global_setup(void);
+pthread_once_t aes_setup_once = PTHREAD_ONCE_INIT;
+// Set by aes_global_setup when CPU has AES-NI, block functions then use hardware backend
+int aes_use_ni = 0;
+// Set when CPU has PCLMULQDQ (and SSSE3 for byte shuffles) - GCM then uses carry-less multiplication for GHASH
+int aes_use_pclmul = 0;
+void aes_ni_init_ctx(aes_ctx* ctx, const u_int8_t* key, int key_bytes, int decrypt);
+void aes_bs_init_ctx(aes_ctx* ctx);
+
+// Bitsliced engine takes batches only without AES-NI and without -DAES_TTABLE
+AES_INLINE int aes_bs_backend(void){
+#ifdef AES_TTABLE
+    return 0;
+#else
+    return !aes_use_ni;
+#endif
+}
+
+// Common part of aes_init_ctx and aes_init_ctx_enc - decryption schedules are built only when decrypt != 0
+int aes_init_schedules(aes_ctx* ctx, const u_int8_t* key, int key_bytes, int decrypt){
+    if(key_bytes != 16 && key_bytes != 24 && key_bytes != 32){
+        fprintf(stderr, "Err: Key has to be 16, 24 or 32 bytes long\n");
+        return -1;
+    }
+
+    AES_PROF_BEGIN();
+    memset(ctx, 0, sizeof(*ctx));
+    int nk = key_bytes / 4;
+    int rounds = nk + 6;
+    ctx->rounds = rounds;
+
+    // Encryption schedule is plain key expansion
+    key_expansion(key, nk, ctx->enc_words);
+
+    // Decryption uses round keys from the last one to the first one
+    // We store them already reversed (round by round, words inside a round keep their order)
+    // so decryption can walk its schedule forward just like encryption does
+    // Equivalent inverse cipher swaps InvMixColumns and AddRoundKey in the middle rounds
+    // MixColumns is linear so InvMixColumns(state ^ key) = InvMixColumns(state) ^ InvMixColumns(key)
+    // and it's enough to apply InvMixColumns to round keys once here
+    if(decrypt){
+        for(int round = 0; round <= rounds; ++round){
+            for(int j = 0; j < 4; ++j){
+                u_int32_t w = ctx->enc_words[(rounds - round) * 4 + j];
+                ctx->dec_words_eq[round * 4 + j] = (round == 0 || round == rounds) ? w : inv_mix_column_word(w);
+            }
+        }
+    }
+
+    AES_PROF_STAGE(AES_PROF_KEY_EXPANSION);
+
+    // T-tables and CPU detection are done only once for the whole program
+    pthread_once(&aes_setup_once, aes_global_setup);
+
+    // Bitsliced engine keeps round keys transposed into bit planes - built only when it's going to be used
+    if(aes_bs_backend()){
+        aes_bs_init_ctx(ctx);
+    }
+
+    // Hardware backend has its own key schedule format
+    if(aes_use_ni){
+        aes_ni_init_ctx(ctx, key, key_bytes, decrypt);
+    }
+    AES_PROF_STAGE(AES_PROF_KEY_SETUP);
+    return 0;
+}
+
+// Expanding the key is the same work for every block, so instead of repeating it per block
+// we do it once per key and keep both schedules in a context that block and mode functions take
+// key_bytes is 16, 24 or 32 (AES-128, AES-192, AES-256), returns 0 or -1 for other sizes
+int aes_init_ctx(aes_ctx* ctx, const u_int8_t* key, int key_bytes){
+    return aes_init_schedules(ctx, key, key_bytes, 1);
+}
+
+// Context only for encryption direction - CTR, GCM, CMAC and DRBG never run the inverse cipher,
+// so the InvMixColumns schedule and AES-NI decryption keys are skipped (they stay zeroed)
+// Decrypting with such context gives garbage
+int aes_init_ctx_enc(aes_ctx* ctx, const u_int8_t* key, int key_bytes){
+    return aes_init_schedules(ctx, key, key_bytes, 0);
+}
+
+// Context for 128-bit key
+void aes_init_ctx_128(aes_ctx* ctx, const u_int8_t* key){
+    aes_init_ctx(ctx, key, 16);
+}
+
+// Wiping secret data (key schedules, hash keys) when it's not needed anymore
+// Plain memset (full width stores) followed by compiler barrier - empty asm which "reads" the memory
+// stops compiler from removing the writes as "dead stores"
+void secure_wipe(void* data, size_t bytes){
+    memset(data, 0, bytes);
+    __asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
+void aes_clear_ctx(aes_ctx* ctx){
+    secure_wipe(ctx, sizeof(*ctx));
+}
+
+// Encrypting one 16 bytes data block with already expanded key (byte engine)
+// rounds is constant in every specialised copy (see AES_SPECIALISE)
+AES_INLINE void aes_encrypt_bytes_rounds(const aes_ctx* ctx, u_int8_t message[16], const int rounds){
+    // Round keys were expanded once in aes_init_ctx
+    const u_int32_t* key_words = ctx->enc_words;
     // Round counts rounds and round_key_offset tracks which word is first word for current round 
     u_int32_t round = 0, round_key_offset = 0;
 
-    // Expanding key
-    key_expansion_128(key, key_words);
-
     // Creating special state matrix which contains data 
     // In AES data are stored in COLUMNS which means that if first byte is on state[0][0] next one is on state[1][0]!
     u_int8_t state[4][4];
@@ -128,6 +449,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
         }
     }
 
+    AES_PROF_BEGIN();
+
     //Round zero of encryption containing first operation AddRoundKey
     /*
     AddRoundKey is a simple operation that does XOR operation between round key and bytes of data
@@ -153,10 +476,12 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
         state[3][j] = state[3][j] ^ key_b3;
     }
 
+    AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
+
     // After round 0 we increment round counter and moving the key offset
     round_key_offset = ++round * 4;
 
-    // Rounds - here we do 9 rounds of encrypting 
+    // Rounds - here we do rounds - 1 rounds of encrypting (9 for AES-128, 11 for AES-192, 13 for AES-256)
     /*
     Each round contains of four operations
     - SubBytes
@@ -164,7 +489,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
     - MixColumns
     - AddRoundKey
     */ 
-    for(int k = 0; k < 9; ++k){
+    #pragma GCC unroll 14
+    for(int k = 0; k < rounds - 1; ++k){
         // SubBytes works the same as SubBytes for key_expansion
         // Because state stores data as bytes we can skip extracting particular bytes
         for (int i = 0; i < 4; ++i){
@@ -173,6 +499,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
             }
         }
 
+        AES_PROF_STAGE(AES_PROF_SUB_BYTES);
+
         // ShiftRows shifts bytes in row which is first step of spreading data across the matrix
         // ShiftRows makes sure that data are spread between columns 
         // ShiftRows and next operation (MixColumns) ensure that changing on bit in message changes cipher completely
@@ -204,6 +532,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
         state[3][1] = state[3][0];
         state[3][0] = temp0;
 
+        AES_PROF_STAGE(AES_PROF_SHIFT_ROWS);
+
         // MixCollumns is a heart of spreading and changing data in state matrix
         // It mixes data in one column 
         // With the help of shift rows it ensures that every column is dependant on every 32-bit word in initial message
@@ -238,6 +568,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
             state[3][j] = (xtim(s0) ^ s0) ^ s1 ^ s2 ^ xtim(s3);
         }
 
+        AES_PROF_STAGE(AES_PROF_MIX_COLUMNS);
+
         //AddRoundKey - the same as round zero
         for(int j = 0; j < 4; ++j){
             u_int32_t key_word = key_words[round_key_offset + j];
@@ -253,11 +585,13 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
             state[3][j] = state[3][j] ^ key_b3;
         }
 
+        AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
+
         // Incrementing round counter and moving key offset
         round_key_offset = ++round * 4;
     }
 
-    // Final round (11 round) performs every operation from previous round but not MixColumns
+    // Final round performs every operation from previous round but not MixColumns
 
     // SubBytes
     for (int i = 0; i < 4; ++i){
@@ -266,6 +600,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
         }
     }
 
+    AES_PROF_STAGE(AES_PROF_SUB_BYTES);
+
     // ShiftRows
     u_int8_t temp0, temp1;
 
@@ -287,6 +623,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
     state[3][1] = state[3][0];
     state[3][0] = temp0;
 
+    AES_PROF_STAGE(AES_PROF_SHIFT_ROWS);
+
     //AddRoundKey
     for(int j = 0; j < 4; ++j){
         u_int32_t key_word = key_words[round_key_offset + j];
@@ -302,6 +640,8 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
         state[3][j] = state[3][j] ^ key_b3;
     }
 
+    AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
+
     // After all rounds of encrypting we copy bytes from state matrix into message
     // Because message is a pointer now data in original message are changed as well, we don't need to return anything
     for (int i = 0; i < 4; i++) {
@@ -311,15 +651,23 @@ void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
     }
 }
 
-// Decrypting one 16 bytes data block
-void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
-    // Preparing 44 32 bit words for round keys and controll variables
-    u_int32_t key_words[44] = {0};
-    // This time round is equal to 10 and round_key_offset equal to 40 because we are inverting encrypting process
-    u_int32_t round = 10, round_key_offset = 40;
+void aes_encrypt_block_bytes(const aes_ctx* ctx, u_int8_t message[16]){
+    AES_SPECIALISE(aes_encrypt_bytes_rounds, ctx, message)
+}
 
-    // Expanding AES key
-    key_expansion_128(key, key_words);
+// Decrypting one 16 bytes data block with already expanded key (byte engine)
+/*
+Decryption is done as equivalent inverse cipher (FIPS-197 section 5.3.5), so rounds have the same structure as encryption:
+- InvSubBytes and InvShiftRows can be swapped (one changes bytes, the other only moves them)
+- InvMixColumns is linear, so InvMixColumns(state ^ key) = InvMixColumns(state) ^ InvMixColumns(key)
+  and with InvMixColumns applied once to middle round keys (dec_words_eq in aes_init_ctx)
+  AddRoundKey can go after InvMixColumns just like after MixColumns in encryption
+*/
+AES_INLINE void aes_decrypt_bytes_rounds(const aes_ctx* ctx, u_int8_t cipher[16], const int rounds){
+    // Decryption schedule has round keys in reversed order so we walk it forward
+    // (first used round key is the last round key of encryption)
+    const u_int32_t* key_words = ctx->dec_words_eq;
+    u_int32_t round = 0, round_key_offset = 0;
 
     // Preparing state matrix
     u_int8_t state[4][4];
@@ -330,8 +678,9 @@ void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
         }
     }
 
-    // Round eleven
-    // AddRoundKey
+    AES_PROF_BEGIN();
+
+    // Round zero - AddRoundKey with the last round key of encryption
     /*
     Becuase XOR operation is it's own inversion then to invert AddRoundKey we need to add key again
     a^b = c => a = c^b - here b is our round key
@@ -350,77 +699,27 @@ void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
         state[3][j] = state[3][j] ^ b3;
     }
 
-    // InvShiftRows
-    // To invert shift rows we need to shift rows right not left 
-    u_int8_t temp0, temp1;
-
-    temp0 = state[1][3];
-    state[1][3] = state[1][2];
-    state[1][2] = state[1][1];
-    state[1][1] = state[1][0];
-    state[1][0] = temp0;
-
-    temp0 = state[2][0]; temp1 = state[2][1];
-    state[2][0] = state[2][2];
-    state[2][1] = state[2][3];
-    state[2][2] = temp0;
-    state[2][3] = temp1;
+    AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
 
-    temp0 = state[3][0];
-    state[3][0] = state[3][1];
-    state[3][1] = state[3][2];
-    state[3][2] = state[3][3];
-    state[3][3] = temp0;
+    round_key_offset = ++round * 4;
+    u_int8_t temp0, temp1;
 
-    // InvSubBytes
-    // To invert byte subtitution we need to do the same steps as for SubBytes but using inverse_s_box
-    // Inverse S-box works the same as S-box but allows to invert SubBytes process
-    for(int i = 0; i < 4; ++i){
-        for(int j = 0; j < 4; ++j){
-            state[i][j] = inverse_s_box[state[i][j]];
+    //Rounds - InvSubBytes, InvShiftRows, InvMixColumns, AddRoundKey (the same order as in encryption)
+    #pragma GCC unroll 14
+    for(int k = 0; k < rounds - 1; ++k){
+        // InvSubBytes
+        // To invert byte subtitution we need to do the same steps as for SubBytes but using inverse_s_box
+        // Inverse S-box works the same as S-box but allows to invert SubBytes process
+        for(int i = 0; i < 4; ++i){
+            for(int j = 0; j < 4; ++j){
+                state[i][j] = inverse_s_box[state[i][j]];
+            }
         }
-    }
-
-    round_key_offset = --round * 4;
-    //Rounds
-    for(int i = 0; i < 9; ++i){
-        // AddRoundKey
-        for(int j = 0; j < 4; ++j){
-            u_int32_t key_word = key_words[round_key_offset+j];
-
-            u_int8_t b0 = (key_word >> 24) & 0xFF;
-            u_int8_t b1 = (key_word >> 16) & 0xFF;
-            u_int8_t b2 = (key_word >> 8) & 0xFF;
-            u_int8_t b3 = (key_word) & 0xFF;
-
-            state[0][j] = state[0][j] ^ b0;
-            state[1][j] = state[1][j] ^ b1;
-            state[2][j] = state[2][j] ^ b2;
-            state[3][j] = state[3][j] ^ b3;
-        }   
-        // InvMixCollumns
-        /*
-        To invert MixCollumns we need to multiply our collumn by inverted matrix
-        It's again a complicated mathematical transformation that can be represented as theese equations:
-        s'0 = 14*s0 ^ 11*s1 ^ 13*s2 ^ 9*s3
-        s'1 = 9*s0 ^ 14*s1 ^ 11*s2 ^ 13*s3
-        s'2 = 13*s0 ^ 9*s1 ^ 14*s2 ^ 11*s3
-        s'3 = 11*s0 ^ 13*s1 ^ 9*s2 ^ 14*s3
-        */
-        for(int j = 0; j < 4; ++j){
-            u_int8_t s0 = state[0][j];
-            u_int8_t s1 = state[1][j];
-            u_int8_t s2 = state[2][j];
-            u_int8_t s3 = state[3][j];
 
-            
-            state[0][j] = mE(s0) ^ mB(s1) ^ mD(s2) ^ m9(s3);
-            state[1][j] = m9(s0) ^ mE(s1) ^ mB(s2) ^ mD(s3);
-            state[2][j] = mD(s0) ^ m9(s1) ^ mE(s2) ^ mB(s3);
-            state[3][j] = mB(s0) ^ mD(s1) ^ m9(s2) ^ mE(s3);
-        }
+        AES_PROF_STAGE(AES_PROF_INV_SUB_BYTES);
 
         // InvShiftRows
+        // To invert shift rows we need to shift rows right not left
         temp0 = state[1][3];
         state[1][3] = state[1][2];
         state[1][2] = state[1][1];
@@ -439,17 +738,92 @@ void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
         state[3][2] = state[3][3];
         state[3][3] = temp0;
 
-        // InvSubBytes
-        for(int i = 0; i < 4; ++i){
-            for(int j = 0; j < 4; ++j){
-                state[i][j] = inverse_s_box[state[i][j]];
-            }
+        AES_PROF_STAGE(AES_PROF_INV_SHIFT_ROWS);
+
+        // InvMixCollumns
+        /*
+        To invert MixCollumns we need to multiply our collumn by inverted matrix
+        It's again a complicated mathematical transformation that can be represented as theese equations:
+        s'0 = 14*s0 ^ 11*s1 ^ 13*s2 ^ 9*s3
+        s'1 = 9*s0 ^ 14*s1 ^ 11*s2 ^ 13*s3
+        s'2 = 13*s0 ^ 9*s1 ^ 14*s2 ^ 11*s3
+        s'3 = 11*s0 ^ 13*s1 ^ 9*s2 ^ 14*s3
+
+        Computing it with m9, mB, mD and mE costs 12 xtim calls per byte, but inverse matrix
+        can be written as MixColumns matrix times a simple one (AES book by Daemen and Rijmen, section 4.1.3):
+        u = 4*(s0 ^ s2), v = 4*(s1 ^ s3)
+        s0 ^= u, s1 ^= v, s2 ^= u, s3 ^= v and then normal MixColumns
+        which is 4 xtim calls for the first step and 4 for MixColumns per column
+        */
+        for(int j = 0; j < 4; ++j){
+            u_int8_t u = xtim(xtim(state[0][j] ^ state[2][j]));
+            u_int8_t v = xtim(xtim(state[1][j] ^ state[3][j]));
+            u_int8_t s0 = state[0][j] ^ u;
+            u_int8_t s1 = state[1][j] ^ v;
+            u_int8_t s2 = state[2][j] ^ u;
+            u_int8_t s3 = state[3][j] ^ v;
+
+            state[0][j] = xtim(s0) ^ (xtim(s1) ^ s1) ^ s2 ^ s3;
+            state[1][j] = s0 ^ xtim(s1) ^ (xtim(s2) ^ s2) ^ s3;
+            state[2][j] = s0 ^ s1 ^ xtim(s2) ^ (xtim(s3) ^ s3);
+            state[3][j] = (xtim(s0) ^ s0) ^ s1 ^ s2 ^ xtim(s3);
+        }
+
+        AES_PROF_STAGE(AES_PROF_INV_MIX_COLUMNS);
+
+        // AddRoundKey - round key has InvMixColumns already applied
+        for(int j = 0; j < 4; ++j){
+            u_int32_t key_word = key_words[round_key_offset+j];
+
+            u_int8_t b0 = (key_word >> 24) & 0xFF;
+            u_int8_t b1 = (key_word >> 16) & 0xFF;
+            u_int8_t b2 = (key_word >> 8) & 0xFF;
+            u_int8_t b3 = (key_word) & 0xFF;
+
+            state[0][j] = state[0][j] ^ b0;
+            state[1][j] = state[1][j] ^ b1;
+            state[2][j] = state[2][j] ^ b2;
+            state[3][j] = state[3][j] ^ b3;
         }
 
-        round_key_offset = --round * 4;
+        AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
+
+        round_key_offset = ++round * 4;
+    }
+
+    // Final round without InvMixColumns
+
+    // InvSubBytes
+    for(int i = 0; i < 4; ++i){
+        for(int j = 0; j < 4; ++j){
+            state[i][j] = inverse_s_box[state[i][j]];
+        }
     }
 
-    // AddRoundKey
+    AES_PROF_STAGE(AES_PROF_INV_SUB_BYTES);
+
+    // InvShiftRows
+    temp0 = state[1][3];
+    state[1][3] = state[1][2];
+    state[1][2] = state[1][1];
+    state[1][1] = state[1][0];
+    state[1][0] = temp0;
+
+    temp0 = state[2][0]; temp1 = state[2][1];
+    state[2][0] = state[2][2];
+    state[2][1] = state[2][3];
+    state[2][2] = temp0;
+    state[2][3] = temp1;
+
+    temp0 = state[3][0];
+    state[3][0] = state[3][1];
+    state[3][1] = state[3][2];
+    state[3][2] = state[3][3];
+    state[3][3] = temp0;
+
+    AES_PROF_STAGE(AES_PROF_INV_SHIFT_ROWS);
+
+    // AddRoundKey with the first round key of encryption
     for(int j = 0; j < 4; ++j){
         u_int32_t key_word = key_words[round_key_offset+j];
 
@@ -464,6 +838,8 @@ void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
         state[3][j] = state[3][j] ^ b3;
     }
 
+    AES_PROF_STAGE(AES_PROF_ADD_ROUND_KEY);
+
     for (int i = 0; i < 4; i++) {
         for (int j = 0; j < 4; j++) {
             cipher[j * 4 + i] = state[i][j];
@@ -471,67 +847,1665 @@ void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
     }
 }
 
-// Function to print data as hex
-void print_hex(unsigned char* data, int len) {
-    for (int i = 0; i < len; ++i) {
-        printf("%02x", data[i]);
-    }
-    putchar('\n');
+void aes_decrypt_block_bytes(const aes_ctx* ctx, u_int8_t cipher[16]){
+    AES_SPECIALISE(aes_decrypt_bytes_rounds, ctx, cipher)
+}
+
+// T-table engine
+/*
+Instead of keeping state as 4x4 byte matrix we keep it as four 32-bit words - one word per column
+(first byte of column is MSB, the same as in key words)
+
+For one output column of a middle round SubBytes, ShiftRows and MixColumns give:
+col'0 = (2*S[a], S[a], S[a], 3*S[a]) ^ (3*S[b], 2*S[b], S[b], S[b]) ^ (S[c], 3*S[c], 2*S[c], S[c]) ^ (S[d], S[d], 3*S[d], 2*S[d])
+where a, b, c, d are bytes picked from different columns by ShiftRows
+Every part depends only on one byte, so we can precompute it for all 256 values - these are T-tables
+Te1-Te3 are Te0 rotated by 8, 16 and 24 bits, so whole round becomes 16 lookups and XORs
+Decryption tables Td0-Td3 work the same with inverse_s_box and InvMixColumns coefficients (14, 9, 13, 11)
+*/
+u_int32_t Te0[256], Te1[256], Te2[256], Te3[256];
+u_int32_t Td0[256], Td1[256], Td2[256], Td3[256];
+
+// Rotating word by 8 bits right
+u_int32_t ror8(u_int32_t w){
+    return (w >> 8) | (w << 24);
 }
 
-void generate_iv(u_int8_t iv_vector[16]){
-    FILE* fd = fopen("/dev/urandom", "rb");
-    if(fd == NULL){
-        perror("Error while opening file");
-        exit(0);
+// Generating T-tables from s_box and inverse_s_box defined in "s-box.h"
+void aes_generate_tables(void){
+    for(int i = 0; i < 256; ++i){
+        u_int8_t s = s_box[i];
+        Te0[i] = ((u_int32_t)xtim(s) << 24) | ((u_int32_t)s << 16) | ((u_int32_t)s << 8) | (u_int8_t)(xtim(s) ^ s);
+        Te1[i] = ror8(Te0[i]);
+        Te2[i] = ror8(Te1[i]);
+        Te3[i] = ror8(Te2[i]);
+
+        u_int8_t is = inverse_s_box[i];
+        Td0[i] = ((u_int32_t)mE(is) << 24) | ((u_int32_t)m9(is) << 16) | ((u_int32_t)mD(is) << 8) | mB(is);
+        Td1[i] = ror8(Td0[i]);
+        Td2[i] = ror8(Td1[i]);
+        Td3[i] = ror8(Td2[i]);
     }
+}
 
-    if(fread(iv_vector, 1, 16, fd) != 16){
-        perror("Error while reading data");
-        exit(0);
+// Loading 4 bytes as big endian word and storing it back
+u_int32_t load_be32(const u_int8_t* p){
+    return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+}
+
+void store_be32(u_int8_t* p, u_int32_t w){
+    p[0] = w >> 24;
+    p[1] = w >> 16;
+    p[2] = w >> 8;
+    p[3] = w;
+}
+
+// Encrypting one 16 bytes data block with already expanded key (T-table engine)
+AES_INLINE void aes_encrypt_ttable_rounds(const aes_ctx* ctx, u_int8_t message[16], const int rounds){
+    const u_int32_t* rk = ctx->enc_words;
+
+    // Round zero - AddRoundKey
+    u_int32_t s0 = load_be32(message) ^ rk[0];
+    u_int32_t s1 = load_be32(message + 4) ^ rk[1];
+    u_int32_t s2 = load_be32(message + 8) ^ rk[2];
+    u_int32_t s3 = load_be32(message + 12) ^ rk[3];
+    u_int32_t t0, t1, t2, t3;
+
+    // Middle rounds - ShiftRows is done by picking bytes from next columns
+    // (row 1 from column + 1, row 2 from column + 2, row 3 from column + 3)
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        rk += 4;
+        t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xFF] ^ Te2[(s2 >> 8) & 0xFF] ^ Te3[s3 & 0xFF] ^ rk[0];
+        t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xFF] ^ Te2[(s3 >> 8) & 0xFF] ^ Te3[s0 & 0xFF] ^ rk[1];
+        t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xFF] ^ Te2[(s0 >> 8) & 0xFF] ^ Te3[s1 & 0xFF] ^ rk[2];
+        t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xFF] ^ Te2[(s1 >> 8) & 0xFF] ^ Te3[s2 & 0xFF] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
     }
 
-    fclose(fd);
+    // Final round has no MixColumns so we use plain s_box
+    rk += 4;
+    t0 = ((u_int32_t)s_box[s0 >> 24] << 24) ^ ((u_int32_t)s_box[(s1 >> 16) & 0xFF] << 16) ^ ((u_int32_t)s_box[(s2 >> 8) & 0xFF] << 8) ^ s_box[s3 & 0xFF] ^ rk[0];
+    t1 = ((u_int32_t)s_box[s1 >> 24] << 24) ^ ((u_int32_t)s_box[(s2 >> 16) & 0xFF] << 16) ^ ((u_int32_t)s_box[(s3 >> 8) & 0xFF] << 8) ^ s_box[s0 & 0xFF] ^ rk[1];
+    t2 = ((u_int32_t)s_box[s2 >> 24] << 24) ^ ((u_int32_t)s_box[(s3 >> 16) & 0xFF] << 16) ^ ((u_int32_t)s_box[(s0 >> 8) & 0xFF] << 8) ^ s_box[s1 & 0xFF] ^ rk[2];
+    t3 = ((u_int32_t)s_box[s3 >> 24] << 24) ^ ((u_int32_t)s_box[(s0 >> 16) & 0xFF] << 16) ^ ((u_int32_t)s_box[(s1 >> 8) & 0xFF] << 8) ^ s_box[s2 & 0xFF] ^ rk[3];
+
+    store_be32(message, t0);
+    store_be32(message + 4, t1);
+    store_be32(message + 8, t2);
+    store_be32(message + 12, t3);
 }
 
-// CBC encryption
-u_int8_t* cbc_encryption_128(const u_int8_t* key, u_int8_t* mes, u_int32_t mes_bytes){
-    // Creating variables for blocks used in cbc encrypting algorithm
-    u_int8_t previous_block[16], data_block[16];
-    // Generating IV vector and treating it as 0 block
-    generate_iv(previous_block);
+void aes_encrypt_block_ttable(const aes_ctx* ctx, u_int8_t message[16]){
+    AES_SPECIALISE(aes_encrypt_ttable_rounds, ctx, message)
+}
 
-    // Creating variables for amount of data blocks and counter for output variable
-    u_int32_t data_blocks = (mes_bytes/16) + 1;
-    u_int32_t output_counter = 0;
+// Decrypting one 16 bytes data block with already expanded key (T-table engine)
+AES_INLINE void aes_decrypt_ttable_rounds(const aes_ctx* ctx, u_int8_t cipher[16], const int rounds){
+    // Equivalent inverse cipher schedule - middle round keys have InvMixColumns already applied
+    const u_int32_t* rk = ctx->dec_words_eq;
 
-    // Creating variable for complete cipher an allocating memory
-    u_int8_t* output = malloc((data_blocks + 1) * 16);
+    u_int32_t s0 = load_be32(cipher) ^ rk[0];
+    u_int32_t s1 = load_be32(cipher + 4) ^ rk[1];
+    u_int32_t s2 = load_be32(cipher + 8) ^ rk[2];
+    u_int32_t s3 = load_be32(cipher + 12) ^ rk[3];
+    u_int32_t t0, t1, t2, t3;
 
-    if(output == NULL){
-        perror("Error while allocating memory");
-        return NULL;
+    // InvShiftRows shifts rows right, so bytes are picked from previous columns
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        rk += 4;
+        t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xFF] ^ Td2[(s2 >> 8) & 0xFF] ^ Td3[s1 & 0xFF] ^ rk[0];
+        t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xFF] ^ Td2[(s3 >> 8) & 0xFF] ^ Td3[s2 & 0xFF] ^ rk[1];
+        t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xFF] ^ Td2[(s0 >> 8) & 0xFF] ^ Td3[s3 & 0xFF] ^ rk[2];
+        t3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xFF] ^ Td2[(s1 >> 8) & 0xFF] ^ Td3[s0 & 0xFF] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
     }
 
-    // Copying 16 bytes of data from previous block to output and incrementing output_counter
-    memcpy(output, previous_block, 16);
-    ++output_counter;
+    rk += 4;
+    t0 = ((u_int32_t)inverse_s_box[s0 >> 24] << 24) ^ ((u_int32_t)inverse_s_box[(s3 >> 16) & 0xFF] << 16) ^ ((u_int32_t)inverse_s_box[(s2 >> 8) & 0xFF] << 8) ^ inverse_s_box[s1 & 0xFF] ^ rk[0];
+    t1 = ((u_int32_t)inverse_s_box[s1 >> 24] << 24) ^ ((u_int32_t)inverse_s_box[(s0 >> 16) & 0xFF] << 16) ^ ((u_int32_t)inverse_s_box[(s3 >> 8) & 0xFF] << 8) ^ inverse_s_box[s2 & 0xFF] ^ rk[1];
+    t2 = ((u_int32_t)inverse_s_box[s2 >> 24] << 24) ^ ((u_int32_t)inverse_s_box[(s1 >> 16) & 0xFF] << 16) ^ ((u_int32_t)inverse_s_box[(s0 >> 8) & 0xFF] << 8) ^ inverse_s_box[s3 & 0xFF] ^ rk[2];
+    t3 = ((u_int32_t)inverse_s_box[s3 >> 24] << 24) ^ ((u_int32_t)inverse_s_box[(s2 >> 16) & 0xFF] << 16) ^ ((u_int32_t)inverse_s_box[(s1 >> 8) & 0xFF] << 8) ^ inverse_s_box[s0 & 0xFF] ^ rk[3];
 
-    // Encrypting blocks with following algorithm
-    /*
-    - Take current block
-    - XOR current block with previous block (previous block in the 0 round is a IV vector)
-    We do not encrypt IV vector - it has to be random but it's not private
-    - Encrypt XORed block of data
+    store_be32(cipher, t0);
+    store_be32(cipher + 4, t1);
+    store_be32(cipher + 8, t2);
+    store_be32(cipher + 12, t3);
+}
 
-    If it's the last block we have to handle padding (PKCF#7 standard)
+void aes_decrypt_block_ttable(const aes_ctx* ctx, u_int8_t cipher[16]){
+    AES_SPECIALISE(aes_decrypt_ttable_rounds, ctx, cipher)
+}
+
+// Bitsliced engine
+/*
+Byte and T-table engines read s_box / T-tables at indexes which depend on key and data,
+time of these reads depends on what is in cache, so it leaks information about the key
+Bitsliced engine has no lookups at all - it's built only from AND, XOR, NOT and shifts:
+- 4 blocks (64 bytes) are transposed into 8 64-bit words, word i holds bit i of every byte
+- S-box is Boolean circuit applied to all 64 bytes at once
+- ShiftRows and MixColumns are moves of bits inside words
+Two groups of 4 blocks are processed together (8 blocks per call), so CPU has independent work
+for every instruction. Round keys are transposed the same way once per key (bs_keys in aes_ctx)
+*/
+// Bitsliced S-box - Boyar-Peralta circuit (113 XOR / AND gates, no lookups)
+// q[i] holds bit i of 64 bytes at once
+AES_INLINE void aes_bs_sbox(u_int64_t* q){
+    u_int64_t x0, x1, x2, x3, x4, x5, x6, x7;
+    u_int64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    u_int64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    u_int64_t y20, y21;
+    u_int64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    u_int64_t z10, z11, z12, z13, z14, z15, z16, z17;
+    u_int64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    u_int64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    u_int64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    u_int64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    u_int64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    u_int64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    u_int64_t t60, t61, t62, t63, t64, t65, t66, t67;
+    u_int64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section (inversion in GF(2^8) through GF(2^4))
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation (with affine constant 0x63 as negations)
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+// Inverse S-box - S-box is inversion followed by affine map A, so InvSbox(x) = A^-1(S(A^-1(x ^ 0x63)))
+// A^-1 with constant is the same cheap XOR network applied before and after the circuit above
+AES_INLINE void aes_bs_inv_affine(u_int64_t* q){
+    u_int64_t q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+    u_int64_t q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+AES_INLINE void aes_bs_inv_sbox(u_int64_t* q){
+    aes_bs_inv_affine(q);
+    aes_bs_sbox(q);
+    aes_bs_inv_affine(q);
+}
+
+// Swapping groups of bits between two words - building block of transposition
+#define BS_SWAPN(cl, ch, s, x, y) do { \
+        u_int64_t a_ = (x), b_ = (y); \
+        (x) = (a_ & (u_int64_t)(cl)) | ((b_ & (u_int64_t)(cl)) << (s)); \
+        (y) = ((a_ & (u_int64_t)(ch)) >> (s)) | (b_ & (u_int64_t)(ch)); \
+    } while(0)
+#define BS_SWAP2(x, y) BS_SWAPN(0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1, x, y)
+#define BS_SWAP4(x, y) BS_SWAPN(0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2, x, y)
+#define BS_SWAP8(x, y) BS_SWAPN(0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4, x, y)
+
+// Transposition of 8x8 bit matrices - the same function converts into bitsliced form and back
+AES_INLINE void aes_bs_ortho(u_int64_t* q){
+    BS_SWAP2(q[0], q[1]);
+    BS_SWAP2(q[2], q[3]);
+    BS_SWAP2(q[4], q[5]);
+    BS_SWAP2(q[6], q[7]);
+
+    BS_SWAP4(q[0], q[2]);
+    BS_SWAP4(q[1], q[3]);
+    BS_SWAP4(q[4], q[6]);
+    BS_SWAP4(q[5], q[7]);
+
+    BS_SWAP8(q[0], q[4]);
+    BS_SWAP8(q[1], q[5]);
+    BS_SWAP8(q[2], q[6]);
+    BS_SWAP8(q[3], q[7]);
+}
+
+AES_INLINE u_int32_t load_le32(const u_int8_t* p){
+    return (u_int32_t)p[0] | ((u_int32_t)p[1] << 8) | ((u_int32_t)p[2] << 16) | ((u_int32_t)p[3] << 24);
+}
+
+AES_INLINE void store_le32(u_int8_t* p, u_int32_t w){
+    p[0] = (u_int8_t)w;
+    p[1] = (u_int8_t)(w >> 8);
+    p[2] = (u_int8_t)(w >> 16);
+    p[3] = (u_int8_t)(w >> 24);
+}
+
+// Spreading one block into two words (even and odd bytes of every column), before ortho
+AES_INLINE void aes_bs_interleave_in(u_int64_t* q0, u_int64_t* q1, const u_int8_t block[16]){
+    u_int64_t x0 = load_le32(block), x1 = load_le32(block + 4);
+    u_int64_t x2 = load_le32(block + 8), x3 = load_le32(block + 12);
+
+    x0 |= x0 << 16;
+    x1 |= x1 << 16;
+    x2 |= x2 << 16;
+    x3 |= x3 << 16;
+    x0 &= 0x0000FFFF0000FFFFULL;
+    x1 &= 0x0000FFFF0000FFFFULL;
+    x2 &= 0x0000FFFF0000FFFFULL;
+    x3 &= 0x0000FFFF0000FFFFULL;
+    x0 |= x0 << 8;
+    x1 |= x1 << 8;
+    x2 |= x2 << 8;
+    x3 |= x3 << 8;
+    x0 &= 0x00FF00FF00FF00FFULL;
+    x1 &= 0x00FF00FF00FF00FFULL;
+    x2 &= 0x00FF00FF00FF00FFULL;
+    x3 &= 0x00FF00FF00FF00FFULL;
+    *q0 = x0 | (x2 << 8);
+    *q1 = x1 | (x3 << 8);
+}
+
+// Reverse of aes_bs_interleave_in
+AES_INLINE void aes_bs_interleave_out(u_int8_t block[16], u_int64_t q0, u_int64_t q1){
+    u_int64_t x0 = q0 & 0x00FF00FF00FF00FFULL;
+    u_int64_t x1 = q1 & 0x00FF00FF00FF00FFULL;
+    u_int64_t x2 = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+    u_int64_t x3 = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+
+    x0 |= x0 >> 8;
+    x1 |= x1 >> 8;
+    x2 |= x2 >> 8;
+    x3 |= x3 >> 8;
+    x0 &= 0x0000FFFF0000FFFFULL;
+    x1 &= 0x0000FFFF0000FFFFULL;
+    x2 &= 0x0000FFFF0000FFFFULL;
+    x3 &= 0x0000FFFF0000FFFFULL;
+    store_le32(block, (u_int32_t)x0 | (u_int32_t)(x0 >> 16));
+    store_le32(block + 4, (u_int32_t)x1 | (u_int32_t)(x1 >> 16));
+    store_le32(block + 8, (u_int32_t)x2 | (u_int32_t)(x2 >> 16));
+    store_le32(block + 12, (u_int32_t)x3 | (u_int32_t)(x3 >> 16));
+}
+
+// 4 blocks (64 bytes) into bitsliced form and back
+AES_INLINE void aes_bs_load(u_int64_t* q, const u_int8_t* blocks){
+    for(int i = 0; i < 4; ++i){
+        aes_bs_interleave_in(&q[i], &q[i + 4], &blocks[i * 16]);
+    }
+    aes_bs_ortho(q);
+}
+
+AES_INLINE void aes_bs_store(u_int8_t* blocks, u_int64_t* q){
+    aes_bs_ortho(q);
+    for(int i = 0; i < 4; ++i){
+        aes_bs_interleave_out(&blocks[i * 16], q[i], q[i + 4]);
+    }
+}
+
+// Bitsliced round keys - every round key copied to all 4 block positions and transposed
+void aes_bs_init_ctx(aes_ctx* ctx){
+    u_int8_t round_key[16];
+    for(int round = 0; round <= ctx->rounds; ++round){
+        for(int j = 0; j < 4; ++j){
+            u_int32_t w = ctx->enc_words[round * 4 + j];
+            round_key[j * 4] = w >> 24;
+            round_key[j * 4 + 1] = w >> 16;
+            round_key[j * 4 + 2] = w >> 8;
+            round_key[j * 4 + 3] = w;
+        }
+        u_int64_t* q = &ctx->bs_keys[round * 8];
+        for(int i = 0; i < 4; ++i){
+            aes_bs_interleave_in(&q[i], &q[i + 4], round_key);
+        }
+        aes_bs_ortho(q);
+    }
+    secure_wipe(round_key, sizeof(round_key));
+}
+
+AES_INLINE void aes_bs_add_round_key(u_int64_t* q, const u_int64_t* key){
+    for(int i = 0; i < 8; ++i){
+        q[i] ^= key[i];
+    }
+}
+
+// Every word holds 16 bits per row (4 columns x 4 blocks), rows are rotated by moving groups of 4 bits
+AES_INLINE void aes_bs_shift_rows(u_int64_t* q){
+    for(int i = 0; i < 8; ++i){
+        u_int64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+            | ((x & 0x00000000FFF00000ULL) >> 4)
+            | ((x & 0x00000000000F0000ULL) << 12)
+            | ((x & 0x0000FF0000000000ULL) >> 8)
+            | ((x & 0x000000FF00000000ULL) << 8)
+            | ((x & 0xF000000000000000ULL) >> 12)
+            | ((x & 0x0FFF000000000000ULL) << 4);
+    }
+}
+
+AES_INLINE void aes_bs_inv_shift_rows(u_int64_t* q){
+    for(int i = 0; i < 8; ++i){
+        u_int64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+            | ((x & 0x000000000FFF0000ULL) << 4)
+            | ((x & 0x00000000F0000000ULL) >> 12)
+            | ((x & 0x000000FF00000000ULL) << 8)
+            | ((x & 0x0000FF0000000000ULL) >> 8)
+            | ((x & 0x000F000000000000ULL) << 12)
+            | ((x & 0xFFF0000000000000ULL) >> 4);
+    }
+}
+
+AES_INLINE u_int64_t aes_bs_rotr32(u_int64_t x){
+    return (x << 32) | (x >> 32);
+}
+
+// MixColumns - rotating word by 16 bits moves every byte to the next row of its column,
+// multiplication by 2 is moving bit planes by one (q[7] is the carry which is reduced with 0x1b)
+AES_INLINE void aes_bs_mix_columns(u_int64_t* q){
+    u_int64_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    u_int64_t q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    u_int64_t r0 = (q0 >> 16) | (q0 << 48);
+    u_int64_t r1 = (q1 >> 16) | (q1 << 48);
+    u_int64_t r2 = (q2 >> 16) | (q2 << 48);
+    u_int64_t r3 = (q3 >> 16) | (q3 << 48);
+    u_int64_t r4 = (q4 >> 16) | (q4 << 48);
+    u_int64_t r5 = (q5 >> 16) | (q5 << 48);
+    u_int64_t r6 = (q6 >> 16) | (q6 << 48);
+    u_int64_t r7 = (q7 >> 16) | (q7 << 48);
+
+    q[0] = q7 ^ r7 ^ r0 ^ aes_bs_rotr32(q0 ^ r0);
+    q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ aes_bs_rotr32(q1 ^ r1);
+    q[2] = q1 ^ r1 ^ r2 ^ aes_bs_rotr32(q2 ^ r2);
+    q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ aes_bs_rotr32(q3 ^ r3);
+    q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ aes_bs_rotr32(q4 ^ r4);
+    q[5] = q4 ^ r4 ^ r5 ^ aes_bs_rotr32(q5 ^ r5);
+    q[6] = q5 ^ r5 ^ r6 ^ aes_bs_rotr32(q6 ^ r6);
+    q[7] = q6 ^ r6 ^ r7 ^ aes_bs_rotr32(q7 ^ r7);
+}
+
+// InvMixColumns as MixColumns of preprocessed columns (the same trick as in byte engine):
+// s0 ^= 4*(s0 ^ s2), s1 ^= 4*(s1 ^ s3), s2 ^= 4*(s0 ^ s2), s3 ^= 4*(s1 ^ s3)
+// rotating by 32 bits puts s2 under s0 (and s3 under s1), multiplication by 4 is moving bit planes by two
+AES_INLINE void aes_bs_inv_mix_columns(u_int64_t* q){
+    u_int64_t t0 = q[0] ^ aes_bs_rotr32(q[0]);
+    u_int64_t t1 = q[1] ^ aes_bs_rotr32(q[1]);
+    u_int64_t t2 = q[2] ^ aes_bs_rotr32(q[2]);
+    u_int64_t t3 = q[3] ^ aes_bs_rotr32(q[3]);
+    u_int64_t t4 = q[4] ^ aes_bs_rotr32(q[4]);
+    u_int64_t t5 = q[5] ^ aes_bs_rotr32(q[5]);
+    u_int64_t t6 = q[6] ^ aes_bs_rotr32(q[6]);
+    u_int64_t t7 = q[7] ^ aes_bs_rotr32(q[7]);
+
+    // 4*t - bits 6 and 7 go out of the top and come back reduced with 0x1b (x^4 + x^3 + x + 1)
+    q[0] ^= t6;
+    q[1] ^= t6 ^ t7;
+    q[2] ^= t0 ^ t7;
+    q[3] ^= t1 ^ t6;
+    q[4] ^= t2 ^ t6 ^ t7;
+    q[5] ^= t3 ^ t7;
+    q[6] ^= t4;
+    q[7] ^= t5;
+
+    aes_bs_mix_columns(q);
+}
+
+// Encrypting 8 blocks (128 bytes) in place as two bitsliced groups of 4
+AES_INLINE void aes_bs_encrypt_rounds(const aes_ctx* ctx, u_int8_t* blocks, const int rounds){
+    u_int64_t a[8], b[8];
+    const u_int64_t* keys = ctx->bs_keys;
+
+    aes_bs_load(a, blocks);
+    aes_bs_load(b, blocks + 64);
+    aes_bs_add_round_key(a, keys);
+    aes_bs_add_round_key(b, keys);
+
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        aes_bs_sbox(a);
+        aes_bs_sbox(b);
+        aes_bs_shift_rows(a);
+        aes_bs_shift_rows(b);
+        aes_bs_mix_columns(a);
+        aes_bs_mix_columns(b);
+        aes_bs_add_round_key(a, &keys[round * 8]);
+        aes_bs_add_round_key(b, &keys[round * 8]);
+    }
+
+    aes_bs_sbox(a);
+    aes_bs_sbox(b);
+    aes_bs_shift_rows(a);
+    aes_bs_shift_rows(b);
+    aes_bs_add_round_key(a, &keys[rounds * 8]);
+    aes_bs_add_round_key(b, &keys[rounds * 8]);
+
+    aes_bs_store(blocks, a);
+    aes_bs_store(blocks + 64, b);
+}
+
+// Decrypting 8 blocks in place - inverse steps in reverse order with the same round keys
+AES_INLINE void aes_bs_decrypt_rounds(const aes_ctx* ctx, u_int8_t* blocks, const int rounds){
+    u_int64_t a[8], b[8];
+    const u_int64_t* keys = ctx->bs_keys;
+
+    aes_bs_load(a, blocks);
+    aes_bs_load(b, blocks + 64);
+    aes_bs_add_round_key(a, &keys[rounds * 8]);
+    aes_bs_add_round_key(b, &keys[rounds * 8]);
+
+    #pragma GCC unroll 14
+    for(int round = rounds - 1; round > 0; --round){
+        aes_bs_inv_shift_rows(a);
+        aes_bs_inv_shift_rows(b);
+        aes_bs_inv_sbox(a);
+        aes_bs_inv_sbox(b);
+        aes_bs_add_round_key(a, &keys[round * 8]);
+        aes_bs_add_round_key(b, &keys[round * 8]);
+        aes_bs_inv_mix_columns(a);
+        aes_bs_inv_mix_columns(b);
+    }
+
+    aes_bs_inv_shift_rows(a);
+    aes_bs_inv_shift_rows(b);
+    aes_bs_inv_sbox(a);
+    aes_bs_inv_sbox(b);
+    aes_bs_add_round_key(a, keys);
+    aes_bs_add_round_key(b, keys);
+
+    aes_bs_store(blocks, a);
+    aes_bs_store(blocks + 64, b);
+}
+
+void aes_encrypt_8_bitslice(const aes_ctx* ctx, u_int8_t blocks[128]){
+    AES_SPECIALISE(aes_bs_encrypt_rounds, ctx, blocks)
+}
+
+void aes_decrypt_8_bitslice(const aes_ctx* ctx, u_int8_t blocks[128]){
+    AES_SPECIALISE(aes_bs_decrypt_rounds, ctx, blocks)
+}
+
+// ECB batch with bitsliced engine - last group shorter than 8 blocks is padded in local buffer,
+// so every block goes through the same constant-time code
+void aes_crypt_blocks_bitslice(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks, int decrypt){
+    void (*fn)(const aes_ctx*, u_int8_t*) = decrypt ? aes_decrypt_8_bitslice : aes_encrypt_8_bitslice;
+    size_t full = n_blocks / 8 * 8;
+
+    for(size_t i = 0; i < full; i += 8){
+        fn(ctx, &blocks[i * 16]);
+    }
+    if(full < n_blocks){
+        u_int8_t tail[128] = {0};
+        size_t tail_bytes = (n_blocks - full) * 16;
+        memcpy(tail, &blocks[full * 16], tail_bytes);
+        fn(ctx, tail);
+        memcpy(&blocks[full * 16], tail, tail_bytes);
+        secure_wipe(tail, sizeof(tail));
+    }
+}
+
+void aes_encrypt_blocks_bitslice(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    aes_crypt_blocks_bitslice(ctx, blocks, n_blocks, 0);
+}
+
+void aes_decrypt_blocks_bitslice(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    aes_crypt_blocks_bitslice(ctx, blocks, n_blocks, 1);
+}
+
+// Single block through bitsliced engine (7 of 8 lanes wasted - for tests and benchmark)
+void aes_encrypt_block_bitslice(const aes_ctx* ctx, u_int8_t message[16]){
+    aes_crypt_blocks_bitslice(ctx, message, 1, 0);
+}
+
+void aes_decrypt_block_bitslice(const aes_ctx* ctx, u_int8_t cipher[16]){
+    aes_crypt_blocks_bitslice(ctx, cipher, 1, 1);
+}
+
+// Multi-key bitsliced encryption (one key per block, used by batch CBC)
+/*
+Replicated round key has the same bits in positions of all 4 blocks, so the key of block i
+is taken from its positions with lane mask and keys of 4 blocks are merged into one set of planes
+Masks are found once by loading block of ones in one position and zeros in the others
+*/
+u_int64_t aes_bs_lane_mask[4];
+
+void aes_bs_generate_lane_masks(void){
+    for(int i = 0; i < 4; ++i){
+        u_int8_t blocks[64] = {0};
+        u_int64_t q[8];
+        memset(&blocks[i * 16], 0xFF, 16);
+        aes_bs_load(q, blocks);
+        aes_bs_lane_mask[i] = q[0];
+    }
+}
+
+AES_INLINE void aes_bs_lane_keys(u_int64_t* k, const aes_ctx* const* ctxs, int round){
+    for(int i = 0; i < 8; ++i){
+        k[i] = (ctxs[0]->bs_keys[round * 8 + i] & aes_bs_lane_mask[0])
+            | (ctxs[1]->bs_keys[round * 8 + i] & aes_bs_lane_mask[1])
+            | (ctxs[2]->bs_keys[round * 8 + i] & aes_bs_lane_mask[2])
+            | (ctxs[3]->bs_keys[round * 8 + i] & aes_bs_lane_mask[3]);
+    }
+}
+
+// 8 blocks, block j encrypted with ctxs[j] - all keys have to have the same size
+AES_INLINE void aes_bs_encrypt_lanes_rounds(const aes_ctx* const* ctxs, u_int8_t* blocks, const int rounds){
+    u_int64_t a[8], b[8], ka[8], kb[8];
+
+    aes_bs_load(a, blocks);
+    aes_bs_load(b, blocks + 64);
+    aes_bs_lane_keys(ka, ctxs, 0);
+    aes_bs_lane_keys(kb, ctxs + 4, 0);
+    aes_bs_add_round_key(a, ka);
+    aes_bs_add_round_key(b, kb);
+
+    #pragma GCC unroll 14
+    for(int round = 1; round <= rounds; ++round){
+        aes_bs_sbox(a);
+        aes_bs_sbox(b);
+        aes_bs_shift_rows(a);
+        aes_bs_shift_rows(b);
+        if(round != rounds){
+            aes_bs_mix_columns(a);
+            aes_bs_mix_columns(b);
+        }
+        aes_bs_lane_keys(ka, ctxs, round);
+        aes_bs_lane_keys(kb, ctxs + 4, round);
+        aes_bs_add_round_key(a, ka);
+        aes_bs_add_round_key(b, kb);
+    }
+
+    aes_bs_store(blocks, a);
+    aes_bs_store(blocks + 64, b);
+}
+
+void aes_encrypt_lanes_bitslice(const aes_ctx* const* ctxs, u_int8_t blocks[128]){
+    const aes_ctx* ctx = ctxs[0];
+    AES_SPECIALISE(aes_bs_encrypt_lanes_rounds, ctxs, blocks)
+}
+
+// AES-NI backend
+/*
+Modern x86 CPUs have instructions doing whole AES round on 128-bit register:
+- AESENC - SubBytes, ShiftRows, MixColumns and AddRoundKey
+- AESENCLAST - the same without MixColumns (final round)
+- AESDEC / AESDECLAST - the same for equivalent inverse cipher
+- AESKEYGENASSIST - SubWord, RotWord and Rcon for key expansion
+- AESIMC - InvMixColumns for converting encryption round keys into decryption ones
+Functions below are compiled for AES-NI with target attribute, so the rest of the program still runs
+on CPUs without it - they are called only when CPUID says instructions are available
+*/
+#ifdef AES_X86
+// Checking CPUID leaf 1 - ECX bit 25 is AES-NI
+int aes_cpu_has_ni(void){
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0){
+        return 0;
+    }
+    return (ecx & bit_AES) != 0;
+}
+
+// ECX bit 1 is PCLMULQDQ, bit 9 is SSSE3
+int aes_cpu_has_pclmul(void){
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0){
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSSE3) != 0;
+}
+
+// One step of key expansion
+// word contains new word (already after SubWord, RotWord and Rcon) broadcast to all 4 positions,
+// we XOR it with prefix XOR of previous round key (w0, w0^w1, w0^w1^w2, w0^w1^w2^w3)
+__attribute__((target("aes,sse2")))
+__m128i aes_ni_expand_step(__m128i key, __m128i word){
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, word);
+}
+
+// AESKEYGENASSIST gives RotWord(SubWord(w3)) ^ Rcon in its highest word and SubWord(w2) in the third one
+// Rcon has to be immediate value, so these are macros and every round is written out
+#define NI_ASSIST(key, rcon) _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, rcon), 0xFF)
+#define NI_ASSIST_SUB(key) _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, 0x00), 0xAA)
+
+// Key expansion with AESKEYGENASSIST
+/*
+- AES-128 - every round key comes from previous one
+- AES-256 - round keys come in pairs, the second one of a pair uses SubWord without rotation and Rcon
+- AES-192 - 6 word steps don't line up with 128-bit registers, so we take words from portable
+  key expansion (it's done once per key, so it costs nothing per block)
+*/
+__attribute__((target("aes,sse2")))
+void aes_ni_init_ctx(aes_ctx* ctx, const u_int8_t* key, int key_bytes, int decrypt){
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    int rounds = ctx->rounds;
+
+    if(key_bytes == 16){
+        rk[0] = _mm_loadu_si128((const __m128i*)key);
+        rk[1] = aes_ni_expand_step(rk[0], NI_ASSIST(rk[0], 0x01));
+        rk[2] = aes_ni_expand_step(rk[1], NI_ASSIST(rk[1], 0x02));
+        rk[3] = aes_ni_expand_step(rk[2], NI_ASSIST(rk[2], 0x04));
+        rk[4] = aes_ni_expand_step(rk[3], NI_ASSIST(rk[3], 0x08));
+        rk[5] = aes_ni_expand_step(rk[4], NI_ASSIST(rk[4], 0x10));
+        rk[6] = aes_ni_expand_step(rk[5], NI_ASSIST(rk[5], 0x20));
+        rk[7] = aes_ni_expand_step(rk[6], NI_ASSIST(rk[6], 0x40));
+        rk[8] = aes_ni_expand_step(rk[7], NI_ASSIST(rk[7], 0x80));
+        rk[9] = aes_ni_expand_step(rk[8], NI_ASSIST(rk[8], 0x1B));
+        rk[10] = aes_ni_expand_step(rk[9], NI_ASSIST(rk[9], 0x36));
+    }
+    else if(key_bytes == 32){
+        rk[0] = _mm_loadu_si128((const __m128i*)key);
+        rk[1] = _mm_loadu_si128((const __m128i*)(key + 16));
+        rk[2] = aes_ni_expand_step(rk[0], NI_ASSIST(rk[1], 0x01));
+        rk[3] = aes_ni_expand_step(rk[1], NI_ASSIST_SUB(rk[2]));
+        rk[4] = aes_ni_expand_step(rk[2], NI_ASSIST(rk[3], 0x02));
+        rk[5] = aes_ni_expand_step(rk[3], NI_ASSIST_SUB(rk[4]));
+        rk[6] = aes_ni_expand_step(rk[4], NI_ASSIST(rk[5], 0x04));
+        rk[7] = aes_ni_expand_step(rk[5], NI_ASSIST_SUB(rk[6]));
+        rk[8] = aes_ni_expand_step(rk[6], NI_ASSIST(rk[7], 0x08));
+        rk[9] = aes_ni_expand_step(rk[7], NI_ASSIST_SUB(rk[8]));
+        rk[10] = aes_ni_expand_step(rk[8], NI_ASSIST(rk[9], 0x10));
+        rk[11] = aes_ni_expand_step(rk[9], NI_ASSIST_SUB(rk[10]));
+        rk[12] = aes_ni_expand_step(rk[10], NI_ASSIST(rk[11], 0x20));
+        rk[13] = aes_ni_expand_step(rk[11], NI_ASSIST_SUB(rk[12]));
+        rk[14] = aes_ni_expand_step(rk[12], NI_ASSIST(rk[13], 0x40));
+    }
+    else {
+        for(int i = 0; i <= rounds; ++i){
+            u_int8_t bytes[16];
+            for(int j = 0; j < 4; ++j){
+                store_be32(&bytes[j * 4], ctx->enc_words[i * 4 + j]);
+            }
+            rk[i] = _mm_loadu_si128((const __m128i*)bytes);
+        }
+    }
+
+    for(int i = 0; i <= rounds; ++i){
+        _mm_storeu_si128((__m128i*)&ctx->ni_enc_keys[i * 16], rk[i]);
+    }
+    if(!decrypt){
+        return;
+    }
+
+    // Decryption keys are in reversed order and middle ones go through InvMixColumns (AESIMC)
+    for(int i = 0; i <= rounds; ++i){
+        __m128i dk = rk[rounds - i];
+        if(i != 0 && i != rounds){
+            dk = _mm_aesimc_si128(dk);
+        }
+        _mm_storeu_si128((__m128i*)&ctx->ni_dec_keys[i * 16], dk);
+    }
+}
+
+// Encrypting one 16 bytes data block with AES-NI
+__attribute__((target("aes,sse2")))
+AES_INLINE void aes_encrypt_ni_rounds(const aes_ctx* ctx, u_int8_t message[16], const int rounds){
+    const __m128i* rk = (const __m128i*)ctx->ni_enc_keys;
+    __m128i state = _mm_loadu_si128((const __m128i*)message);
+
+    state = _mm_xor_si128(state, _mm_loadu_si128(&rk[0]));
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(&rk[round]));
+    }
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(&rk[rounds]));
+
+    _mm_storeu_si128((__m128i*)message, state);
+}
+
+__attribute__((target("aes,sse2")))
+void aes_encrypt_block_ni(const aes_ctx* ctx, u_int8_t message[16]){
+    AES_SPECIALISE(aes_encrypt_ni_rounds, ctx, message)
+}
+
+// Decrypting one 16 bytes data block with AES-NI
+__attribute__((target("aes,sse2")))
+AES_INLINE void aes_decrypt_ni_rounds(const aes_ctx* ctx, u_int8_t cipher[16], const int rounds){
+    const __m128i* rk = (const __m128i*)ctx->ni_dec_keys;
+    __m128i state = _mm_loadu_si128((const __m128i*)cipher);
+
+    state = _mm_xor_si128(state, _mm_loadu_si128(&rk[0]));
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        state = _mm_aesdec_si128(state, _mm_loadu_si128(&rk[round]));
+    }
+    state = _mm_aesdeclast_si128(state, _mm_loadu_si128(&rk[rounds]));
+
+    _mm_storeu_si128((__m128i*)cipher, state);
+}
+
+__attribute__((target("aes,sse2")))
+void aes_decrypt_block_ni(const aes_ctx* ctx, u_int8_t cipher[16]){
+    AES_SPECIALISE(aes_decrypt_ni_rounds, ctx, cipher)
+}
+
+// Encrypting many independent blocks at once (ECB batch)
+// AESENC has few cycles of latency but CPU can start a new one every cycle,
+// so 8 blocks are kept in flight and every round key is applied to all of them before moving on
+// Loops over the 8 blocks are unrolled as well - otherwise compiler keeps b[] on stack
+// and every AESENC waits for store and load of its block
+__attribute__((target("aes,sse2")))
+AES_INLINE void aes_encrypt_blocks_ni_rounds(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks, const int rounds){
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    for(int i = 0; i <= rounds; ++i){
+        rk[i] = _mm_loadu_si128((const __m128i*)&ctx->ni_enc_keys[i * 16]);
+    }
+
+    size_t i = 0;
+    for(; i + 8 <= n_blocks; i += 8){
+        __m128i* p = (__m128i*)&blocks[i * 16];
+        __m128i b[8];
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            b[j] = _mm_xor_si128(_mm_loadu_si128(&p[j]), rk[0]);
+        }
+        #pragma GCC unroll 14
+        for(int round = 1; round < rounds; ++round){
+            #pragma GCC unroll 8
+            for(int j = 0; j < 8; ++j){
+                b[j] = _mm_aesenc_si128(b[j], rk[round]);
+            }
+        }
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            _mm_storeu_si128(&p[j], _mm_aesenclast_si128(b[j], rk[rounds]));
+        }
+    }
+
+    // Rest of blocks one by one
+    for(; i < n_blocks; ++i){
+        aes_encrypt_ni_rounds(ctx, &blocks[i * 16], rounds);
+    }
+}
+
+__attribute__((target("aes,sse2")))
+void aes_encrypt_blocks_ni(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    AES_SPECIALISE(aes_encrypt_blocks_ni_rounds, ctx, blocks, n_blocks)
+}
+
+// Decrypting many independent blocks at once - the same 8 blocks in flight as for encryption
+__attribute__((target("aes,sse2")))
+AES_INLINE void aes_decrypt_blocks_ni_rounds(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks, const int rounds){
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    for(int i = 0; i <= rounds; ++i){
+        rk[i] = _mm_loadu_si128((const __m128i*)&ctx->ni_dec_keys[i * 16]);
+    }
+
+    size_t i = 0;
+    for(; i + 8 <= n_blocks; i += 8){
+        __m128i* p = (__m128i*)&blocks[i * 16];
+        __m128i b[8];
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            b[j] = _mm_xor_si128(_mm_loadu_si128(&p[j]), rk[0]);
+        }
+        #pragma GCC unroll 14
+        for(int round = 1; round < rounds; ++round){
+            #pragma GCC unroll 8
+            for(int j = 0; j < 8; ++j){
+                b[j] = _mm_aesdec_si128(b[j], rk[round]);
+            }
+        }
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            _mm_storeu_si128(&p[j], _mm_aesdeclast_si128(b[j], rk[rounds]));
+        }
+    }
+
+    for(; i < n_blocks; ++i){
+        aes_decrypt_ni_rounds(ctx, &blocks[i * 16], rounds);
+    }
+}
+
+__attribute__((target("aes,sse2")))
+void aes_decrypt_blocks_ni(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    AES_SPECIALISE(aes_decrypt_blocks_ni_rounds, ctx, blocks, n_blocks)
+}
+
+// 8 blocks with 8 different keys (of the same size) - round key of every block is read from its context,
+// so independent messages keep AES unit as busy as 8 blocks of one message
+__attribute__((target("aes,sse2")))
+AES_INLINE void aes_encrypt_lanes_ni_rounds(const aes_ctx* const* ctxs, u_int8_t* blocks, const int rounds){
+    __m128i* p = (__m128i*)blocks;
+    __m128i b[8];
+    #pragma GCC unroll 8
+    for(int j = 0; j < 8; ++j){
+        b[j] = _mm_xor_si128(_mm_loadu_si128(&p[j]), _mm_loadu_si128((const __m128i*)ctxs[j]->ni_enc_keys));
+    }
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            b[j] = _mm_aesenc_si128(b[j], _mm_loadu_si128((const __m128i*)&ctxs[j]->ni_enc_keys[round * 16]));
+        }
+    }
+    #pragma GCC unroll 8
+    for(int j = 0; j < 8; ++j){
+        _mm_storeu_si128(&p[j], _mm_aesenclast_si128(b[j], _mm_loadu_si128((const __m128i*)&ctxs[j]->ni_enc_keys[rounds * 16])));
+    }
+}
+
+__attribute__((target("aes,sse2")))
+void aes_encrypt_lanes_ni(const aes_ctx* const* ctxs, u_int8_t blocks[128]){
+    const aes_ctx* ctx = ctxs[0];
+    AES_SPECIALISE(aes_encrypt_lanes_ni_rounds, ctxs, blocks)
+}
+#else
+// Without x86 there is no AES-NI - these are never called because aes_use_ni stays 0
+int aes_cpu_has_ni(void){
+    return 0;
+}
+
+int aes_cpu_has_pclmul(void){
+    return 0;
+}
+
+void aes_ni_init_ctx(aes_ctx* ctx, const u_int8_t* key, int key_bytes, int decrypt){
+    (void)ctx;
+    (void)key;
+    (void)key_bytes;
+    (void)decrypt;
+}
+
+void aes_encrypt_block_ni(const aes_ctx* ctx, u_int8_t message[16]){
+    aes_encrypt_block_ttable(ctx, message);
+}
+
+void aes_decrypt_block_ni(const aes_ctx* ctx, u_int8_t cipher[16]){
+    aes_decrypt_block_ttable(ctx, cipher);
+}
+
+void aes_encrypt_blocks_ni(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    for(size_t i = 0; i < n_blocks; ++i){
+        aes_encrypt_block_ttable(ctx, &blocks[i * 16]);
+    }
+}
+
+void aes_decrypt_blocks_ni(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    for(size_t i = 0; i < n_blocks; ++i){
+        aes_decrypt_block_ttable(ctx, &blocks[i * 16]);
+    }
+}
+
+void aes_encrypt_lanes_ni(const aes_ctx* const* ctxs, u_int8_t blocks[128]){
+    for(int j = 0; j < 8; ++j){
+        aes_encrypt_block_ttable(ctxs[j], &blocks[j * 16]);
+    }
+}
+#endif
+
+void aes_global_setup(void){
+    aes_generate_tables();
+    aes_bs_generate_lane_masks();
+    aes_use_ni = aes_cpu_has_ni();
+    aes_use_pclmul = aes_cpu_has_pclmul();
+}
+
+// Block functions used by modes
+// AES-NI is used when CPU has it, otherwise portable engine picked at compile time with AES_TTABLE
+void aes_encrypt_block(const aes_ctx* ctx, u_int8_t message[16]){
+    AES_PROF_BEGIN();
+    if(aes_use_ni){
+        aes_encrypt_block_ni(ctx, message);
+    }
+    else {
+#ifdef AES_TTABLE
+        aes_encrypt_block_ttable(ctx, message);
+#else
+        aes_encrypt_block_bytes(ctx, message);
+#endif
+    }
+    AES_PROF_END(AES_PROF_BLOCK_ENCRYPT, 16);
+}
+
+void aes_decrypt_block(const aes_ctx* ctx, u_int8_t cipher[16]){
+    AES_PROF_BEGIN();
+    if(aes_use_ni){
+        aes_decrypt_block_ni(ctx, cipher);
+    }
+    else {
+#ifdef AES_TTABLE
+        aes_decrypt_block_ttable(ctx, cipher);
+#else
+        aes_decrypt_block_bytes(ctx, cipher);
+#endif
+    }
+    AES_PROF_END(AES_PROF_BLOCK_DECRYPT, 16);
+}
+
+// Encrypting n_blocks independent blocks in place (ECB batch) - used by parallel modes
+void aes_encrypt_blocks(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    AES_PROF_BEGIN();
+    if(aes_use_ni){
+        aes_encrypt_blocks_ni(ctx, blocks, n_blocks);
+    }
+    else {
+#ifdef AES_TTABLE
+        for(size_t i = 0; i < n_blocks; ++i){
+            aes_encrypt_block_ttable(ctx, &blocks[i * 16]);
+        }
+#else
+        aes_encrypt_blocks_bitslice(ctx, blocks, n_blocks);
+#endif
+    }
+    AES_PROF_END(AES_PROF_BLOCKS_ENCRYPT, n_blocks * 16);
+}
+
+// Decrypting n_blocks independent blocks in place (ECB batch)
+void aes_decrypt_blocks(const aes_ctx* ctx, u_int8_t* blocks, size_t n_blocks){
+    AES_PROF_BEGIN();
+    if(aes_use_ni){
+        aes_decrypt_blocks_ni(ctx, blocks, n_blocks);
+    }
+    else {
+#ifdef AES_TTABLE
+        for(size_t i = 0; i < n_blocks; ++i){
+            aes_decrypt_block_ttable(ctx, &blocks[i * 16]);
+        }
+#else
+        aes_decrypt_blocks_bitslice(ctx, blocks, n_blocks);
+#endif
+    }
+    AES_PROF_END(AES_PROF_BLOCKS_DECRYPT, n_blocks * 16);
+}
+
+// Encrypting 8 blocks where block j uses key ctxs[j] (all keys of the same size)
+void aes_encrypt_lanes(const aes_ctx* const* ctxs, u_int8_t blocks[128]){
+    if(aes_use_ni){
+        aes_encrypt_lanes_ni(ctxs, blocks);
+        return;
+    }
+#ifdef AES_TTABLE
+    for(int j = 0; j < 8; ++j){
+        aes_encrypt_block_ttable(ctxs[j], &blocks[j * 16]);
+    }
+#else
+    aes_encrypt_lanes_bitslice(ctxs, blocks);
+#endif
+}
+
+// Encrypting one 16 bytes data block
+// Thin wrapper for callers which have only raw key - for many blocks use aes_ctx directly
+void aes_encrypt_128(const u_int8_t* key, u_int8_t message[16]){
+    aes_ctx ctx;
+    aes_init_ctx_enc(&ctx, key, 16);
+    aes_encrypt_block(&ctx, message);
+    aes_clear_ctx(&ctx);
+}
+
+// Decrypting one 16 bytes data block
+void aes_decrypt_128(const u_int8_t* key, u_int8_t cipher[16]){
+    aes_ctx ctx;
+    aes_init_ctx_128(&ctx, key);
+    aes_decrypt_block(&ctx, cipher);
+    aes_clear_ctx(&ctx);
+}
+
+// Function to print data as hex
+void print_hex(unsigned char* data, int len) {
+    for (int i = 0; i < len; ++i) {
+        printf("%02x", data[i]);
+    }
+    putchar('\n');
+}
+
+// Random IVs and nonces
+/*
+Opening /dev/urandom for every message costs three syscalls and FILE allocation, so IVs come from
+AES-256 CTR_DRBG (NIST SP 800-90A, without derivation function) built on our block cipher:
+- seed (48 bytes - key and counter V) is read once with getrandom()
+- every refill encrypts V+1, V+2, ... into buffer of IV_POOL_BYTES (256 IVs) with batch functions,
+  then key and V are replaced with next 48 bytes of keystream, so old output can't be recomputed
+- IVs are handed out from the buffer - no syscall and no lock on the common path
+Every thread has its own generator (thread local), so threads never wait for each other
+After fork child would give the same IVs as parent, so fork handler makes every generator reseed
+Thread local memory is freed without clearing when thread exits, so destructor of a pthread key
+wipes key, V and unused output of the exiting thread's generator
+*/
+#define IV_POOL_BYTES 4096
+// Reseeding from the OS after this many refills (SP 800-90A allows 2^48 requests)
+#define IV_POOL_RESEED_INTERVAL (1 << 20)
+
+typedef struct {
+    aes_ctx ctx;
+    u_int8_t v[16];
+    u_int8_t buf[IV_POOL_BYTES];
+    size_t pos;
+    u_int64_t refills;
+    unsigned int generation;
+    int seeded;
+} aes_drbg;
+
+__thread aes_drbg aes_drbg_state;
+// Changed in child after fork - generators with older generation reseed before giving anything
+volatile unsigned int aes_drbg_generation = 0;
+pthread_once_t aes_drbg_once = PTHREAD_ONCE_INIT;
+// Value of the key is generator of the thread, set when it's seeded for the first time
+pthread_key_t aes_drbg_key;
+int aes_drbg_key_ok = 0;
+
+void aes_drbg_after_fork(void){
+    ++aes_drbg_generation;
+}
+
+// Called at thread exit for threads which used their generator
+void aes_drbg_thread_exit(void* state){
+    secure_wipe(state, sizeof(aes_drbg));
+}
+
+void aes_drbg_global_setup(void){
+    pthread_atfork(NULL, NULL, aes_drbg_after_fork);
+    aes_drbg_key_ok = pthread_key_create(&aes_drbg_key, aes_drbg_thread_exit) == 0;
+}
+
+// Reading bytes from kernel CSPRNG, /dev/urandom is used only when getrandom() isn't available
+int aes_os_random(u_int8_t* out, size_t bytes){
+    size_t done = 0;
+    while(done < bytes){
+        ssize_t n = getrandom(out + done, bytes - done, 0);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    if(done == bytes){
+        return 0;
+    }
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        perror("Error while opening /dev/urandom");
+        return -1;
+    }
+    while(done < bytes){
+        ssize_t n = read(fd, out + done, bytes - done);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            perror("Error while reading random data");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+    return 0;
+}
+
+// V + 1 as 128-bit big endian number
+void aes_drbg_inc(u_int8_t v[16]){
+    for(int j = 15; j >= 0; --j){
+        if(++v[j] != 0){
+            break;
+        }
+    }
+}
+
+// CTR_DRBG_Update - new key and V are the next 48 bytes of keystream XOR-ed with provided data
+void aes_drbg_update(aes_drbg* d, const u_int8_t provided[48]){
+    u_int8_t temp[48];
+    for(int b = 0; b < 3; ++b){
+        aes_drbg_inc(d->v);
+        memcpy(&temp[b * 16], d->v, 16);
+    }
+    aes_encrypt_blocks(&d->ctx, temp, 3);
+    for(int j = 0; j < 48; ++j){
+        temp[j] ^= provided[j];
+    }
+    // DRBG only encrypts, so decryption schedules would be thrown away on every re-key
+    aes_init_ctx_enc(&d->ctx, temp, 32);
+    memcpy(d->v, &temp[32], 16);
+    secure_wipe(temp, sizeof(temp));
+}
+
+// Instantiate / reseed - key and V start from zeros (or current state) and are mixed with OS entropy
+int aes_drbg_seed(aes_drbg* d){
+    u_int8_t seed[48];
+    if(aes_os_random(seed, sizeof(seed)) == -1){
+        return -1;
+    }
+    if(!d->seeded){
+        u_int8_t zero_key[32] = {0};
+        aes_init_ctx_enc(&d->ctx, zero_key, 32);
+        memset(d->v, 0, 16);
+        if(aes_drbg_key_ok){
+            pthread_setspecific(aes_drbg_key, d);
+        }
+    }
+    aes_drbg_update(d, seed);
+    secure_wipe(seed, sizeof(seed));
+
+    d->seeded = 1;
+    d->refills = 0;
+    d->generation = aes_drbg_generation;
+    return 0;
+}
+
+// Generating next IV_POOL_BYTES of output
+int aes_drbg_refill(aes_drbg* d){
+    if(!d->seeded || d->generation != aes_drbg_generation || d->refills >= IV_POOL_RESEED_INTERVAL){
+        pthread_once(&aes_drbg_once, aes_drbg_global_setup);
+        if(aes_drbg_seed(d) == -1){
+            return -1;
+        }
+    }
+
+    for(size_t b = 0; b < IV_POOL_BYTES / 16; ++b){
+        aes_drbg_inc(d->v);
+        memcpy(&d->buf[b * 16], d->v, 16);
+    }
+    aes_encrypt_blocks(&d->ctx, d->buf, IV_POOL_BYTES / 16);
+
+    u_int8_t zeros[48] = {0};
+    aes_drbg_update(d, zeros);
+    d->pos = 0;
+    ++d->refills;
+    return 0;
+}
+
+// Filling out with random bytes from generator of calling thread, returns 0 or -1
+int random_bytes(u_int8_t* out, size_t bytes){
+    aes_drbg* d = &aes_drbg_state;
+    // Buffer filled before fork can't be used in child
+    if(d->seeded && d->generation != aes_drbg_generation){
+        d->pos = IV_POOL_BYTES;
+    }
+
+    while(bytes > 0){
+        if(!d->seeded || d->pos == IV_POOL_BYTES){
+            if(aes_drbg_refill(d) == -1){
+                return -1;
+            }
+        }
+        size_t n = IV_POOL_BYTES - d->pos;
+        if(n > bytes){
+            n = bytes;
+        }
+        memcpy(out, &d->buf[d->pos], n);
+        // Output which was given away doesn't stay in memory
+        secure_wipe(&d->buf[d->pos], n);
+        d->pos += n;
+        out += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+// Random 16 bytes IV, returns 0 or -1
+int generate_iv(u_int8_t iv_vector[16]){
+    AES_PROF_BEGIN();
+    int ret = random_bytes(iv_vector, 16);
+    AES_PROF_END(AES_PROF_GENERATE_IV, 16);
+    return ret;
+}
+
+// Running n_jobs jobs of job_size bytes each in parallel
+// Job 0 is done by calling thread, the rest get their own threads
+// If thread can't be created its job is done by calling thread, so result is always complete
+int aes_run_jobs(void* (*worker)(void*), void* jobs, size_t job_size, int n_jobs){
+    u_int8_t* job = (u_int8_t*)jobs;
+    if(n_jobs <= 1){
+        worker(job);
+        return 0;
+    }
+
+    pthread_t* tids = malloc(sizeof(pthread_t) * n_jobs);
+    if(tids == NULL){
+        perror("Error while allocating memory");
+        return -1;
+    }
+
+    int created = 0, ret = 0;
+    for(int t = 1; t < n_jobs; ++t){
+        if(pthread_create(&tids[created], NULL, worker, job + t * job_size) != 0){
+            perror("pthread_create");
+            worker(job + t * job_size);
+            continue;
+        }
+        ++created;
+    }
+    worker(job);
+
+    for(int t = 0; t < created; ++t){
+        if(pthread_join(tids[t], NULL) != 0){
+            perror("pthread_join");
+            ret = -1;
+        }
+    }
+
+    free(tids);
+    return ret;
+}
+
+// Key schedule cache
+/*
+Services which encrypt for many tenants get raw keys, and expanding key for every message
+(key_expansion, inverse schedule, AES-NI and bitsliced schedules) costs more than encrypting short message
+Cache keeps expanded contexts of recently used keys:
+- hash table from raw key bytes to entry, keys are compared in constant time
+- entries are in LRU list (most recently used at head), when cache is full the least recently used
+  entry which nobody uses at the moment is evicted and its key and schedules are wiped
+- key_cache_acquire gives context which stays valid (isn't evicted) until key_cache_release
+- hit / miss / eviction counters show if cache is big enough for the workload
+
+One mutex protects lookups and lists - hit is only a few pointer updates, so it's held very shortly
+On miss entry is claimed under the mutex (in hash table and held, marked as filling), key is expanded
+without the mutex and entry is published afterwards - only threads which want the same key wait for it
+Hash is keyed with random seed, so bucket of a key can't be predicted from outside
+*/
+typedef struct key_cache_entry {
+    aes_ctx ctx;
+    u_int8_t key[32];
+    int key_bytes;
+    // Number of users between acquire and release - such entry can't be evicted
+    int refs;
+    // Set (under the mutex) while context is being expanded outside of the mutex
+    int filling;
+    u_int64_t hash;
+    struct key_cache_entry* hash_next;
+    struct key_cache_entry* lru_prev;
+    struct key_cache_entry* lru_next;
+} key_cache_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    // Signalled when filling entry gets its context
+    pthread_cond_t filled;
+    key_cache_entry* entries;
+    size_t capacity;
+    size_t used;
+    key_cache_entry** buckets;
+    size_t bucket_mask;
+    // Most recently used entry is head, eviction starts from tail
+    key_cache_entry* lru_head;
+    key_cache_entry* lru_tail;
+    u_int64_t seed[2];
+    u_int64_t hits;
+    u_int64_t misses;
+    u_int64_t evictions;
+} key_cache;
+
+// Preparing cache for capacity keys, returns 0 or -1
+int key_cache_init(key_cache* c, size_t capacity){
+    memset(c, 0, sizeof(*c));
+    if(capacity == 0){
+        fprintf(stderr, "Err: Cache capacity has to be at least 1\n");
+        return -1;
+    }
+
+    // Power of 2 buckets, at least two per entry so chains stay short
+    size_t buckets = 1;
+    while(buckets < 2 * capacity){
+        buckets <<= 1;
+    }
+    c->entries = calloc(capacity, sizeof(key_cache_entry));
+    c->buckets = calloc(buckets, sizeof(key_cache_entry*));
+    if(c->entries == NULL || c->buckets == NULL){
+        perror("Error while allocating memory");
+        free(c->entries);
+        free(c->buckets);
+        return -1;
+    }
+    if(random_bytes((u_int8_t*)c->seed, sizeof(c->seed)) == -1){
+        free(c->entries);
+        free(c->buckets);
+        return -1;
+    }
+
+    c->capacity = capacity;
+    c->bucket_mask = buckets - 1;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->filled, NULL);
+    return 0;
+}
+
+// Wiping every cached schedule - no context from this cache can be used after it
+void key_cache_destroy(key_cache* c){
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->filled);
+    secure_wipe(c->entries, c->capacity * sizeof(key_cache_entry));
+    free(c->entries);
+    free(c->buckets);
+    secure_wipe(c, sizeof(*c));
+}
+
+// Keyed hash of raw key - every 8 bytes are mixed in with multiplication and xor-shift
+u_int64_t key_cache_hash(const key_cache* c, const u_int8_t* key, int key_bytes){
+    u_int64_t h = c->seed[0] ^ (u_int64_t)key_bytes;
+    for(int i = 0; i < key_bytes; i += 8){
+        u_int64_t w;
+        memcpy(&w, &key[i], 8);
+        h = (h ^ w ^ c->seed[1]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Comparing keys without early exit - time doesn't tell how many first bytes matched
+int key_cache_equal(const u_int8_t* a, const u_int8_t* b, int bytes){
+    u_int8_t diff = 0;
+    for(int i = 0; i < bytes; ++i){
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+void key_cache_lru_unlink(key_cache* c, key_cache_entry* e){
+    if(e->lru_prev != NULL){
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else {
+        c->lru_head = e->lru_next;
+    }
+    if(e->lru_next != NULL){
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else {
+        c->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+void key_cache_lru_push(key_cache* c, key_cache_entry* e){
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if(c->lru_head != NULL){
+        c->lru_head->lru_prev = e;
+    }
+    c->lru_head = e;
+    if(c->lru_tail == NULL){
+        c->lru_tail = e;
+    }
+}
+
+void key_cache_hash_remove(key_cache* c, key_cache_entry* e){
+    key_cache_entry** link = &c->buckets[e->hash & c->bucket_mask];
+    while(*link != e){
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+    e->hash_next = NULL;
+}
+
+// Getting expanded context for raw key (16, 24 or 32 bytes), expanding it only on miss
+// Context stays valid until key_cache_release, returns NULL on wrong key size
+// or when every entry is in use (cache has to be bigger than number of contexts held at once)
+const aes_ctx* key_cache_acquire(key_cache* c, const u_int8_t* key, int key_bytes){
+    if(key_bytes != 16 && key_bytes != 24 && key_bytes != 32){
+        fprintf(stderr, "Err: Key has to be 16, 24 or 32 bytes long\n");
+        return NULL;
+    }
+    u_int64_t hash = key_cache_hash(c, key, key_bytes);
+
+    pthread_mutex_lock(&c->lock);
+    key_cache_entry* e = c->buckets[hash & c->bucket_mask];
+    while(e != NULL && !(e->hash == hash && e->key_bytes == key_bytes && key_cache_equal(e->key, key, key_bytes))){
+        e = e->hash_next;
+    }
+
+    if(e != NULL){
+        ++c->hits;
+        // Moving to the front of LRU list
+        if(c->lru_head != e){
+            key_cache_lru_unlink(c, e);
+            key_cache_lru_push(c, e);
+        }
+        // Held entry can't be evicted, so after waiting it still has our key
+        __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+        while(e->filling){
+            pthread_cond_wait(&c->filled, &c->lock);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return &e->ctx;
+    }
+
+    ++c->misses;
+    if(c->used < c->capacity){
+        e = &c->entries[c->used++];
+    }
+    else {
+        // The least recently used entry which isn't held by anybody
+        e = c->lru_tail;
+        while(e != NULL && __atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) > 0){
+            e = e->lru_prev;
+        }
+        if(e == NULL){
+            pthread_mutex_unlock(&c->lock);
+            fprintf(stderr, "Err: Every key cache entry is in use\n");
+            return NULL;
+        }
+        ++c->evictions;
+        key_cache_hash_remove(c, e);
+        key_cache_lru_unlink(c, e);
+        secure_wipe(e->key, sizeof(e->key));
+    }
+
+    // Claiming entry - other threads looking for this key find it and wait until it's filled
+    memcpy(e->key, key, key_bytes);
+    e->key_bytes = key_bytes;
+    e->hash = hash;
+    e->filling = 1;
+    __atomic_store_n(&e->refs, 1, __ATOMIC_RELAXED);
+    e->hash_next = c->buckets[hash & c->bucket_mask];
+    c->buckets[hash & c->bucket_mask] = e;
+    key_cache_lru_push(c, e);
+    pthread_mutex_unlock(&c->lock);
+
+    // Old schedule is wiped and the new one expanded without blocking other keys
+    secure_wipe(&e->ctx, sizeof(e->ctx));
+    aes_init_ctx(&e->ctx, key, key_bytes);
+
+    pthread_mutex_lock(&c->lock);
+    e->filling = 0;
+    pthread_cond_broadcast(&c->filled);
+    pthread_mutex_unlock(&c->lock);
+    return &e->ctx;
+}
+
+// Giving back context from key_cache_acquire - entry can be evicted again
+// Counter is only increased under the mutex, so decreasing it doesn't need the mutex -
+// eviction either still sees the entry as used or sees it after we stopped using it
+void key_cache_release(key_cache* c, const aes_ctx* ctx){
+    (void)c;
+    // ctx is the first field, so entry starts at the same address
+    key_cache_entry* e = (key_cache_entry*)ctx;
+    __atomic_fetch_sub(&e->refs, 1, __ATOMIC_RELEASE);
+}
+
+// Reading counters (any pointer can be NULL)
+void key_cache_stats(key_cache* c, u_int64_t* hits, u_int64_t* misses, u_int64_t* evictions){
+    pthread_mutex_lock(&c->lock);
+    if(hits != NULL){
+        *hits = c->hits;
+    }
+    if(misses != NULL){
+        *misses = c->misses;
+    }
+    if(evictions != NULL){
+        *evictions = c->evictions;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Caller-provided buffers
+/*
+Functions below never allocate memory - caller gives output buffer (or the same buffer for in place)
+so processing many small records doesn't call malloc / realloc per record
+Sizes can be checked up front:
+- cbc_encrypted_size - IV + padded cipher for message of given length
+- cbc_padded_size - padded cipher without IV (in place encryption)
+- cbc_decrypted_max_size - plaintext can't be longer than cipher without IV and one padding byte
+*/
+u_int64_t cbc_padded_size(u_int64_t mes_bytes){
+    return (mes_bytes / 16 + 1) * 16;
+}
+
+u_int64_t cbc_encrypted_size(u_int64_t mes_bytes){
+    return 16 + cbc_padded_size(mes_bytes);
+}
+
+u_int64_t cbc_decrypted_max_size(u_int64_t cipher_bytes){
+    return cipher_bytes < 32 ? 0 : cipher_bytes - 17;
+}
+
+// Encrypting message with PKCS#7 padding into out (cbc_padded_size(mes_bytes) bytes), iv is the 0 block
+// out can be the same buffer as mes - every block is read before it's overwritten
+void cbc_encrypt_padded(const aes_ctx* ctx, const u_int8_t iv[16], const u_int8_t* mes, u_int64_t mes_bytes, u_int8_t* out){
+    // Creating variables for blocks used in cbc encrypting algorithm
+    u_int8_t previous_block[16], data_block[16];
+    memcpy(previous_block, iv, 16);
+
+    // Creating variables for amount of data blocks and counter for output variable
+    u_int64_t data_blocks = (mes_bytes/16) + 1;
+    u_int64_t output_counter = 0;
+
+    // Encrypting blocks with following algorithm
+    /*
+    - Take current block
+    - XOR current block with previous block (previous block in the 0 round is a IV vector)
+    We do not encrypt IV vector - it has to be random but it's not private
+    - Encrypt XORed block of data
+
+    If it's the last block we have to handle padding (PKCF#7 standard)
     We fill last block of data with bytes containing number of filled bytes
     Eg. if we are filling 3 bytes then we add 3 bytes each with value 0x03
     
     Because CBC requires padding even if original message is multiple of 16 bytes we need to add padding
     In this case we add whole 16 bytes block with each byte set to 0x10
     */
-    for(int i = 0; i < data_blocks; ++i){
+    for(u_int64_t i = 0; i < data_blocks; ++i){
         // If it's the last block - handle padding
         if(i == data_blocks - 1){
             // We calculate size of last message block
@@ -539,109 +2513,3444 @@ u_int8_t* cbc_encryption_128(const u_int8_t* key, u_int8_t* mes, u_int32_t mes_b
             // Variable that stores padding
             u_int8_t padding_value;
 
-            // If message is multiple of 16 bytes - padding is equal to 16
-            if(last_block_size == 0 && mes_bytes > 0){
-                padding_value = 16;
+            // If message is multiple of 16 bytes - padding is equal to 16
+            if(last_block_size == 0 && mes_bytes > 0){
+                padding_value = 16;
+            }
+            // Else we calculate padding as 16 - size of last block
+            else {
+                padding_value = 16 - last_block_size;
+            }
+            // We copy what is left of original message (if last block size is zero it means there's nothing more to copy)
+            memcpy(data_block, &mes[i * 16], last_block_size);
+            
+            // We add padding bytes
+            for(int p = last_block_size; p < 16; ++p){
+                data_block[p] = padding_value;
+            }
+        
+        } 
+        // If it's not last block of data - we regulary copy 16 bytes from message
+        else {
+            memcpy(data_block, &mes[i * 16], 16);
+        }
+
+        // Performing XOR with previous data block
+        for(int j = 0; j < 16; ++j){
+            data_block[j] = data_block[j] ^ previous_block[j];
+        }
+
+        // Encrypting the XORed value
+        aes_encrypt_block(ctx, data_block);
+
+        // Copying encrypted block data into output (starting from the right place) and into previous block
+        memcpy(&out[output_counter * 16], data_block, 16);
+        memcpy(previous_block, data_block, 16);
+
+        // Incrementing output counter
+        ++output_counter;
+    }
+}
+
+// CBC encryption into caller buffer - output is IV followed by cipher, the same as cbc_encryption_128
+// Returns number of written bytes or -1 when out_capacity is smaller than cbc_encrypted_size
+int64_t cbc_encrypt_into(const aes_ctx* ctx, const u_int8_t* mes, u_int64_t mes_bytes, u_int8_t* out, u_int64_t out_capacity){
+    u_int64_t needed = cbc_encrypted_size(mes_bytes);
+    if(out_capacity < needed){
+        fprintf(stderr, "Err: Output buffer too small\n");
+        return -1;
+    }
+
+    // Generating IV vector and treating it as 0 block
+    if(generate_iv(out) == -1){
+        return -1;
+    }
+    cbc_encrypt_padded(ctx, out, mes, mes_bytes, &out[16]);
+    return needed;
+}
+
+// CBC encryption in place - buf holds message and has to have capacity for cbc_padded_size(mes_bytes)
+// IV is written to iv, returns cipher length or -1
+int64_t cbc_encrypt_inplace(const aes_ctx* ctx, u_int8_t iv[16], u_int8_t* buf, u_int64_t mes_bytes, u_int64_t capacity){
+    u_int64_t needed = cbc_padded_size(mes_bytes);
+    if(capacity < needed){
+        fprintf(stderr, "Err: Buffer too small for padding\n");
+        return -1;
+    }
+
+    if(generate_iv(iv) == -1){
+        return -1;
+    }
+    cbc_encrypt_padded(ctx, iv, buf, mes_bytes, buf);
+    return needed;
+}
+
+// CBC encryption
+u_int8_t* cbc_encryption_ctx(const aes_ctx* ctx, u_int8_t* mes, u_int32_t mes_bytes){
+    AES_PROF_BEGIN();
+    // Creating variable for complete cipher an allocating memory
+    u_int64_t output_bytes = cbc_encrypted_size(mes_bytes);
+    u_int8_t* output = malloc(output_bytes);
+
+    if(output == NULL){
+        perror("Error while allocating memory");
+        return NULL;
+    }
+
+    if(cbc_encrypt_into(ctx, mes, mes_bytes, output, output_bytes) == -1){
+        free(output);
+        return NULL;
+    }
+    AES_PROF_END(AES_PROF_CBC_ENCRYPT, mes_bytes);
+    return output;
+}
+
+// XOR of two 16 byte blocks as two 64-bit words
+AES_INLINE void cbc_xor_block(u_int8_t* out, const u_int8_t* a, const u_int8_t* b){
+    u_int64_t a0, a1, b0, b1;
+    memcpy(&a0, a, 8);
+    memcpy(&a1, a + 8, 8);
+    memcpy(&b0, b, 8);
+    memcpy(&b1, b + 8, 8);
+    a0 ^= b0;
+    a1 ^= b1;
+    memcpy(out, &a0, 8);
+    memcpy(out + 8, &a1, 8);
+}
+
+// Decrypting n_blocks of CBC cipher from in into out (out is the same buffer as in or doesn't overlap it)
+// chain is cipher block before the first one (IV for beginning of message)
+/*
+Every plaintext block needs only D(C[i]) and C[i-1], so unlike encryption blocks don't wait for each other
+We decrypt CBC_BATCH_BLOCKS blocks with one aes_decrypt_blocks call (it keeps 8 blocks in flight in AES-NI)
+directly in out and then XOR them with previous cipher blocks, 64 bits at a time
+1 KiB batches make call, copy and carry overhead small next to the decryption itself
+- out != in - cipher blocks stay in in, between batches only the last one (16 bytes) is carried
+- out == in - decryption overwrites cipher, so the batch is copied aside before it
+*/
+#define CBC_BATCH_BLOCKS 64
+
+void cbc_decrypt_blocks(const aes_ctx* ctx, const u_int8_t chain[16], const u_int8_t* in, u_int8_t* out, u_int64_t n_blocks){
+    u_int8_t saved[CBC_BATCH_BLOCKS * 16], previous[16];
+    memcpy(previous, chain, 16);
+
+    for(u_int64_t i = 0; i < n_blocks; i += CBC_BATCH_BLOCKS){
+        u_int64_t blocks = n_blocks - i;
+        if(blocks > CBC_BATCH_BLOCKS){
+            blocks = CBC_BATCH_BLOCKS;
+        }
+        const u_int8_t* cipher = &in[i * 16];
+        u_int8_t* dst = &out[i * 16];
+
+        if(dst == cipher){
+            memcpy(saved, cipher, blocks * 16);
+            cipher = saved;
+        }
+        else {
+            memcpy(dst, cipher, blocks * 16);
+        }
+        aes_decrypt_blocks(ctx, dst, blocks);
+
+        cbc_xor_block(dst, dst, previous);
+        for(u_int64_t b = 1; b < blocks; ++b){
+            cbc_xor_block(&dst[b * 16], &dst[b * 16], &cipher[(b - 1) * 16]);
+        }
+        memcpy(previous, &cipher[(blocks - 1) * 16], 16);
+    }
+}
+
+// Part of CBC cipher decrypted by one thread
+typedef struct {
+    const aes_ctx* ctx;
+    const u_int8_t* chain;
+    const u_int8_t* in;
+    u_int8_t* out;
+    u_int64_t n_blocks;
+} cbc_decrypt_job;
+
+void* cbc_decrypt_worker(void* arg){
+    cbc_decrypt_job* job = (cbc_decrypt_job*)arg;
+    cbc_decrypt_blocks(job->ctx, job->chain, job->in, job->out, job->n_blocks);
+    return NULL;
+}
+
+// Below this size starting threads costs more than it gives
+#define CBC_MIN_THREAD_BYTES (64 * 1024)
+
+// Decrypting n_blocks of CBC cipher into caller buffer with several threads
+// Every thread gets its range of blocks and starts from cipher block just before its range,
+// so out can't be the same buffer as in (the next thread would read overwritten block)
+// Returns 0 or -1
+int cbc_decrypt_blocks_mt(const aes_ctx* ctx, const u_int8_t chain[16], const u_int8_t* in, u_int8_t* out, u_int64_t n_blocks, int threads){
+    if(threads < 1 || n_blocks * 16 < CBC_MIN_THREAD_BYTES){
+        threads = 1;
+    }
+    if((u_int64_t)threads > n_blocks){
+        threads = n_blocks > 0 ? n_blocks : 1;
+    }
+    if(threads == 1){
+        cbc_decrypt_blocks(ctx, chain, in, out, n_blocks);
+        return 0;
+    }
+
+    cbc_decrypt_job* jobs = malloc(sizeof(cbc_decrypt_job) * threads);
+    if(jobs == NULL){
+        perror("Error while allocating memory");
+        return -1;
+    }
+
+    u_int64_t offset_blocks = 0;
+    for(int t = 0; t < threads; ++t){
+        u_int64_t part_blocks = n_blocks / threads + ((u_int64_t)t < n_blocks % threads);
+        jobs[t].ctx = ctx;
+        jobs[t].chain = offset_blocks == 0 ? chain : &in[(offset_blocks - 1) * 16];
+        jobs[t].in = &in[offset_blocks * 16];
+        jobs[t].out = &out[offset_blocks * 16];
+        jobs[t].n_blocks = part_blocks;
+        offset_blocks += part_blocks;
+    }
+
+    int ret = aes_run_jobs(cbc_decrypt_worker, jobs, sizeof(cbc_decrypt_job), threads);
+    free(jobs);
+    return ret;
+}
+
+// CBC decryption with several blocks in flight and (for big inputs) several threads
+u_int8_t* cbc_decrypt_mt(const aes_ctx* ctx, u_int8_t* cipher, u_int32_t cipher_bytes, u_int32_t* mes_bytes, int threads){
+    // Cipher has to be IV and at least one block (padding is always present)
+    if(cipher_bytes < 32 || cipher_bytes % 16 != 0){
+        fprintf(stderr, "Err: Incorrect cipher length\n");
+        return NULL;
+    }
+
+    u_int32_t cipher_blocks = cipher_bytes/16, mes_blocks = cipher_blocks - 1;
+    u_int8_t* output = malloc((cipher_blocks - 1) * 16);
+    if(output == NULL){
+        perror("Error while allocating memory");
+        return NULL;
+    }
+
+    // First cipher block is IV, message blocks start right after it
+    AES_PROF_BEGIN();
+    if(cbc_decrypt_blocks_mt(ctx, cipher, &cipher[16], output, mes_blocks, threads) == -1){
+        free(output);
+        return NULL;
+    }
+    AES_PROF_END(AES_PROF_CBC_DECRYPT, cipher_bytes - 16);
+
+    // Handling padding
+    u_int8_t padding = output[mes_blocks * 16 - 1];
+
+    if(padding == 0 || padding > 16){
+        fprintf(stderr, "Err: Incorrect padding value\n");
+        free(output);
+        return NULL;
+    }
+
+    u_int32_t out_encrypted_bytes = mes_blocks * 16 - padding;
+    u_int8_t* tmp_output;
+    tmp_output = realloc(output, out_encrypted_bytes);
+    if(tmp_output == NULL && out_encrypted_bytes > 0){
+        perror("Error while reallocating memory");
+        free(output);
+        return NULL;
+    }
+    else {
+        output = tmp_output;
+    }
+    if(mes_bytes != NULL){
+        *mes_bytes = out_encrypted_bytes;
+    }
+
+    return output;
+}
+
+// CBC decryption
+u_int8_t* cbc_decrypt_ctx(const aes_ctx* ctx, u_int8_t* cipher, u_int32_t cipher_bytes, u_int32_t* mes_bytes){
+    return cbc_decrypt_mt(ctx, cipher, cipher_bytes, mes_bytes, 1);
+}
+
+// Decrypting padded cipher (without IV) into out and removing padding
+// Last block is decrypted first, so we know real message length before anything is written
+// and out needs space only for the message itself; out can be the same buffer as cipher
+// Returns message length or -1
+int64_t cbc_decrypt_padded(const aes_ctx* ctx, const u_int8_t iv[16], const u_int8_t* cipher, u_int64_t cipher_bytes, u_int8_t* out, u_int64_t out_capacity){
+    if(cipher_bytes == 0 || cipher_bytes % 16 != 0){
+        fprintf(stderr, "Err: Incorrect cipher length\n");
+        return -1;
+    }
+
+    u_int64_t blocks = cipher_bytes / 16;
+    const u_int8_t* previous = (blocks == 1) ? iv : &cipher[(blocks - 2) * 16];
+    u_int8_t last_block[16];
+    memcpy(last_block, &cipher[(blocks - 1) * 16], 16);
+    aes_decrypt_block(ctx, last_block);
+    for(int j = 0; j < 16; ++j){
+        last_block[j] ^= previous[j];
+    }
+
+    // Handling padding
+    u_int8_t padding = last_block[15];
+    if(padding == 0 || padding > 16){
+        fprintf(stderr, "Err: Incorrect padding value\n");
+        return -1;
+    }
+
+    u_int64_t mes_bytes = cipher_bytes - padding;
+    if(out_capacity < mes_bytes){
+        fprintf(stderr, "Err: Output buffer too small\n");
+        return -1;
+    }
+
+    if(blocks > 1){
+        cbc_decrypt_blocks(ctx, iv, cipher, out, blocks - 1);
+    }
+    memcpy(&out[(blocks - 1) * 16], last_block, 16 - padding);
+    return mes_bytes;
+}
+
+// CBC decryption into caller buffer - input is IV followed by cipher
+// out_capacity equal to cbc_decrypted_max_size(cipher_bytes) is always enough
+int64_t cbc_decrypt_into(const aes_ctx* ctx, const u_int8_t* cipher, u_int64_t cipher_bytes, u_int8_t* out, u_int64_t out_capacity){
+    if(cipher_bytes < 32){
+        fprintf(stderr, "Err: Incorrect cipher length\n");
+        return -1;
+    }
+    return cbc_decrypt_padded(ctx, cipher, &cipher[16], cipher_bytes - 16, out, out_capacity);
+}
+
+// CBC decryption in place - buf holds cipher without IV, after return it holds message
+// Returns message length or -1
+int64_t cbc_decrypt_inplace(const aes_ctx* ctx, const u_int8_t iv[16], u_int8_t* buf, u_int64_t cipher_bytes){
+    return cbc_decrypt_padded(ctx, iv, buf, cipher_bytes, buf, cipher_bytes);
+}
+
+// CBC encryption with raw key - key is expanded once for the whole message
+u_int8_t* cbc_encryption_128(const u_int8_t* key, u_int8_t* mes, u_int32_t mes_bytes){
+    AES_PROF_BEGIN();
+    aes_ctx ctx;
+    aes_init_ctx_128(&ctx, key);
+    u_int8_t* output = cbc_encryption_ctx(&ctx, mes, mes_bytes);
+    aes_clear_ctx(&ctx);
+    AES_PROF_END(AES_PROF_CBC_ENCRYPTION_128, mes_bytes);
+    return output;
+}
+
+// CBC decryption with raw key
+u_int8_t* cbc_decrypt_128(const u_int8_t* key, u_int8_t* cipher, u_int32_t cipher_bytes, u_int32_t* mes_bytes){
+    AES_PROF_BEGIN();
+    aes_ctx ctx;
+    aes_init_ctx_128(&ctx, key);
+    u_int8_t* output = cbc_decrypt_ctx(&ctx, cipher, cipher_bytes, mes_bytes);
+    aes_clear_ctx(&ctx);
+    AES_PROF_END(AES_PROF_CBC_DECRYPT_128, cipher_bytes);
+    return output;
+}
+
+// Batch CBC encryption of many independent messages
+/*
+CBC encryption of one message is a chain - block i needs cipher of block i-1, so one message
+can use only one AES pipeline slot. Many short messages (each with its own key and IV) are
+independent, so batch keeps 8 of them in flight - lane j encrypts next block of its message,
+all 8 lanes go through AES together (aes_encrypt_lanes) and a lane which finished its message
+takes the next job. Jobs are grouped by key size, so every group uses engine copy with constant rounds
+*/
+#define CBC_BATCH_LANES 8
+
+typedef struct {
+    const aes_ctx* ctx;
+    // 16 bytes IV of this message
+    const u_int8_t* iv;
+    const u_int8_t* in;
+    u_int64_t in_bytes;
+    // cbc_padded_size(in_bytes) bytes of padded cipher (without IV), can be the same buffer as in
+    u_int8_t* out;
+} cbc_batch_job;
+
+typedef struct {
+    const u_int8_t* in;
+    u_int8_t* out;
+    // Chain is previous cipher block (already in out) or IV
+    const u_int8_t* chain;
+    u_int64_t in_bytes;
+    u_int64_t block;
+    u_int64_t blocks;
+} cbc_batch_lane;
+
+// Next block of message XOR-ed with chain, last block gets PKCS#7 padding
+AES_INLINE void cbc_batch_load(const cbc_batch_lane* lane, u_int8_t* block){
+    u_int64_t offset = lane->block * 16;
+    if(offset + 16 <= lane->in_bytes){
+        cbc_xor_block(block, &lane->in[offset], lane->chain);
+        return;
+    }
+    u_int8_t last[16];
+    u_int64_t n = lane->in_bytes - offset;
+    memcpy(last, &lane->in[offset], n);
+    memset(&last[n], 16 - n, 16 - n);
+    cbc_xor_block(block, last, lane->chain);
+}
+
+// Taking next job with given number of rounds, returns 0 when there are no more
+int cbc_batch_take(cbc_batch_lane* lane, const aes_ctx** ctx, const cbc_batch_job* jobs, size_t n_jobs, size_t* next_job, int rounds){
+    while(*next_job < n_jobs && jobs[*next_job].ctx->rounds != rounds){
+        ++*next_job;
+    }
+    if(*next_job == n_jobs){
+        return 0;
+    }
+    const cbc_batch_job* job = &jobs[(*next_job)++];
+    *ctx = job->ctx;
+    lane->in = job->in;
+    lane->out = job->out;
+    lane->chain = job->iv;
+    lane->in_bytes = job->in_bytes;
+    lane->block = 0;
+    lane->blocks = cbc_padded_size(job->in_bytes) / 16;
+    return 1;
+}
+
+// Encrypting all jobs with keys of given number of rounds
+void cbc_encrypt_batch_rounds(const cbc_batch_job* jobs, size_t n_jobs, int rounds){
+    cbc_batch_lane lanes[CBC_BATCH_LANES];
+    const aes_ctx* ctxs[CBC_BATCH_LANES];
+    u_int8_t blocks[CBC_BATCH_LANES * 16];
+    int busy[CBC_BATCH_LANES];
+    size_t next_job = 0;
+    int active = 0;
+
+    for(int l = 0; l < CBC_BATCH_LANES; ++l){
+        busy[l] = cbc_batch_take(&lanes[l], &ctxs[l], jobs, n_jobs, &next_job, rounds);
+        active += busy[l];
+    }
+    if(active == 0){
+        return;
+    }
+    // Lanes without message encrypt garbage with key of some other lane (result is dropped)
+    for(int l = 0; l < CBC_BATCH_LANES; ++l){
+        if(!busy[l]){
+            ctxs[l] = ctxs[0];
+        }
+    }
+
+    while(active > 0){
+        for(int l = 0; l < CBC_BATCH_LANES; ++l){
+            if(busy[l]){
+                cbc_batch_load(&lanes[l], &blocks[l * 16]);
+            }
+        }
+
+        aes_encrypt_lanes(ctxs, blocks);
+
+        // Writing cipher blocks, lanes which finished take the next message right away
+        for(int l = 0; l < CBC_BATCH_LANES; ++l){
+            if(!busy[l]){
+                continue;
+            }
+            cbc_batch_lane* lane = &lanes[l];
+            u_int8_t* dst = &lane->out[lane->block * 16];
+            memcpy(dst, &blocks[l * 16], 16);
+            lane->chain = dst;
+            if(++lane->block == lane->blocks){
+                busy[l] = cbc_batch_take(lane, &ctxs[l], jobs, n_jobs, &next_job, rounds);
+                if(!busy[l]){
+                    --active;
+                }
+            }
+        }
+    }
+}
+
+// Encrypting n_jobs messages, every one with its own key context and IV
+void cbc_encrypt_batch(const cbc_batch_job* jobs, size_t n_jobs){
+    const int rounds[3] = {10, 12, 14};
+    for(int r = 0; r < 3; ++r){
+        cbc_encrypt_batch_rounds(jobs, n_jobs, rounds[r]);
+    }
+}
+
+// AES-CMAC (RFC 4493, SP 800-38B)
+/*
+CMAC is CBC-MAC with zero IV where only the last chain value is kept - no cipher output is written,
+so MAC of a message needs only 16 bytes of state and no allocation
+- subkeys: L = E(0^128), K1 = L * x, K2 = K1 * x (doubling in GF(2^128), reduction constant 0x87)
+- full last block is XOR-ed with K1, partial one is padded with 10...0 and XOR-ed with K2
+  (this stops length extension attacks which plain CBC-MAC allows for messages of different lengths)
+- tag = E(X ^ last), where X is CBC chain of all blocks before the last one
+
+Batch keeps 8 independent messages in flight just like cbc_encrypt_batch - CMAC of one message
+is a chain, but lanes of different messages (and different keys) go through AES together
+*/
+#define CMAC_BATCH_LANES 8
+
+typedef struct {
+    const aes_ctx* aes;
+    u_int8_t k1[16];
+    u_int8_t k2[16];
+} cmac_ctx;
+
+// Multiplying 128-bit big endian value by x - shift left by one bit with 0x87 when top bit falls out
+void cmac_double(u_int8_t out[16], const u_int8_t in[16]){
+    u_int8_t carry = in[0] >> 7;
+    for(int i = 0; i < 15; ++i){
+        out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+    }
+    // Mask instead of branch - subkeys are secret
+    out[15] = (in[15] << 1) ^ (0x87 & (0 - carry));
+}
+
+// Preparing CMAC subkeys - aes has to live as long as CMAC context
+void cmac_init_ctx(cmac_ctx* cm, const aes_ctx* aes){
+    u_int8_t l[16] = {0};
+    cm->aes = aes;
+    aes_encrypt_block(aes, l);
+    cmac_double(cm->k1, l);
+    cmac_double(cm->k2, cm->k1);
+    secure_wipe(l, sizeof(l));
+}
+
+void cmac_clear_ctx(cmac_ctx* cm){
+    secure_wipe(cm, sizeof(*cm));
+}
+
+// Number of CBC-MAC blocks - empty message is one padded block
+AES_INLINE u_int64_t cmac_blocks(u_int64_t bytes){
+    return bytes == 0 ? 1 : (bytes + 15) / 16;
+}
+
+// Block i of message XOR-ed with chain, the last block gets subkey (and padding)
+AES_INLINE void cmac_load(const cmac_ctx* cm, const u_int8_t* mes, u_int64_t bytes, u_int64_t i, const u_int8_t chain[16], u_int8_t block[16]){
+    u_int64_t offset = i * 16;
+    if(i + 1 < cmac_blocks(bytes)){
+        cbc_xor_block(block, &mes[offset], chain);
+        return;
+    }
+    u_int8_t last[16];
+    u_int64_t n = bytes - offset;
+    if(n == 16){
+        cbc_xor_block(last, &mes[offset], cm->k1);
+    }
+    else {
+        memcpy(last, &mes[offset], n);
+        last[n] = 0x80;
+        memset(&last[n + 1], 0, 15 - n);
+        cbc_xor_block(last, last, cm->k2);
+    }
+    cbc_xor_block(block, last, chain);
+}
+
+// CMAC of bytes of mes, full 16 byte tag
+void cmac_compute(const cmac_ctx* cm, const u_int8_t* mes, u_int64_t bytes, u_int8_t tag[16]){
+    u_int8_t x[16] = {0};
+    u_int64_t blocks = cmac_blocks(bytes);
+    for(u_int64_t i = 0; i < blocks; ++i){
+        cmac_load(cm, mes, bytes, i, x, x);
+        aes_encrypt_block(cm->aes, x);
+    }
+    memcpy(tag, x, 16);
+}
+
+// Checking tag (tag_bytes 8 - 16, truncated tag is its first bytes), returns 0 when it's correct, -1 otherwise
+int cmac_verify(const cmac_ctx* cm, const u_int8_t* mes, u_int64_t bytes, const u_int8_t* tag, int tag_bytes){
+    u_int8_t computed[16];
+    if(tag_bytes < 8 || tag_bytes > 16){
+        fprintf(stderr, "Err: Incorrect tag length\n");
+        return -1;
+    }
+    cmac_compute(cm, mes, bytes, computed);
+
+    // Whole tag is compared without early exit, the same as in gcm_decrypt
+    u_int8_t diff = 0;
+    for(int j = 0; j < tag_bytes; ++j){
+        diff |= computed[j] ^ tag[j];
+    }
+    return diff == 0 ? 0 : -1;
+}
+
+typedef struct {
+    const cmac_ctx* ctx;
+    const u_int8_t* in;
+    u_int64_t in_bytes;
+    // 16 bytes of tag
+    u_int8_t* tag;
+} cmac_batch_job;
+
+typedef struct {
+    const cmac_batch_job* job;
+    u_int8_t chain[16];
+    u_int64_t block;
+    u_int64_t blocks;
+} cmac_batch_lane;
+
+// Taking next job with given number of rounds, returns 0 when there are no more
+int cmac_batch_take(cmac_batch_lane* lane, const aes_ctx** ctx, const cmac_batch_job* jobs, size_t n_jobs, size_t* next_job, int rounds){
+    while(*next_job < n_jobs && jobs[*next_job].ctx->aes->rounds != rounds){
+        ++*next_job;
+    }
+    if(*next_job == n_jobs){
+        return 0;
+    }
+    lane->job = &jobs[(*next_job)++];
+    *ctx = lane->job->ctx->aes;
+    memset(lane->chain, 0, 16);
+    lane->block = 0;
+    lane->blocks = cmac_blocks(lane->job->in_bytes);
+    return 1;
+}
+
+// MACs of all jobs with keys of given number of rounds
+void cmac_batch_rounds(const cmac_batch_job* jobs, size_t n_jobs, int rounds){
+    cmac_batch_lane lanes[CMAC_BATCH_LANES];
+    const aes_ctx* ctxs[CMAC_BATCH_LANES];
+    u_int8_t blocks[CMAC_BATCH_LANES * 16];
+    int busy[CMAC_BATCH_LANES];
+    size_t next_job = 0;
+    int active = 0;
+
+    for(int l = 0; l < CMAC_BATCH_LANES; ++l){
+        busy[l] = cmac_batch_take(&lanes[l], &ctxs[l], jobs, n_jobs, &next_job, rounds);
+        active += busy[l];
+    }
+    if(active == 0){
+        return;
+    }
+    // Lanes without message encrypt garbage with key of some other lane (result is dropped)
+    for(int l = 0; l < CMAC_BATCH_LANES; ++l){
+        if(!busy[l]){
+            ctxs[l] = ctxs[0];
+        }
+    }
+
+    while(active > 0){
+        for(int l = 0; l < CMAC_BATCH_LANES; ++l){
+            if(busy[l]){
+                const cmac_batch_job* job = lanes[l].job;
+                cmac_load(job->ctx, job->in, job->in_bytes, lanes[l].block, lanes[l].chain, &blocks[l * 16]);
+            }
+        }
+
+        aes_encrypt_lanes(ctxs, blocks);
+
+        // Only chain is kept, finished lane writes tag and takes the next message
+        for(int l = 0; l < CMAC_BATCH_LANES; ++l){
+            if(!busy[l]){
+                continue;
+            }
+            cmac_batch_lane* lane = &lanes[l];
+            memcpy(lane->chain, &blocks[l * 16], 16);
+            if(++lane->block == lane->blocks){
+                memcpy(lane->job->tag, lane->chain, 16);
+                busy[l] = cmac_batch_take(lane, &ctxs[l], jobs, n_jobs, &next_job, rounds);
+                if(!busy[l]){
+                    --active;
+                }
+            }
+        }
+    }
+    secure_wipe(lanes, sizeof(lanes));
+    secure_wipe(blocks, sizeof(blocks));
+}
+
+// CMAC of n_jobs messages, every one with its own CMAC context
+void cmac_batch(const cmac_batch_job* jobs, size_t n_jobs){
+    const int rounds[3] = {10, 12, 14};
+    for(int r = 0; r < 3; ++r){
+        cmac_batch_rounds(jobs, n_jobs, rounds[r]);
+    }
+}
+
+// Streaming (incremental) CBC
+/*
+cbc_encryption_128 needs whole message in memory and its lengths are 32-bit
+Stream API keeps everything CBC needs between calls:
+- chain - previous cipher block (IV at the beginning)
+- partial - bytes which don't make full block yet
+so message can be passed in pieces of any size and total length is 64-bit
+
+Output format is the same as cbc_encryption_128 - IV followed by cipher blocks
+- update writes at most in_bytes + CBC_STREAM_OVERHEAD bytes
+- final writes at most CBC_STREAM_OVERHEAD bytes
+*/
+#define CBC_STREAM_OVERHEAD 32
+
+typedef struct {
+    const aes_ctx* ctx;
+    // 0 for encryption, 1 for decryption
+    int decrypt;
+    // Encryption: IV not written to output yet, decryption: IV not read from input yet
+    int iv_pending;
+    u_int8_t chain[16];
+    u_int8_t partial[16];
+    u_int32_t partial_bytes;
+    u_int64_t total_bytes;
+} cbc_stream;
+
+// Preparing stream, for encryption IV is generated here
+// Returns 0 or -1 when IV couldn't be generated
+int cbc_stream_init(cbc_stream* st, const aes_ctx* ctx, int decrypt){
+    memset(st, 0, sizeof(*st));
+    st->ctx = ctx;
+    st->decrypt = decrypt;
+    st->iv_pending = 1;
+    if(!decrypt){
+        return generate_iv(st->chain);
+    }
+    return 0;
+}
+
+// Encrypting one full block and writing it to out
+void cbc_stream_encrypt_block(cbc_stream* st, const u_int8_t* block, u_int8_t* out){
+    for(int j = 0; j < 16; ++j){
+        st->chain[j] ^= block[j];
+    }
+    aes_encrypt_block(st->ctx, st->chain);
+    memcpy(out, st->chain, 16);
+}
+
+// Decrypting count full blocks from in and moving chain to the last of them
+void cbc_stream_decrypt_blocks(cbc_stream* st, const u_int8_t* in, u_int8_t* out, u_int64_t count){
+    u_int8_t last[16];
+    memcpy(last, &in[(count - 1) * 16], 16);
+    cbc_decrypt_blocks(st->ctx, st->chain, in, out, count);
+    memcpy(st->chain, last, 16);
+}
+
+int cbc_stream_update_encrypt(cbc_stream* st, const u_int8_t* in, u_int64_t in_bytes, u_int8_t* out, u_int64_t* out_bytes){
+    u_int64_t written = 0;
+
+    if(st->iv_pending){
+        memcpy(out, st->chain, 16);
+        written += 16;
+        st->iv_pending = 0;
+    }
+
+    // Filling partial block first
+    if(st->partial_bytes > 0){
+        u_int64_t take = 16 - st->partial_bytes;
+        if(take > in_bytes){
+            take = in_bytes;
+        }
+        memcpy(&st->partial[st->partial_bytes], in, take);
+        st->partial_bytes += take;
+        in += take;
+        in_bytes -= take;
+
+        if(st->partial_bytes < 16){
+            *out_bytes = written;
+            return 0;
+        }
+        cbc_stream_encrypt_block(st, st->partial, &out[written]);
+        written += 16;
+        st->partial_bytes = 0;
+    }
+
+    // Full blocks straight from input
+    while(in_bytes >= 16){
+        cbc_stream_encrypt_block(st, in, &out[written]);
+        written += 16;
+        in += 16;
+        in_bytes -= 16;
+    }
+
+    memcpy(st->partial, in, in_bytes);
+    st->partial_bytes = in_bytes;
+    *out_bytes = written;
+    return 0;
+}
+
+int cbc_stream_update_decrypt(cbc_stream* st, const u_int8_t* in, u_int64_t in_bytes, u_int8_t* out, u_int64_t* out_bytes){
+    u_int64_t written = 0;
+
+    // First 16 bytes of cipher are IV
+    while(st->iv_pending && in_bytes > 0){
+        st->chain[st->partial_bytes++] = *in++;
+        --in_bytes;
+        if(st->partial_bytes == 16){
+            st->iv_pending = 0;
+            st->partial_bytes = 0;
+        }
+    }
+
+    // Last block can contain padding, so we always keep 1-16 bytes for final
+    // Completing partial block only if there is more data after it
+    if(st->partial_bytes > 0 && st->partial_bytes + in_bytes > 16){
+        u_int64_t take = 16 - st->partial_bytes;
+        memcpy(&st->partial[st->partial_bytes], in, take);
+        in += take;
+        in_bytes -= take;
+        cbc_stream_decrypt_blocks(st, st->partial, out, 1);
+        written += 16;
+        st->partial_bytes = 0;
+    }
+
+    // Full blocks straight from input, several at once
+    if(st->partial_bytes == 0 && in_bytes > 16){
+        u_int64_t blocks = (in_bytes - 1) / 16;
+        cbc_stream_decrypt_blocks(st, in, &out[written], blocks);
+        written += blocks * 16;
+        in += blocks * 16;
+        in_bytes -= blocks * 16;
+    }
+
+    memcpy(&st->partial[st->partial_bytes], in, in_bytes);
+    st->partial_bytes += in_bytes;
+    *out_bytes = written;
+    return 0;
+}
+
+// Passing next part of data through stream, out_bytes gets number of bytes written to out
+int cbc_stream_update(cbc_stream* st, const u_int8_t* in, u_int64_t in_bytes, u_int8_t* out, u_int64_t* out_bytes){
+    st->total_bytes += in_bytes;
+    if(st->decrypt){
+        return cbc_stream_update_decrypt(st, in, in_bytes, out, out_bytes);
+    }
+    return cbc_stream_update_encrypt(st, in, in_bytes, out, out_bytes);
+}
+
+// Finishing stream - encryption adds padding block, decryption checks and removes padding
+// Returns 0 or -1 when cipher is incorrect
+int cbc_stream_final(cbc_stream* st, u_int8_t* out, u_int64_t* out_bytes){
+    u_int64_t written = 0;
+
+    if(!st->decrypt){
+        // Empty message still needs IV in output
+        if(st->iv_pending){
+            memcpy(out, st->chain, 16);
+            written += 16;
+            st->iv_pending = 0;
+        }
+
+        // PKCS#7 padding just like in cbc_encryption_128
+        u_int8_t padding_value = 16 - st->partial_bytes;
+        for(int p = st->partial_bytes; p < 16; ++p){
+            st->partial[p] = padding_value;
+        }
+        cbc_stream_encrypt_block(st, st->partial, &out[written]);
+        written += 16;
+    }
+    else {
+        if(st->iv_pending || st->partial_bytes != 16){
+            fprintf(stderr, "Err: Incorrect cipher length\n");
+            return -1;
+        }
+
+        u_int8_t block[16];
+        cbc_stream_decrypt_blocks(st, st->partial, block, 1);
+
+        u_int8_t padding = block[15];
+        if(padding == 0 || padding > 16){
+            fprintf(stderr, "Err: Incorrect padding value\n");
+            return -1;
+        }
+        memcpy(out, block, 16 - padding);
+        written = 16 - padding;
+    }
+
+    st->partial_bytes = 0;
+    *out_bytes = written;
+    return 0;
+}
+
+// CTR mode
+/*
+CTR turns block cipher into stream cipher:
+- counter block starts at random IV (nonce) and is incremented by one for every next block
+- keystream block = E(counter), cipher block = message block XOR keystream block
+Encryption and decryption are the same operation and there is no padding
+
+Every keystream block depends only on IV and block index, so buffer can be split between threads
+and every thread starts from its own counter value IV + first_block_index
+*/
+
+// Below this size starting threads costs more than it gives
+#define CTR_MIN_THREAD_BYTES (64 * 1024)
+// Number of keystream blocks generated together - one aes_encrypt_blocks call (8 blocks in flight in AES-NI)
+// for 1 KiB, so call overhead is small next to the encryption itself
+#define CTR_BATCH_BLOCKS 64
+
+// Adding value to 128-bit big endian counter (carry goes from last byte to the first one)
+void ctr_add_128(u_int8_t counter[16], u_int64_t value){
+    for(int i = 15; i >= 0 && value != 0; --i){
+        value += counter[i];
+        counter[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+// Part of buffer processed by one thread
+typedef struct {
+    const aes_ctx* ctx;
+    u_int8_t counter[16];
+    const u_int8_t* in;
+    u_int8_t* out;
+    u_int64_t bytes;
+} ctr_job;
+
+// 64-bit big endian load and store - counter block is kept as two 64-bit halves
+u_int64_t load_be64(const u_int8_t* p){
+    return ((u_int64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+void store_be64(u_int8_t* p, u_int64_t w){
+    store_be32(p, w >> 32);
+    store_be32(p + 4, (u_int32_t)w);
+}
+
+// Word which has w in memory in big endian byte order (one BSWAP on little endian CPUs)
+AES_INLINE u_int64_t ctr_be64(u_int64_t w){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(w);
+#else
+    return w;
+#endif
+}
+
+// Encrypting (or decrypting) one part of buffer starting from job counter
+void* ctr_worker(void* arg){
+    ctr_job* job = (ctr_job*)arg;
+    u_int8_t keystream[CTR_BATCH_BLOCKS * 16];
+    u_int64_t counter_hi = load_be64(job->counter), counter_lo = load_be64(job->counter + 8);
+    // Upper half is the same in every block until carry, so it's converted only then
+    u_int64_t hi_be = ctr_be64(counter_hi);
+    u_int64_t done = 0;
+
+    while(done < job->bytes){
+        u_int64_t chunk = job->bytes - done;
+        if(chunk > sizeof(keystream)){
+            chunk = sizeof(keystream);
+        }
+        size_t blocks = (chunk + 15) / 16;
+
+        // Preparing counter blocks and encrypting them all at once
+        for(size_t b = 0; b < blocks; ++b){
+            u_int64_t lo_be = ctr_be64(counter_lo);
+            memcpy(&keystream[b * 16], &hi_be, 8);
+            memcpy(&keystream[b * 16 + 8], &lo_be, 8);
+            // Carry from lower half
+            if(++counter_lo == 0){
+                hi_be = ctr_be64(++counter_hi);
+            }
+        }
+        aes_encrypt_blocks(job->ctx, keystream, blocks);
+
+        // XOR-ing whole blocks as 64-bit words, memcpy inside avoids problems with unaligned buffers
+        u_int64_t i = 0;
+        for(; i + 16 <= chunk; i += 16){
+            cbc_xor_block(&job->out[done + i], &job->in[done + i], &keystream[i]);
+        }
+        for(; i < chunk; ++i){
+            job->out[done + i] = job->in[done + i] ^ keystream[i];
+        }
+        done += chunk;
+    }
+
+    return NULL;
+}
+
+// CTR encryption / decryption of in into out (they can be the same buffer)
+// Buffer is split into threads parts with whole number of blocks, returns 0 or -1 on error
+int ctr_crypt(const aes_ctx* ctx, const u_int8_t iv[16], const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int threads){
+    if(threads < 1 || bytes < CTR_MIN_THREAD_BYTES){
+        threads = 1;
+    }
+    // Every part needs at least one block, otherwise offset of empty parts goes past bytes
+    u_int64_t total_blocks = (bytes + 15) / 16;
+    if((u_int64_t)threads > total_blocks){
+        threads = total_blocks > 0 ? total_blocks : 1;
+    }
+
+    ctr_job* jobs = malloc(sizeof(ctr_job) * threads);
+    if(jobs == NULL){
+        perror("Error while allocating memory");
+        return -1;
+    }
+
+    // Splitting blocks evenly, first parts get one more block if it doesn't divide
+    u_int64_t offset_blocks = 0;
+    for(int t = 0; t < threads; ++t){
+        u_int64_t part_blocks = total_blocks / threads + ((u_int64_t)t < total_blocks % threads);
+        u_int64_t offset = offset_blocks * 16;
+        u_int64_t part_bytes = part_blocks * 16;
+        if(offset + part_bytes > bytes){
+            part_bytes = bytes - offset;
+        }
+
+        jobs[t].ctx = ctx;
+        memcpy(jobs[t].counter, iv, 16);
+        ctr_add_128(jobs[t].counter, offset_blocks);
+        jobs[t].in = in + offset;
+        jobs[t].out = out + offset;
+        jobs[t].bytes = part_bytes;
+        offset_blocks += part_blocks;
+    }
+
+    AES_PROF_BEGIN();
+    int ret = aes_run_jobs(ctr_worker, jobs, sizeof(ctr_job), threads);
+    AES_PROF_END(AES_PROF_CTR, bytes);
+
+    // Jobs contained counters derived from IV
+    memset(jobs, 0, sizeof(ctr_job) * threads);
+    free(jobs);
+    return ret;
+}
+
+// CTR encryption - output is IV followed by cipher (the same length as message)
+// IV comes from generate_iv just like in CBC
+u_int8_t* ctr_encryption_ctx(const aes_ctx* ctx, const u_int8_t* mes, u_int64_t mes_bytes, int threads){
+    u_int8_t* output = malloc(mes_bytes + 16);
+    if(output == NULL){
+        perror("Error while allocating memory");
+        return NULL;
+    }
+
+    if(generate_iv(output) == -1 || ctr_crypt(ctx, output, mes, &output[16], mes_bytes, threads) == -1){
+        free(output);
+        return NULL;
+    }
+
+    return output;
+}
+
+// CTR decryption - input is IV followed by cipher
+u_int8_t* ctr_decrypt_ctx(const aes_ctx* ctx, const u_int8_t* cipher, u_int64_t cipher_bytes, int threads, u_int64_t* mes_bytes){
+    if(cipher_bytes < 16){
+        fprintf(stderr, "Err: Cipher too short\n");
+        return NULL;
+    }
+
+    u_int64_t out_bytes = cipher_bytes - 16;
+    // malloc(0) can return NULL, so we always ask for at least one byte
+    u_int8_t* output = malloc(out_bytes > 0 ? out_bytes : 1);
+    if(output == NULL){
+        perror("Error while allocating memory");
+        return NULL;
+    }
+
+    if(ctr_crypt(ctx, cipher, &cipher[16], output, out_bytes, threads) == -1){
+        free(output);
+        return NULL;
+    }
+    if(mes_bytes != NULL){
+        *mes_bytes = out_bytes;
+    }
+
+    return output;
+}
+
+// GCM mode (authenticated encryption)
+/*
+GCM = CTR encryption + GHASH authentication
+- H = E(0^128) is hash key
+- J0 is counter block made from IV (IV || 0x00000001 for 96-bit IV, GHASH of IV otherwise)
+- data is encrypted in CTR mode starting from J0 + 1, only last 32 bits of counter are incremented
+- GHASH is polynomial hash in GF(2^128): Y = (Y ^ block) * H for every block of AAD and cipher
+  and at the end for block with AAD and cipher lengths in bits
+- tag = E(J0) ^ Y
+
+Multiplication in GF(2^128) is done in one of two ways:
+- portable - 4-bit tables (Shoup's method) with 16 precomputed multiples of H
+- PCLMULQDQ - carry-less multiplication instruction, picked at runtime just like AES-NI
+With AES-NI and PCLMULQDQ CTR and GHASH are interleaved - carry-less multiplications
+of 8 cipher blocks are placed between AES rounds of next 8 counter blocks, so both units work at once
+*/
+typedef struct {
+    const aes_ctx* aes;
+    // H as two 64-bit halves and its multiples for 4-bit table multiplication
+    u_int64_t h_hi, h_lo;
+    u_int64_t table_hi[16], table_lo[16];
+    // H^1 - H^8 for PCLMULQDQ path, byte reversed
+    u_int8_t h_powers[8][16];
+    int use_pclmul;
+} gcm_ctx;
+
+// Reduction constants for shifting 4 bits out of the table product
+const u_int64_t gcm_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+// Preparing 16 multiples of H (index is 4-bit value read in GCM bit order)
+void gcm_gen_table(gcm_ctx* g){
+    u_int64_t vh = g->h_hi, vl = g->h_lo;
+
+    g->table_hi[0] = 0;
+    g->table_lo[0] = 0;
+    g->table_hi[8] = vh;
+    g->table_lo[8] = vl;
+
+    // 4, 2 and 1 are H multiplied by x, x^2, x^3 (in GCM bit order it's shift right)
+    for(int i = 4; i > 0; i >>= 1){
+        u_int64_t t = (vl & 1) * 0xe1000000ULL;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (t << 32);
+        g->table_hi[i] = vh;
+        g->table_lo[i] = vl;
+    }
+
+    // Other entries are XOR combinations of these four
+    for(int i = 2; i <= 8; i *= 2){
+        for(int j = 1; j < i; ++j){
+            g->table_hi[i + j] = g->table_hi[i] ^ g->table_hi[j];
+            g->table_lo[i + j] = g->table_lo[i] ^ g->table_lo[j];
+        }
+    }
+}
+
+// x = x * H with 4-bit tables, x is processed from the last nibble to the first one
+void gcm_mult_table(const gcm_ctx* g, u_int8_t x[16]){
+    u_int8_t lo = x[15] & 0x0F, hi, rem;
+    u_int64_t zh = g->table_hi[lo], zl = g->table_lo[lo];
+
+    for(int i = 15; i >= 0; --i){
+        lo = x[i] & 0x0F;
+        hi = (x[i] >> 4) & 0x0F;
+
+        if(i != 15){
+            rem = zl & 0x0F;
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+            zh ^= g->table_hi[lo];
+            zl ^= g->table_lo[lo];
+        }
+
+        rem = zl & 0x0F;
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+        zh ^= g->table_hi[hi];
+        zl ^= g->table_lo[hi];
+    }
+
+    store_be64(x, zh);
+    store_be64(x + 8, zl);
+}
+
+// GHASH of data with portable tables, last partial block is padded with zeros
+void gcm_ghash_table(const gcm_ctx* g, u_int8_t y[16], const u_int8_t* data, u_int64_t bytes){
+    while(bytes > 0){
+        u_int64_t n = bytes < 16 ? bytes : 16;
+        for(u_int64_t j = 0; j < n; ++j){
+            y[j] ^= data[j];
+        }
+        gcm_mult_table(g, y);
+        data += n;
+        bytes -= n;
+    }
+}
+
+#ifdef AES_X86
+// PCLMULQDQ GHASH
+/*
+GCM stores bits of field elements in reversed order, so blocks are byte reversed with PSHUFB
+and the whole product is shifted left by one bit before reduction
+Product of 8 blocks with H^8 .. H^1 is added together without reduction and reduced once
+(Y ^ X1) * H^8 ^ X2 * H^7 ^ ... ^ X8 * H = the same as 8 single steps of GHASH
+*/
+#define GCM_TARGET __attribute__((target("aes,pclmul,sse2,ssse3")))
+
+GCM_TARGET
+AES_INLINE __m128i gcm_bswap(__m128i x){
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Adding a * b (256-bit product without reduction) to lo, mid and hi parts
+GCM_TARGET
+AES_INLINE void gcm_clmul_acc(__m128i a, __m128i b, __m128i* lo, __m128i* mid, __m128i* hi){
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x10));
+    *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x01));
+}
+
+// Reducing 256-bit product modulo x^128 + x^7 + x^2 + x + 1 (reversed bit order)
+GCM_TARGET
+AES_INLINE __m128i gcm_reduce(__m128i lo, __m128i mid, __m128i hi){
+    __m128i t2, t4, t5, t7, t8, t9;
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // Shifting 256-bit product left by one bit
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, t8);
+    hi = _mm_or_si128(hi, t9);
+
+    // First phase of reduction
+    t7 = _mm_slli_epi32(lo, 31);
+    t8 = _mm_slli_epi32(lo, 30);
+    t9 = _mm_slli_epi32(lo, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    lo = _mm_xor_si128(lo, t7);
+
+    // Second phase of reduction
+    t2 = _mm_srli_epi32(lo, 1);
+    t4 = _mm_srli_epi32(lo, 2);
+    t5 = _mm_srli_epi32(lo, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    lo = _mm_xor_si128(lo, t2);
+    return _mm_xor_si128(hi, lo);
+}
+
+GCM_TARGET
+AES_INLINE __m128i gcm_mult_clmul(__m128i a, __m128i b){
+    __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    gcm_clmul_acc(a, b, &lo, &mid, &hi);
+    return gcm_reduce(lo, mid, hi);
+}
+
+// Computing H^1 - H^8
+GCM_TARGET
+void gcm_init_clmul(gcm_ctx* g, const u_int8_t h[16]){
+    __m128i h1 = gcm_bswap(_mm_loadu_si128((const __m128i*)h));
+    __m128i power = h1;
+    for(int i = 0; i < 8; ++i){
+        _mm_storeu_si128((__m128i*)g->h_powers[i], power);
+        power = gcm_mult_clmul(power, h1);
+    }
+}
+
+// GHASH of data with PCLMULQDQ, 8 blocks per reduction when there is enough data
+GCM_TARGET
+void gcm_ghash_clmul(const gcm_ctx* g, u_int8_t y_bytes[16], const u_int8_t* data, u_int64_t bytes){
+    __m128i hp[8];
+    for(int i = 0; i < 8; ++i){
+        hp[i] = _mm_loadu_si128((const __m128i*)g->h_powers[i]);
+    }
+    __m128i y = gcm_bswap(_mm_loadu_si128((const __m128i*)y_bytes));
+
+    while(bytes >= 128){
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for(int j = 0; j < 8; ++j){
+            __m128i x = gcm_bswap(_mm_loadu_si128((const __m128i*)&data[j * 16]));
+            if(j == 0){
+                x = _mm_xor_si128(x, y);
+            }
+            gcm_clmul_acc(x, hp[7 - j], &lo, &mid, &hi);
+        }
+        y = gcm_reduce(lo, mid, hi);
+        data += 128;
+        bytes -= 128;
+    }
+
+    while(bytes > 0){
+        u_int8_t block[16] = {0};
+        u_int64_t n = bytes < 16 ? bytes : 16;
+        memcpy(block, data, n);
+        y = _mm_xor_si128(y, gcm_bswap(_mm_loadu_si128((const __m128i*)block)));
+        y = gcm_mult_clmul(y, hp[0]);
+        data += n;
+        bytes -= n;
+    }
+
+    _mm_storeu_si128((__m128i*)y_bytes, gcm_bswap(y));
+}
+
+// 8 blocks of CTR with GHASH of 8 other (already byte reversed) blocks between AES rounds
+// ghash is constant - first chunk of encryption has no previous cipher to hash
+GCM_TARGET
+AES_INLINE void gcm_ni_chunk(const __m128i* rk, const __m128i* hp, __m128i* ctr, __m128i* y, const __m128i* ghash_in, const u_int8_t* in, u_int8_t* out, const int ghash, const int rounds){
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    __m128i b[8], first = _mm_setzero_si128();
+    __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+    // Counter is kept byte reversed, so incrementing last 32 bits of block is adding 1 to lowest lane
+    #pragma GCC unroll 8
+    for(int j = 0; j < 8; ++j){
+        *ctr = _mm_add_epi32(*ctr, one);
+        b[j] = _mm_xor_si128(gcm_bswap(*ctr), rk[0]);
+    }
+    if(ghash){
+        first = _mm_xor_si128(ghash_in[0], *y);
+    }
+
+    #pragma GCC unroll 14
+    for(int round = 1; round < rounds; ++round){
+        #pragma GCC unroll 8
+        for(int j = 0; j < 8; ++j){
+            b[j] = _mm_aesenc_si128(b[j], rk[round]);
+        }
+        // One carry-less multiplication per AES round
+        if(ghash && round <= 8){
+            gcm_clmul_acc(round == 1 ? first : ghash_in[round - 1], hp[8 - round], &lo, &mid, &hi);
+        }
+    }
+    if(ghash){
+        *y = gcm_reduce(lo, mid, hi);
+    }
+
+    #pragma GCC unroll 8
+    for(int j = 0; j < 8; ++j){
+        b[j] = _mm_aesenclast_si128(b[j], rk[rounds]);
+        b[j] = _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i*)&in[j * 16]));
+        _mm_storeu_si128((__m128i*)&out[j * 16], b[j]);
+    }
+}
+
+// Encrypting / decrypting chunks of 8 blocks with interleaved GHASH
+// counter is the last used counter block, y is GHASH state - both are updated
+GCM_TARGET
+AES_INLINE void gcm_ni_crypt_rounds(const gcm_ctx* g, u_int8_t counter[16], u_int8_t y_bytes[16], const u_int8_t* in, u_int8_t* out, u_int64_t chunks, int decrypt, const int rounds){
+    __m128i rk[AES_MAX_ROUNDS + 1], hp[8], prev[8];
+    for(int i = 0; i <= rounds; ++i){
+        rk[i] = _mm_loadu_si128((const __m128i*)&g->aes->ni_enc_keys[i * 16]);
+    }
+    for(int i = 0; i < 8; ++i){
+        hp[i] = _mm_loadu_si128((const __m128i*)g->h_powers[i]);
+    }
+    __m128i ctr = gcm_bswap(_mm_loadu_si128((const __m128i*)counter));
+    __m128i y = gcm_bswap(_mm_loadu_si128((const __m128i*)y_bytes));
+
+    for(u_int64_t c = 0; c < chunks; ++c){
+        const u_int8_t* src = &in[c * 128];
+        u_int8_t* dst = &out[c * 128];
+
+        if(decrypt){
+            // Hashing cipher we are decrypting right now (read before out overwrites it)
+            for(int j = 0; j < 8; ++j){
+                prev[j] = gcm_bswap(_mm_loadu_si128((const __m128i*)&src[j * 16]));
+            }
+            gcm_ni_chunk(rk, hp, &ctr, &y, prev, src, dst, 1, rounds);
+        }
+        else {
+            // Hashing cipher of previous chunk while encrypting this one
+            if(c == 0){
+                gcm_ni_chunk(rk, hp, &ctr, &y, prev, src, dst, 0, rounds);
+            }
+            else {
+                gcm_ni_chunk(rk, hp, &ctr, &y, prev, src, dst, 1, rounds);
+            }
+            for(int j = 0; j < 8; ++j){
+                prev[j] = gcm_bswap(_mm_loadu_si128((const __m128i*)&dst[j * 16]));
+            }
+        }
+    }
+
+    _mm_storeu_si128((__m128i*)counter, gcm_bswap(ctr));
+    _mm_storeu_si128((__m128i*)y_bytes, gcm_bswap(y));
+
+    // Cipher of the last chunk still has to be hashed
+    if(!decrypt && chunks > 0){
+        gcm_ghash_clmul(g, y_bytes, &out[(chunks - 1) * 128], 128);
+    }
+}
+
+GCM_TARGET
+void gcm_ni_crypt(const gcm_ctx* g, u_int8_t counter[16], u_int8_t y_bytes[16], const u_int8_t* in, u_int8_t* out, u_int64_t chunks, int decrypt){
+    const aes_ctx* ctx = g->aes;
+    AES_SPECIALISE(gcm_ni_crypt_rounds, g, counter, y_bytes, in, out, chunks, decrypt)
+}
+#else
+void gcm_init_clmul(gcm_ctx* g, const u_int8_t h[16]){
+    (void)g;
+    (void)h;
+}
+
+void gcm_ghash_clmul(const gcm_ctx* g, u_int8_t y[16], const u_int8_t* data, u_int64_t bytes){
+    gcm_ghash_table(g, y, data, bytes);
+}
+
+void gcm_ni_crypt(const gcm_ctx* g, u_int8_t counter[16], u_int8_t y[16], const u_int8_t* in, u_int8_t* out, u_int64_t chunks, int decrypt){
+    (void)g; (void)counter; (void)y; (void)in; (void)out; (void)chunks; (void)decrypt;
+}
+#endif
+
+// GHASH with the best available multiplication
+void gcm_ghash(const gcm_ctx* g, u_int8_t y[16], const u_int8_t* data, u_int64_t bytes){
+    if(g->use_pclmul){
+        gcm_ghash_clmul(g, y, data, bytes);
+    }
+    else {
+        gcm_ghash_table(g, y, data, bytes);
+    }
+}
+
+// Preparing GCM context - aes has to live as long as GCM context (128 or 256-bit key)
+void gcm_init_ctx(gcm_ctx* g, const aes_ctx* aes){
+    u_int8_t h[16] = {0};
+
+    memset(g, 0, sizeof(*g));
+    g->aes = aes;
+    aes_encrypt_block(aes, h);
+    g->h_hi = load_be64(h);
+    g->h_lo = load_be64(h + 8);
+    gcm_gen_table(g);
+
+    g->use_pclmul = aes_use_ni && aes_use_pclmul;
+    if(g->use_pclmul){
+        gcm_init_clmul(g, h);
+    }
+    secure_wipe(h, sizeof(h));
+}
+
+void gcm_clear_ctx(gcm_ctx* g){
+    secure_wipe(g, sizeof(*g));
+}
+
+// Incrementing last 32 bits of counter block
+void gcm_inc32(u_int8_t counter[16]){
+    store_be32(&counter[12], load_be32(&counter[12]) + 1);
+}
+
+// CTR part of GCM with GHASH of cipher, used for data which doesn't make full 8 block chunks
+// or when there is no AES-NI / PCLMULQDQ
+void gcm_crypt_portable(const gcm_ctx* g, u_int8_t counter[16], u_int8_t y[16], const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int decrypt){
+    u_int8_t keystream[CTR_BATCH_BLOCKS * 16];
+
+    while(bytes > 0){
+        u_int64_t chunk = bytes < sizeof(keystream) ? bytes : sizeof(keystream);
+        size_t blocks = (chunk + 15) / 16;
+
+        for(size_t b = 0; b < blocks; ++b){
+            gcm_inc32(counter);
+            memcpy(&keystream[b * 16], counter, 16);
+        }
+        aes_encrypt_blocks(g->aes, keystream, blocks);
+
+        // GHASH always goes over cipher - before XOR for decryption, after XOR for encryption
+        if(decrypt){
+            gcm_ghash(g, y, in, chunk);
+        }
+        for(u_int64_t i = 0; i < chunk; ++i){
+            out[i] = in[i] ^ keystream[i];
+        }
+        if(!decrypt){
+            gcm_ghash(g, y, out, chunk);
+        }
+
+        in += chunk;
+        out += chunk;
+        bytes -= chunk;
+    }
+    secure_wipe(keystream, sizeof(keystream));
+}
+
+// Common part of GCM encryption and decryption - computes full 16 byte tag
+void gcm_crypt(const gcm_ctx* g, const u_int8_t* iv, u_int64_t iv_bytes, const u_int8_t* aad, u_int64_t aad_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, u_int8_t tag[16], int decrypt){
+    AES_PROF_BEGIN();
+    u_int8_t j0[16] = {0}, counter[16], y[16] = {0}, lengths[16];
+
+    // J0 - for 96-bit IV it's IV || 0x00000001, otherwise GHASH(IV || padding || IV length)
+    if(iv_bytes == 12){
+        memcpy(j0, iv, 12);
+        j0[15] = 1;
+    }
+    else {
+        gcm_ghash(g, j0, iv, iv_bytes);
+        store_be64(lengths, 0);
+        store_be64(lengths + 8, iv_bytes * 8);
+        gcm_ghash(g, j0, lengths, 16);
+    }
+    memcpy(counter, j0, 16);
+
+    gcm_ghash(g, y, aad, aad_bytes);
+
+    // Full 8 block chunks go through interleaved AES-NI / PCLMULQDQ path, the rest through portable path
+    u_int64_t done = 0;
+    if(g->use_pclmul){
+        u_int64_t chunks = bytes / 128;
+        gcm_ni_crypt(g, counter, y, in, out, chunks, decrypt);
+        done = chunks * 128;
+    }
+    gcm_crypt_portable(g, counter, y, in + done, out + done, bytes - done, decrypt);
+
+    // Lengths block and tag
+    store_be64(lengths, aad_bytes * 8);
+    store_be64(lengths + 8, bytes * 8);
+    gcm_ghash(g, y, lengths, 16);
+
+    aes_encrypt_block(g->aes, j0);
+    for(int j = 0; j < 16; ++j){
+        tag[j] = j0[j] ^ y[j];
+    }
+    AES_PROF_END(AES_PROF_GCM, aad_bytes + bytes);
+}
+
+// GCM encryption of bytes from in into out (can be the same buffer), tag gets 16 bytes
+// IV (nonce) must never repeat for the same key - 12 bytes is recommended length
+// Returns 0, or -1 for empty IV (SP 800-38D requires at least 1 bit)
+int gcm_encrypt(const gcm_ctx* g, const u_int8_t* iv, u_int64_t iv_bytes, const u_int8_t* aad, u_int64_t aad_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, u_int8_t tag[16]){
+    if(iv_bytes == 0){
+        return -1;
+    }
+    gcm_crypt(g, iv, iv_bytes, aad, aad_bytes, in, out, bytes, tag, 0);
+    return 0;
+}
+
+// GCM decryption - returns 0 when tag is correct, -1 otherwise (out is then wiped)
+// tag_bytes can be 12 - 16 (truncated tag)
+int gcm_decrypt(const gcm_ctx* g, const u_int8_t* iv, u_int64_t iv_bytes, const u_int8_t* aad, u_int64_t aad_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, const u_int8_t* tag, int tag_bytes){
+    u_int8_t computed[16];
+    if(tag_bytes < 12 || tag_bytes > 16){
+        fprintf(stderr, "Err: Incorrect tag length\n");
+        return -1;
+    }
+    if(iv_bytes == 0){
+        return -1;
+    }
+
+    gcm_crypt(g, iv, iv_bytes, aad, aad_bytes, in, out, bytes, computed, 1);
+
+    // Comparing whole tag without early exit, so time doesn't depend on position of first difference
+    u_int8_t diff = 0;
+    for(int j = 0; j < tag_bytes; ++j){
+        diff |= computed[j] ^ tag[j];
+    }
+    if(diff != 0){
+        secure_wipe(out, bytes);
+        return -1;
+    }
+    return 0;
+}
+
+// XTS mode (storage encryption)
+/*
+XTS-AES (IEEE 1619, SP 800-38E) encrypts disk sectors - every sector is encrypted separately
+and cipher has exactly the same length as data, so it fits in place of the sector
+- key is two AES keys of the same size: K1 encrypts data, K2 encrypts the tweak
+- T = E_K2(sector number written as 128-bit little endian value)
+- block j of the sector: C = E_K1(P ^ T_j) ^ T_j, where T_0 = T and T_j+1 = T_j * alpha in GF(2^128)
+- sector which isn't a multiple of 16 bytes uses ciphertext stealing: last partial block borrows
+  the end of the previous cipher block, and they are swapped, so nothing has to be padded
+
+Blocks of a sector depend only on sector number and position, so independent sectors
+can be processed by different threads without any communication between them
+*/
+
+// Below this size starting threads costs more than it gives (the same as for CTR)
+#define XTS_MIN_THREAD_BYTES (64 * 1024)
+// Blocks (and tweaks of different sectors) encrypted together - 8 blocks in flight in AES-NI and bitsliced engines
+#define XTS_BATCH_BLOCKS 8
+
+// Two key schedules: data key and tweak key
+typedef struct {
+    aes_ctx data;
+    aes_ctx tweak;
+} xts_ctx;
+
+// Preparing XTS context - key_bytes is 32 (XTS-AES-128) or 64 (XTS-AES-256), first half is data key
+// Returns 0 or -1 (wrong size or both halves equal, which IEEE 1619 forbids)
+int xts_init_ctx(xts_ctx* x, const u_int8_t* key, int key_bytes){
+    if(key_bytes != 32 && key_bytes != 64){
+        fprintf(stderr, "Err: XTS key has to be 32 or 64 bytes long\n");
+        return -1;
+    }
+    int half = key_bytes / 2;
+    if(memcmp(key, key + half, half) == 0){
+        fprintf(stderr, "Err: XTS data key and tweak key have to be different\n");
+        return -1;
+    }
+
+    aes_init_ctx(&x->data, key, half);
+    aes_init_ctx(&x->tweak, key + half, half);
+    return 0;
+}
+
+void xts_clear_ctx(xts_ctx* x){
+    secure_wipe(x, sizeof(*x));
+}
+
+// Tweak is little endian in XTS, so it's kept as two 64-bit little endian halves
+u_int64_t load_le64(const u_int8_t* p){
+    return ((u_int64_t)load_le32(p + 4) << 32) | load_le32(p);
+}
+
+void store_le64(u_int8_t* p, u_int64_t w){
+    store_le32(p, (u_int32_t)w);
+    store_le32(p + 4, w >> 32);
+}
+
+// Multiplying tweak by alpha (x) - shift left by one bit, bit shifted out of the top
+// comes back as x^7 + x^2 + x + 1 (0x87) - mask instead of branch keeps it constant-time
+AES_INLINE void xts_mul_alpha(u_int64_t* lo, u_int64_t* hi){
+    u_int64_t carry = 0 - (*hi >> 63);
+    *hi = (*hi << 1) | (*lo >> 63);
+    *lo = (*lo << 1) ^ (carry & 0x87);
+}
+
+// XOR of block with tweak
+AES_INLINE void xts_xor_tweak(u_int8_t* dst, const u_int8_t* src, u_int64_t lo, u_int64_t hi){
+    store_le64(dst, load_le64(src) ^ lo);
+    store_le64(dst + 8, load_le64(src + 8) ^ hi);
+}
+
+// One block with its tweak (ciphertext stealing part)
+void xts_crypt_block(const aes_ctx* ctx, u_int8_t block[16], u_int64_t lo, u_int64_t hi, int decrypt){
+    xts_xor_tweak(block, block, lo, hi);
+    if(decrypt){
+        aes_decrypt_blocks(ctx, block, 1);
+    }
+    else {
+        aes_encrypt_blocks(ctx, block, 1);
+    }
+    xts_xor_tweak(block, block, lo, hi);
+}
+
+// Encrypting or decrypting one sector (at least 16 bytes) whose tweak is already encrypted
+// in and out can be the same buffer
+void xts_crypt_sector_tweak(const xts_ctx* x, const u_int8_t tweak[16], const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int decrypt){
+    u_int8_t buf[XTS_BATCH_BLOCKS * 16];
+    u_int64_t tweak_lo[XTS_BATCH_BLOCKS], tweak_hi[XTS_BATCH_BLOCKS];
+    u_int64_t lo = load_le64(tweak), hi = load_le64(tweak + 8);
+
+    // With partial last block the last full block takes part in ciphertext stealing
+    u_int64_t blocks = bytes / 16;
+    u_int64_t tail = bytes % 16;
+    u_int64_t plain_blocks = tail != 0 ? blocks - 1 : blocks;
+
+    for(u_int64_t done = 0; done < plain_blocks; ){
+        size_t n = plain_blocks - done < XTS_BATCH_BLOCKS ? plain_blocks - done : XTS_BATCH_BLOCKS;
+        for(size_t b = 0; b < n; ++b){
+            tweak_lo[b] = lo;
+            tweak_hi[b] = hi;
+            xts_xor_tweak(&buf[b * 16], &in[(done + b) * 16], lo, hi);
+            xts_mul_alpha(&lo, &hi);
+        }
+        if(decrypt){
+            aes_decrypt_blocks(&x->data, buf, n);
+        }
+        else {
+            aes_encrypt_blocks(&x->data, buf, n);
+        }
+        for(size_t b = 0; b < n; ++b){
+            xts_xor_tweak(&out[(done + b) * 16], &buf[b * 16], tweak_lo[b], tweak_hi[b]);
+        }
+        done += n;
+    }
+    if(tail == 0){
+        return;
+    }
+
+    // Ciphertext stealing - (lo, hi) is tweak of block m-1 now, next one belongs to partial block m
+    u_int64_t next_lo = lo, next_hi = hi;
+    xts_mul_alpha(&next_lo, &next_hi);
+    const u_int8_t* in_last = &in[plain_blocks * 16];
+    u_int8_t* out_last = &out[plain_blocks * 16];
+    u_int8_t full[16], part[16];
+    memcpy(full, in_last, 16);
+    memcpy(part, in_last + 16, tail);
+
+    // Decryption uses tweaks in reverse order: full block was encrypted with the tweak of partial block
+    if(decrypt){
+        xts_crypt_block(&x->data, full, next_lo, next_hi, 1);
+    }
+    else {
+        xts_crypt_block(&x->data, full, lo, hi, 0);
+    }
+    // Partial output is beginning of that block, the rest of it is stolen to fill partial input
+    memcpy(out_last + 16, full, tail);
+    memcpy(part + tail, full + tail, 16 - tail);
+    if(decrypt){
+        xts_crypt_block(&x->data, part, lo, hi, 1);
+    }
+    else {
+        xts_crypt_block(&x->data, part, next_lo, next_hi, 0);
+    }
+    memcpy(out_last, part, 16);
+    secure_wipe(full, sizeof(full));
+    secure_wipe(part, sizeof(part));
+}
+
+// Part of buffer processed by one thread - whole sectors starting from sector number
+typedef struct {
+    const xts_ctx* ctx;
+    u_int64_t sector;
+    u_int64_t sector_bytes;
+    const u_int8_t* in;
+    u_int8_t* out;
+    u_int64_t bytes;
+    int decrypt;
+} xts_job;
+
+// Sectors are taken 8 at a time so their tweaks are encrypted in one batch
+void* xts_worker(void* arg){
+    xts_job* job = (xts_job*)arg;
+    u_int8_t tweaks[XTS_BATCH_BLOCKS * 16];
+    u_int64_t offset = 0, sector = job->sector;
+
+    while(offset < job->bytes){
+        size_t n = 0;
+        for(; n < XTS_BATCH_BLOCKS && offset + n * job->sector_bytes < job->bytes; ++n){
+            store_le64(&tweaks[n * 16], sector + n);
+            store_le64(&tweaks[n * 16 + 8], 0);
+        }
+        aes_encrypt_blocks(&job->ctx->tweak, tweaks, n);
+
+        for(size_t s = 0; s < n; ++s){
+            u_int64_t bytes = job->bytes - offset < job->sector_bytes ? job->bytes - offset : job->sector_bytes;
+            xts_crypt_sector_tweak(job->ctx, &tweaks[s * 16], job->in + offset, job->out + offset, bytes, job->decrypt);
+            offset += bytes;
+        }
+        sector += n;
+    }
+
+    secure_wipe(tweaks, sizeof(tweaks));
+    return NULL;
+}
+
+// Common part of XTS encryption and decryption
+int xts_crypt(const xts_ctx* x, u_int64_t first_sector, u_int64_t sector_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int threads, int decrypt){
+    if(sector_bytes < 16 || (bytes % sector_bytes != 0 && bytes % sector_bytes < 16)){
+        fprintf(stderr, "Err: XTS sector (and last part of data) has to be at least 16 bytes long\n");
+        return -1;
+    }
+
+    u_int64_t sectors = (bytes + sector_bytes - 1) / sector_bytes;
+    if(threads < 1 || bytes < XTS_MIN_THREAD_BYTES){
+        threads = 1;
+    }
+    if((u_int64_t)threads > sectors){
+        threads = sectors > 0 ? sectors : 1;
+    }
+
+    xts_job* jobs = malloc(sizeof(xts_job) * threads);
+    if(jobs == NULL){
+        perror("Error while allocating memory");
+        return -1;
+    }
+
+    // Splitting sectors evenly, first parts get one more sector if it doesn't divide
+    u_int64_t offset_sectors = 0;
+    for(int t = 0; t < threads; ++t){
+        u_int64_t part_sectors = sectors / threads + ((u_int64_t)t < sectors % threads);
+        u_int64_t offset = offset_sectors * sector_bytes;
+        u_int64_t part_bytes = part_sectors * sector_bytes;
+        if(offset + part_bytes > bytes){
+            part_bytes = bytes - offset;
+        }
+
+        jobs[t].ctx = x;
+        jobs[t].sector = first_sector + offset_sectors;
+        jobs[t].sector_bytes = sector_bytes;
+        jobs[t].in = in + offset;
+        jobs[t].out = out + offset;
+        jobs[t].bytes = part_bytes;
+        jobs[t].decrypt = decrypt;
+        offset_sectors += part_sectors;
+    }
+
+    AES_PROF_BEGIN();
+    int ret = aes_run_jobs(xts_worker, jobs, sizeof(xts_job), threads);
+    AES_PROF_END(AES_PROF_XTS, bytes);
+    free(jobs);
+    return ret;
+}
+
+// XTS encryption of bytes from in into out (can be the same buffer), returns 0 or -1
+// Data is split into sectors of sector_bytes numbered from first_sector, the last one can be shorter
+// (but at least 16 bytes), threads encrypt different sectors at the same time
+int xts_encrypt(const xts_ctx* x, u_int64_t first_sector, u_int64_t sector_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int threads){
+    return xts_crypt(x, first_sector, sector_bytes, in, out, bytes, threads, 0);
+}
+
+// XTS decryption - sector numbers and size have to be the same as in encryption
+int xts_decrypt(const xts_ctx* x, u_int64_t first_sector, u_int64_t sector_bytes, const u_int8_t* in, u_int8_t* out, u_int64_t bytes, int threads){
+    return xts_crypt(x, first_sector, sector_bytes, in, out, bytes, threads, 1);
+}
+
+// Reading test vector written in hex into bytes, returns number of bytes
+u_int32_t selftest_hex(const char* hex, u_int8_t* out){
+    u_int32_t n = strlen(hex) / 2;
+    for(u_int32_t i = 0; i < n; ++i){
+        unsigned int byte;
+        sscanf(&hex[2 * i], "%2x", &byte);
+        out[i] = (u_int8_t)byte;
+    }
+    return n;
+}
+
+// SP 800-38A appendix F vectors - the same 4 plaintext blocks for every key and mode
+typedef struct {
+    const char* key;
+    const char* ecb;
+    const char* cbc;
+    const char* ctr;
+} sp800_38a_vector;
+
+const char* sp800_38a_plain = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+                              "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+const char* sp800_38a_cbc_iv = "000102030405060708090a0b0c0d0e0f";
+const char* sp800_38a_ctr_iv = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+const sp800_38a_vector sp800_38a_vectors[] = {
+    // F.1.1, F.2.1, F.5.1 (AES-128)
+    {"2b7e151628aed2a6abf7158809cf4f3c",
+     "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4",
+     "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7",
+     "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee"},
+    // F.1.3, F.2.3, F.5.3 (AES-192)
+    {"8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+     "bd334f1d6e45f25ff712a214571fa5cc974104846d0ad3ad7734ecb3ecee4eefef7afd2270e2e60adce0ba2face6444e9a4b41ba738d6c72fb16691603c18e0e",
+     "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd",
+     "1abc932417521ca24f2b0459fe7e6e0b090339ec0aa6faefd5ccc2c6f4ce8e941e36b26bd1ebc670d1bd1d665620abf74f78a7f6d29809585a97daec58c6b050"},
+    // F.1.5, F.2.5, F.5.5 (AES-256)
+    {"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+     "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7",
+     "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b",
+     "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c52b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6"}
+};
+
+// ECB, CBC and CTR known answers in both directions for every key size
+int sp800_38a_selftest(void){
+    u_int8_t plain[64], cbc_iv[16], ctr_iv[16], key[32], expected[64], out[80];
+    const char* modes[3] = {"ECB", "CBC", "CTR"};
+    int failed = 0;
+    aes_ctx ctx;
+
+    selftest_hex(sp800_38a_plain, plain);
+    selftest_hex(sp800_38a_cbc_iv, cbc_iv);
+    selftest_hex(sp800_38a_ctr_iv, ctr_iv);
+
+    for(size_t v = 0; v < sizeof(sp800_38a_vectors) / sizeof(sp800_38a_vectors[0]); ++v){
+        int key_bytes = selftest_hex(sp800_38a_vectors[v].key, key);
+        aes_init_ctx(&ctx, key, key_bytes);
+
+        for(int m = 0; m < 3; ++m){
+            int ok;
+            if(m == 0){
+                selftest_hex(sp800_38a_vectors[v].ecb, expected);
+                memcpy(out, plain, 64);
+                aes_encrypt_blocks(&ctx, out, 4);
+                ok = memcmp(out, expected, 64) == 0;
+                aes_decrypt_blocks(&ctx, out, 4);
+                ok = ok && memcmp(out, plain, 64) == 0;
+            }
+            else if(m == 1){
+                // Padded encryption adds one block after the 4 from the vector
+                selftest_hex(sp800_38a_vectors[v].cbc, expected);
+                cbc_encrypt_padded(&ctx, cbc_iv, plain, 64, out);
+                ok = memcmp(out, expected, 64) == 0;
+                cbc_decrypt_blocks(&ctx, cbc_iv, expected, out, 4);
+                ok = ok && memcmp(out, plain, 64) == 0;
+            }
+            else {
+                selftest_hex(sp800_38a_vectors[v].ctr, expected);
+                ctr_crypt(&ctx, ctr_iv, plain, out, 64, 1);
+                ok = memcmp(out, expected, 64) == 0;
+                ctr_crypt(&ctx, ctr_iv, expected, out, 64, 1);
+                ok = ok && memcmp(out, plain, 64) == 0;
+            }
+            printf("SP 800-38A AES-%d %s %s\n", key_bytes * 8, modes[m], ok ? "OK" : "FAILED");
+            failed |= !ok;
+        }
+    }
+    aes_clear_ctx(&ctx);
+    return failed;
+}
+
+// GCM test vectors (McGrew & Viega "The Galois/Counter Mode of Operation", used by NIST)
+typedef struct {
+    const char* key;
+    const char* iv;
+    const char* aad;
+    const char* plain;
+    const char* cipher;
+    const char* tag;
+} gcm_vector;
+
+const gcm_vector gcm_vectors[] = {
+    // Test cases 1 - 4 (AES-128)
+    {"00000000000000000000000000000000", "000000000000000000000000", "", "", "",
+     "58e2fccefa7e3061367f1d57a4e7455a"},
+    {"00000000000000000000000000000000", "000000000000000000000000", "",
+     "00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78",
+     "ab6e47d42cec13bdf53a67b21257bddf"},
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+     "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+     "4d5c2af327cd64a62cf35abd2ba6fab4"},
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+     "5bc94fbc3221a5db94fae95ae7121a47"},
+    // Test cases 13 - 16 (AES-256)
+    {"0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "", "",
+     "530f8afbc74536b9a963b4f1c4cb738b"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "",
+     "00000000000000000000000000000000", "cea7403d4d606b6e074ec5d3baf39d18",
+     "d0d1c8a799996bf0265b98b5d48ab919"},
+    {"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+     "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+     "b094dac5d93471bdec1a502270e3cc6c"},
+    {"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+     "76fc6ece0f4e1768cddf8853bb2d551b"}
+};
+
+// Checking GCM known answers and PCLMULQDQ GHASH against table GHASH
+int gcm_selftest(void){
+    int ok = 1;
+
+    for(size_t v = 0; v < sizeof(gcm_vectors) / sizeof(gcm_vectors[0]); ++v){
+        u_int8_t key[32], iv[12], aad[20], plain[64], cipher[64], tag[16], out[64], out_tag[16];
+        int key_bytes = selftest_hex(gcm_vectors[v].key, key);
+        u_int32_t iv_bytes = selftest_hex(gcm_vectors[v].iv, iv);
+        u_int32_t aad_bytes = selftest_hex(gcm_vectors[v].aad, aad);
+        u_int32_t bytes = selftest_hex(gcm_vectors[v].plain, plain);
+        selftest_hex(gcm_vectors[v].cipher, cipher);
+        selftest_hex(gcm_vectors[v].tag, tag);
+
+        aes_ctx aes;
+        gcm_ctx g;
+        aes_init_ctx(&aes, key, key_bytes);
+        gcm_init_ctx(&g, &aes);
+
+        // Both GHASH implementations (table one is always available)
+        for(int pclmul = g.use_pclmul; pclmul >= 0; --pclmul){
+            g.use_pclmul = pclmul;
+            ok = ok && gcm_encrypt(&g, iv, iv_bytes, aad, aad_bytes, plain, out, bytes, out_tag) == 0;
+            ok = ok && memcmp(out, cipher, bytes) == 0 && memcmp(out_tag, tag, 16) == 0;
+            ok = ok && gcm_decrypt(&g, iv, iv_bytes, aad, aad_bytes, cipher, out, bytes, tag, 16) == 0 && memcmp(out, plain, bytes) == 0;
+
+            // Changed tag has to be rejected
+            tag[15] ^= 1;
+            ok = ok && gcm_decrypt(&g, iv, iv_bytes, aad, aad_bytes, cipher, out, bytes, tag, 16) == -1;
+            tag[15] ^= 1;
+        }
+        gcm_clear_ctx(&g);
+        aes_clear_ctx(&aes);
+    }
+
+    // Longer messages (interleaved 8 block chunks with tail) and IV not being 96 bits
+    u_int8_t key[16] = {0x0f, 0x1e, 0x2d, 0x3c, 0x4b, 0x5a, 0x69, 0x78, 0x87, 0x96, 0xa5, 0xb4, 0xc3, 0xd2, 0xe1, 0xf0};
+    u_int8_t iv[20], data[1000], a[1000], b[1000], tag_a[16], tag_b[16];
+    for(int i = 0; i < 1000; ++i){
+        data[i] = (u_int8_t)(i * 29 + 3);
+    }
+    for(int i = 0; i < 20; ++i){
+        iv[i] = (u_int8_t)(i * 5);
+    }
+    aes_ctx aes;
+    gcm_ctx g;
+    aes_init_ctx(&aes, key, 16);
+    gcm_init_ctx(&g, &aes);
+    for(u_int32_t len = 0; len <= 1000 && ok; len += 37){
+        gcm_encrypt(&g, iv, 12 + len % 9, data, len % 50, data, a, len, tag_a);
+        int saved = g.use_pclmul;
+        g.use_pclmul = 0;
+        gcm_encrypt(&g, iv, 12 + len % 9, data, len % 50, data, b, len, tag_b);
+        g.use_pclmul = saved;
+        ok = memcmp(a, b, len) == 0 && memcmp(tag_a, tag_b, 16) == 0;
+        ok = ok && gcm_decrypt(&g, iv, 12 + len % 9, data, len % 50, a, a, len, tag_a, 16) == 0 && memcmp(a, data, len) == 0;
+    }
+    // Empty IV has to be rejected in both directions
+    ok = ok && gcm_encrypt(&g, iv, 0, NULL, 0, data, a, 16, tag_a) == -1;
+    ok = ok && gcm_decrypt(&g, iv, 0, NULL, 0, a, a, 16, tag_a, 16) == -1;
+    gcm_clear_ctx(&g);
+    aes_clear_ctx(&aes);
+
+    printf("GCM (%s)   %s\n", aes_use_ni && aes_use_pclmul ? "PCLMUL" : "tables", ok ? "OK" : "FAILED");
+    return !ok;
+}
+
+// XTS test vectors (IEEE 1619 appendix B vectors 2 and 15, XTS-AES-256 vector 10 key with shorter data)
+struct {
+    const char* key;
+    u_int64_t sector;
+    const char* plain;
+    const char* cipher;
+} xts_vectors[] = {
+    {"1111111111111111111111111111111122222222222222222222222222222222", 0x3333333333ULL,
+     "4444444444444444444444444444444444444444444444444444444444444444",
+     "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0"},
+    {"fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x123456789aULL,
+     "000102030405060708090a0b0c0d0e0f10",
+     "6c1625db4671522d3d7599601de7ca09ed"},
+    {"27182818284590452353602874713526624977572470936999595749669676273141592653589793238462643383279502884197169399375105820974944592", 0xff,
+     "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f202122232425262728292a2b2c2d2e2f",
+     "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b5d31e276f8fe4a8d66b317f9ac683f44"},
+    {"27182818284590452353602874713526624977572470936999595749669676273141592653589793238462643383279502884197169399375105820974944592", 0xff,
+     "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f2021222324",
+     "1c3b3a102f770386e4836c99e370cf9bd500010cf8fe25a2cf7dce0764caf96cea00803f5e"}
+};
+
+// Checking XTS known answers, ciphertext stealing for every tail length and threads against one thread
+int xts_selftest(void){
+    int ok = 1;
+
+    for(size_t v = 0; v < sizeof(xts_vectors) / sizeof(xts_vectors[0]); ++v){
+        u_int8_t key[64], plain[48], cipher[48], out[48];
+        int key_bytes = selftest_hex(xts_vectors[v].key, key);
+        u_int32_t bytes = selftest_hex(xts_vectors[v].plain, plain);
+        selftest_hex(xts_vectors[v].cipher, cipher);
+
+        xts_ctx x;
+        ok = ok && xts_init_ctx(&x, key, key_bytes) == 0;
+        ok = ok && xts_encrypt(&x, xts_vectors[v].sector, bytes, plain, out, bytes, 1) == 0 && memcmp(out, cipher, bytes) == 0;
+        ok = ok && xts_decrypt(&x, xts_vectors[v].sector, bytes, out, out, bytes, 1) == 0 && memcmp(out, plain, bytes) == 0;
+        xts_clear_ctx(&x);
+    }
+
+    // Sectors of 16 - 80 bytes, sector written alone has to match the same sector inside longer data
+    u_int8_t key[64];
+    for(int i = 0; i < 64; ++i){
+        key[i] = (u_int8_t)(i * 11 + 7);
+    }
+    xts_ctx x;
+    xts_init_ctx(&x, key, 64);
+    u_int8_t data[5 * 80], a[5 * 80], b[80];
+    for(int i = 0; i < 5 * 80; ++i){
+        data[i] = (u_int8_t)(i * 29 + 3);
+    }
+    for(u_int32_t sector_bytes = 16; sector_bytes <= 80 && ok; ++sector_bytes){
+        u_int64_t bytes = 4 * sector_bytes + 16 + (sector_bytes - 16) / 2;
+        ok = xts_encrypt(&x, 1000, sector_bytes, data, a, bytes, 1) == 0;
+        ok = ok && xts_encrypt(&x, 1002, sector_bytes, &data[2 * sector_bytes], b, sector_bytes, 1) == 0;
+        ok = ok && memcmp(b, &a[2 * sector_bytes], sector_bytes) == 0;
+        ok = ok && xts_decrypt(&x, 1000, sector_bytes, a, a, bytes, 1) == 0 && memcmp(a, data, bytes) == 0;
+    }
+
+    // Threads (several sectors each, shorter last sector) against one thread
+    const u_int64_t big_bytes = 4 * XTS_MIN_THREAD_BYTES + 100;
+    u_int8_t* big = malloc(big_bytes);
+    u_int8_t* big_mt = malloc(big_bytes);
+    if(big == NULL || big_mt == NULL){
+        perror("Error while allocating memory");
+        ok = 0;
+    }
+    else {
+        for(u_int64_t i = 0; i < big_bytes; ++i){
+            big[i] = (u_int8_t)(i * 13 + 5);
+        }
+        memcpy(big_mt, big, big_bytes);
+        ok = ok && xts_encrypt(&x, 7, 4096, big, big, big_bytes, 1) == 0;
+        ok = ok && xts_encrypt(&x, 7, 4096, big_mt, big_mt, big_bytes, 4) == 0 && memcmp(big, big_mt, big_bytes) == 0;
+        ok = ok && xts_decrypt(&x, 7, 4096, big_mt, big_mt, big_bytes, 3) == 0;
+        for(u_int64_t i = 0; i < big_bytes && ok; ++i){
+            ok = big_mt[i] == (u_int8_t)(i * 13 + 5);
+        }
+    }
+    free(big);
+    free(big_mt);
+    xts_clear_ctx(&x);
+
+    printf("XTS                %s\n", ok ? "OK" : "FAILED");
+    return !ok;
+}
+
+// Keys used by key cache test threads - key k is 16 bytes of value k
+#define KEY_CACHE_TEST_KEYS 16
+
+typedef struct {
+    key_cache* cache;
+    u_int8_t expected[KEY_CACHE_TEST_KEYS][16];
+    int ok;
+} key_cache_test;
+
+void* key_cache_test_worker(void* arg){
+    key_cache_test* t = (key_cache_test*)arg;
+    unsigned int state = (unsigned int)(uintptr_t)&state;
+    for(int i = 0; i < 2000; ++i){
+        int k = rand_r(&state) % KEY_CACHE_TEST_KEYS;
+        u_int8_t key[16], block[16] = {0};
+        memset(key, k, 16);
+        const aes_ctx* ctx = key_cache_acquire(t->cache, key, 16);
+        if(ctx == NULL){
+            __atomic_store_n(&t->ok, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        aes_encrypt_block(ctx, block);
+        key_cache_release(t->cache, ctx);
+        if(memcmp(block, t->expected[k], 16) != 0){
+            __atomic_store_n(&t->ok, 0, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Key cache - LRU order, pinned entries survive eviction, contexts match fresh ones under several threads
+int key_cache_selftest(void){
+    key_cache c;
+    key_cache_test t;
+    u_int8_t key[KEY_CACHE_TEST_KEYS][16];
+    u_int64_t hits, misses, evictions;
+    int ok = key_cache_init(&c, 4) == 0;
+    if(!ok){
+        printf("Key cache          FAILED\n");
+        return 1;
+    }
+
+    for(int k = 0; k < KEY_CACHE_TEST_KEYS; ++k){
+        aes_ctx ctx;
+        memset(key[k], k, 16);
+        memset(t.expected[k], 0, 16);
+        aes_init_ctx_128(&ctx, key[k]);
+        aes_encrypt_block(&ctx, t.expected[k]);
+        aes_clear_ctx(&ctx);
+    }
+
+    // Keys 0 - 3 fill the cache, using key 1 again makes key 0 the least recently used
+    for(int k = 0; k < 4; ++k){
+        key_cache_release(&c, key_cache_acquire(&c, key[k], 16));
+    }
+    key_cache_release(&c, key_cache_acquire(&c, key[1], 16));
+    // Key 2 is held, so key 4 and key 5 evict key 0 and key 3 and never key 2
+    const aes_ctx* held = key_cache_acquire(&c, key[2], 16);
+    key_cache_release(&c, key_cache_acquire(&c, key[4], 16));
+    key_cache_release(&c, key_cache_acquire(&c, key[5], 16));
+    key_cache_stats(&c, &hits, &misses, &evictions);
+    ok = hits == 2 && misses == 6 && evictions == 2;
+    key_cache_release(&c, key_cache_acquire(&c, key[1], 16));
+    key_cache_release(&c, key_cache_acquire(&c, key[0], 16));
+    key_cache_stats(&c, &hits, &misses, &evictions);
+    ok = ok && hits == 3 && misses == 7 && evictions == 3;
+    u_int8_t block[16] = {0};
+    aes_encrypt_block(held, block);
+    ok = ok && memcmp(block, t.expected[2], 16) == 0;
+    key_cache_release(&c, held);
+    key_cache_destroy(&c);
+
+    // More keys than entries from several threads at once
+    ok = ok && key_cache_init(&c, 8) == 0;
+    if(ok){
+        pthread_t threads[4];
+        int created = 0;
+        t.cache = &c;
+        t.ok = 1;
+        for(; created < 4; ++created){
+            if(pthread_create(&threads[created], NULL, key_cache_test_worker, &t) != 0){
+                break;
+            }
+        }
+        for(int i = 0; i < created; ++i){
+            pthread_join(threads[i], NULL);
+        }
+        key_cache_stats(&c, &hits, &misses, &evictions);
+        ok = created == 4 && t.ok && hits + misses == 4 * 2000 && evictions == misses - 8;
+        key_cache_destroy(&c);
+    }
+
+    printf("Key cache          %s\n", ok ? "OK" : "FAILED");
+    return !ok;
+}
+
+// RFC 4493 section 4 test vectors (AES-128, the same 4 SP 800-38A plaintext blocks, 0, 16, 40 and 64 bytes)
+const char* cmac_tags[4] = {
+    "bb1d6929e95937287fa37d129b756746",
+    "070a16b46b4d4144f79bdd9dd04a287c",
+    "dfa66747de9ae63030ca32611497c827",
+    "51f0bebf7e3b9d92fc49741779363cfe"
+};
+
+// Checking CMAC subkeys and tags from RFC 4493 and batch against one by one with mixed key sizes
+int cmac_selftest(void){
+    u_int8_t key[32], mes[64], tag[16], out[16], k1[16], k2[16];
+    selftest_hex(sp800_38a_vectors[0].key, key);
+    selftest_hex(sp800_38a_plain, mes);
+    selftest_hex("fbeed618357133667c85e08f7236a8de", k1);
+    selftest_hex("f7ddac306ae266ccf90bc11ee46d513b", k2);
+
+    aes_ctx aes;
+    cmac_ctx cm;
+    aes_init_ctx(&aes, key, 16);
+    cmac_init_ctx(&cm, &aes);
+    int ok = memcmp(cm.k1, k1, 16) == 0 && memcmp(cm.k2, k2, 16) == 0;
+    const u_int64_t lengths[4] = {0, 16, 40, 64};
+    for(int v = 0; v < 4; ++v){
+        selftest_hex(cmac_tags[v], tag);
+        cmac_compute(&cm, mes, lengths[v], out);
+        ok = ok && memcmp(out, tag, 16) == 0 && cmac_verify(&cm, mes, lengths[v], tag, 16) == 0;
+        tag[0] ^= 1;
+        ok = ok && cmac_verify(&cm, mes, lengths[v], tag, 16) == -1;
+    }
+    cmac_clear_ctx(&cm);
+    aes_clear_ctx(&aes);
+
+    // 29 messages of 0 - 84 bytes under 3 keys of different size
+    enum { CMAC_TEST_JOBS = 29 };
+    u_int8_t data[100], tags[CMAC_TEST_JOBS][16];
+    aes_ctx keys[3];
+    cmac_ctx cms[3];
+    cmac_batch_job jobs[CMAC_TEST_JOBS];
+    for(int i = 0; i < 100; ++i){
+        data[i] = (u_int8_t)(i * 37 + 11);
+    }
+    for(int k = 0; k < 3; ++k){
+        for(int i = 0; i < 32; ++i){
+            key[i] = (u_int8_t)(k * 32 + i);
+        }
+        aes_init_ctx(&keys[k], key, 16 + 8 * k);
+        cmac_init_ctx(&cms[k], &keys[k]);
+    }
+    for(int j = 0; j < CMAC_TEST_JOBS; ++j){
+        jobs[j].ctx = &cms[j % 3];
+        jobs[j].in = &data[j % 7];
+        jobs[j].in_bytes = j * 3;
+        jobs[j].tag = tags[j];
+    }
+    cmac_batch(jobs, CMAC_TEST_JOBS);
+    for(int j = 0; j < CMAC_TEST_JOBS; ++j){
+        cmac_compute(jobs[j].ctx, jobs[j].in, jobs[j].in_bytes, out);
+        ok = ok && memcmp(out, tags[j], 16) == 0;
+    }
+    for(int k = 0; k < 3; ++k){
+        cmac_clear_ctx(&cms[k]);
+        aes_clear_ctx(&keys[k]);
+    }
+
+    printf("CMAC               %s\n", ok ? "OK" : "FAILED");
+    return !ok;
+}
+
+int iv_compare(const void* a, const void* b){
+    return memcmp(a, b, 16);
+}
+
+void* iv_thread_worker(void* arg){
+    generate_iv((u_int8_t*)arg);
+    return NULL;
+}
+
+// IV pool - no repeated IVs across several refills, other thread and forked child get different IVs
+int iv_pool_selftest(void){
+    const int count = 3 * IV_POOL_BYTES / 16;
+    u_int8_t (*ivs)[16] = malloc((count + 3) * 16);
+    if(ivs == NULL){
+        perror("Error while allocating memory");
+        return 1;
+    }
+
+    int ok = 1;
+    for(int i = 0; i < count && ok; ++i){
+        ok = generate_iv(ivs[i]) == 0;
+    }
+
+    pthread_t thread;
+    if(ok && pthread_create(&thread, NULL, iv_thread_worker, ivs[count]) == 0){
+        pthread_join(thread, NULL);
+    }
+    else {
+        ok = 0;
+    }
+
+    // Child sends its first IV through pipe, parent takes next one from its own pool
+    int fds[2];
+    if(ok && pipe(fds) == 0){
+        pid_t pid = fork();
+        if(pid == 0){
+            u_int8_t child_iv[16] = {0};
+            generate_iv(child_iv);
+            ssize_t written = write(fds[1], child_iv, 16);
+            _exit(written == 16 ? 0 : 1);
+        }
+        close(fds[1]);
+        ok = pid > 0 && read(fds[0], ivs[count + 1], 16) == 16 && generate_iv(ivs[count + 2]) == 0;
+        close(fds[0]);
+        if(pid > 0){
+            waitpid(pid, NULL, 0);
+        }
+    }
+    else {
+        ok = 0;
+    }
+
+    qsort(ivs, count + 3, 16, iv_compare);
+    for(int i = 1; i < count + 3 && ok; ++i){
+        ok = memcmp(ivs[i - 1], ivs[i], 16) != 0;
+    }
+    free(ivs);
+
+    printf("IV pool            %s\n", ok ? "OK" : "FAILED");
+    return !ok;
+}
+
+// Self-test comparing hardware backend with portable engines
+/*
+1. FIPS-197 appendix C known answers (AES-128, AES-192, AES-256) through every engine
+2. AES-NI key schedule against portable key expansion
+3. Random keys and blocks - every engine has to give bit identical results
+4. Modes - SP 800-38A (ECB, CBC, CTR), GCM and XTS known answers, threaded and caller buffer variants against reference
+*/
+int aes_selftest(void){
+    u_int8_t key[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+    };
+    u_int8_t plain[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+    };
+    // Appendix C.1, C.2 and C.3 - keys are first 16, 24 and 32 bytes of key above
+    const int key_sizes[3] = {16, 24, 32};
+    u_int8_t expected[3][16] = {
+        {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+        {0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91},
+        {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89}
+    };
+    void (*enc[4])(const aes_ctx*, u_int8_t*) = {aes_encrypt_block_bytes, aes_encrypt_block_ttable, aes_encrypt_block_bitslice, aes_encrypt_block_ni};
+    void (*dec[4])(const aes_ctx*, u_int8_t*) = {aes_decrypt_block_bytes, aes_decrypt_block_ttable, aes_decrypt_block_bitslice, aes_decrypt_block_ni};
+    const char* names[4] = {"byte", "T-table", "bitslice", "AES-NI"};
+    // CPU detection normally happens with first context, here we need it before
+    pthread_once(&aes_setup_once, aes_global_setup);
+    int engines = aes_use_ni ? 4 : 3;
+    int failed = 0;
+    aes_ctx ctx;
+    u_int8_t block[16];
+
+    printf("AES-NI: %s\n", aes_use_ni ? "available" : "not available");
+
+    for(int k = 0; k < 3; ++k){
+        aes_init_ctx(&ctx, key, key_sizes[k]);
+        // All engines are called directly, so bitsliced keys are needed even with AES-NI
+        aes_bs_init_ctx(&ctx);
+        for(int e = 0; e < engines; ++e){
+            memcpy(block, plain, 16);
+            enc[e](&ctx, block);
+            int ok = memcmp(block, expected[k], 16) == 0;
+            dec[e](&ctx, block);
+            ok = ok && memcmp(block, plain, 16) == 0;
+            printf("FIPS-197 AES-%d %-8s %s\n", key_sizes[k] * 8, names[e], ok ? "OK" : "FAILED");
+            failed |= !ok;
+        }
+    }
+
+    // Comparing engines on random data
+    srand(time(NULL));
+    int mismatches = 0;
+    for(int i = 0; i < 30000; ++i){
+        u_int8_t reference[16], input[16];
+        int key_bytes = key_sizes[i % 3];
+        for(int j = 0; j < 32; ++j){
+            key[j] = rand() & 0xFF;
+        }
+        for(int j = 0; j < 16; ++j){
+            input[j] = rand() & 0xFF;
+        }
+        aes_init_ctx(&ctx, key, key_bytes);
+        aes_bs_init_ctx(&ctx);
+
+        if(aes_use_ni){
+            for(int j = 0; j < 4 * (ctx.rounds + 1); ++j){
+                u_int8_t word[4];
+                store_be32(word, ctx.enc_words[j]);
+                if(memcmp(word, &ctx.ni_enc_keys[j * 4], 4) != 0){
+                    ++mismatches;
+                }
+            }
+        }
+
+        memcpy(reference, input, 16);
+        aes_encrypt_block_bytes(&ctx, reference);
+        for(int e = 1; e < engines; ++e){
+            memcpy(block, input, 16);
+            enc[e](&ctx, block);
+            mismatches += memcmp(block, reference, 16) != 0;
+            dec[e](&ctx, block);
+            mismatches += memcmp(block, input, 16) != 0;
+        }
+    }
+    printf("Random cross-check: %d mismatches\n", mismatches);
+    failed |= mismatches != 0;
+
+    // Bitsliced batch - one full group of 8 blocks and shorter padded group after it
+    int batch_ok = 1;
+    for(int k = 0; k < 3; ++k){
+        u_int8_t batch[13 * 16], reference[13 * 16];
+        for(int j = 0; j < 13 * 16; ++j){
+            batch[j] = reference[j] = rand() & 0xFF;
+        }
+        aes_init_ctx(&ctx, key, key_sizes[k]);
+        aes_bs_init_ctx(&ctx);
+        aes_encrypt_blocks_bitslice(&ctx, batch, 13);
+        for(int j = 0; j < 13; ++j){
+            aes_encrypt_block_bytes(&ctx, &reference[j * 16]);
+        }
+        batch_ok = batch_ok && memcmp(batch, reference, sizeof(batch)) == 0;
+        aes_decrypt_blocks_bitslice(&ctx, batch, 13);
+        for(int j = 0; j < 13; ++j){
+            aes_decrypt_block_bytes(&ctx, &reference[j * 16]);
+        }
+        batch_ok = batch_ok && memcmp(batch, reference, sizeof(batch)) == 0;
+    }
+    printf("Bitsliced batch    %s\n", batch_ok ? "OK" : "FAILED");
+    failed |= !batch_ok;
+
+    failed |= sp800_38a_selftest();
+
+    // Key and initial counter block from SP 800-38A F.5.1 for the rest of mode tests
+    u_int8_t ctr_key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    };
+    u_int8_t ctr_iv[16] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+    };
+    aes_init_ctx_128(&ctx, ctr_key);
+
+    // Threaded CTR has to give the same bytes as one thread (odd length to check the tail)
+    u_int64_t big_bytes = 4 * CTR_MIN_THREAD_BYTES + 7;
+    u_int8_t* one = malloc(big_bytes);
+    u_int8_t* many = malloc(big_bytes);
+    if(one == NULL || many == NULL){
+        perror("Error while allocating memory");
+        failed = 1;
+    }
+    else {
+        for(u_int64_t i = 0; i < big_bytes; ++i){
+            one[i] = many[i] = (u_int8_t)(i * 31);
+        }
+        ctr_crypt(&ctx, ctr_iv, one, one, big_bytes, 1);
+        ctr_crypt(&ctx, ctr_iv, many, many, big_bytes, 3);
+        int threads_ok = memcmp(one, many, big_bytes) == 0;
+        printf("CTR threads        %s\n", threads_ok ? "OK" : "FAILED");
+        failed |= !threads_ok;
+    }
+    free(one);
+    free(many);
+
+    // Pipelined and threaded CBC decryption against block by block reference
+    u_int32_t cbc_bytes = 4 * CBC_MIN_THREAD_BYTES + 5;
+    u_int8_t* cbc_mes = malloc(cbc_bytes);
+    u_int8_t* cbc_cipher = NULL;
+    if(cbc_mes != NULL){
+        for(u_int32_t i = 0; i < cbc_bytes; ++i){
+            cbc_mes[i] = (u_int8_t)(i * 7);
+        }
+        cbc_cipher = cbc_encryption_ctx(&ctx, cbc_mes, cbc_bytes);
+    }
+    if(cbc_cipher == NULL){
+        failed = 1;
+    }
+    else {
+        u_int32_t cipher_bytes = (cbc_bytes / 16 + 2) * 16;
+        int cbc_ok = 1;
+
+        // Reference - every block decrypted separately
+        u_int8_t block[16];
+        for(u_int32_t i = 16; i < cipher_bytes && cbc_ok; i += 16){
+            memcpy(block, &cbc_cipher[i], 16);
+            aes_decrypt_block_bytes(&ctx, block);
+            for(int j = 0; j < 16; ++j){
+                block[j] ^= cbc_cipher[i - 16 + j];
+            }
+            u_int32_t n = (i - 16 + 16 <= cbc_bytes) ? 16 : cbc_bytes - (i - 16);
+            cbc_ok = memcmp(block, &cbc_mes[i - 16], n) == 0;
+        }
+
+        for(int threads = 1; threads <= 4 && cbc_ok; threads += 3){
+            u_int32_t out_bytes = 0;
+            u_int8_t* out = cbc_decrypt_mt(&ctx, cbc_cipher, cipher_bytes, &out_bytes, threads);
+            cbc_ok = out != NULL && out_bytes == cbc_bytes && memcmp(out, cbc_mes, cbc_bytes) == 0;
+            free(out);
+        }
+        printf("CBC decrypt        %s\n", cbc_ok ? "OK" : "FAILED");
+        failed |= !cbc_ok;
+    }
+    free(cbc_mes);
+    free(cbc_cipher);
+
+    // Caller buffer and in place variants against allocating ones (every length around block boundary)
+    int into_ok = 1;
+    for(u_int32_t len = 0; len <= 48 && into_ok; ++len){
+        u_int8_t mes[48], record[48 + 32], plain[48 + 32], iv[16];
+        for(u_int32_t i = 0; i < len; ++i){
+            mes[i] = (u_int8_t)(i * 13 + len);
+        }
+
+        int64_t cipher_bytes = cbc_encrypt_into(&ctx, mes, len, record, sizeof(record));
+        u_int32_t out_bytes = 0;
+        u_int8_t* out = cbc_decrypt_ctx(&ctx, record, cipher_bytes, &out_bytes);
+        into_ok = cipher_bytes == (int64_t)cbc_encrypted_size(len) && out_bytes == len && (len == 0 || memcmp(out, mes, len) == 0);
+        free(out);
+
+        into_ok = into_ok && cbc_decrypt_into(&ctx, record, cipher_bytes, plain, len) == len && memcmp(plain, mes, len) == 0;
+
+        memcpy(record, mes, len);
+        cipher_bytes = cbc_encrypt_inplace(&ctx, iv, record, len, sizeof(record));
+        into_ok = into_ok && cbc_decrypt_inplace(&ctx, iv, record, cipher_bytes) == len && memcmp(record, mes, len) == 0;
+    }
+    printf("CBC into/in place  %s\n", into_ok ? "OK" : "FAILED");
+    failed |= !into_ok;
+
+    // Batch of messages with mixed key sizes and lengths against encrypting them one by one
+    enum { BATCH_JOBS = 37, BATCH_MAX_BYTES = 100 };
+    aes_ctx batch_ctx[5];
+    cbc_batch_job jobs[BATCH_JOBS];
+    u_int8_t batch_iv[BATCH_JOBS][16], batch_mes[BATCH_JOBS][BATCH_MAX_BYTES];
+    u_int8_t batch_out[BATCH_JOBS][BATCH_MAX_BYTES + 16], reference[BATCH_MAX_BYTES + 16];
+    for(int k = 0; k < 5; ++k){
+        for(int j = 0; j < 32; ++j){
+            key[j] = rand() & 0xFF;
+        }
+        aes_init_ctx(&batch_ctx[k], key, key_sizes[k % 3]);
+    }
+    for(int i = 0; i < BATCH_JOBS; ++i){
+        for(int j = 0; j < 16; ++j){
+            batch_iv[i][j] = rand() & 0xFF;
+        }
+        for(int j = 0; j < BATCH_MAX_BYTES; ++j){
+            batch_mes[i][j] = rand() & 0xFF;
+        }
+        jobs[i].ctx = &batch_ctx[i % 5];
+        jobs[i].iv = batch_iv[i];
+        jobs[i].in = batch_mes[i];
+        jobs[i].in_bytes = (i * 7) % (BATCH_MAX_BYTES + 1);
+        jobs[i].out = batch_out[i];
+    }
+    // Last job is encrypted in place
+    memcpy(batch_out[BATCH_JOBS - 1], batch_mes[BATCH_JOBS - 1], BATCH_MAX_BYTES);
+    jobs[BATCH_JOBS - 1].in = batch_out[BATCH_JOBS - 1];
+    cbc_encrypt_batch(jobs, BATCH_JOBS);
+
+    int batch_cbc_ok = 1;
+    for(int i = 0; i < BATCH_JOBS; ++i){
+        cbc_encrypt_padded(jobs[i].ctx, batch_iv[i], batch_mes[i], jobs[i].in_bytes, reference);
+        batch_cbc_ok = batch_cbc_ok && memcmp(reference, batch_out[i], cbc_padded_size(jobs[i].in_bytes)) == 0;
+    }
+    for(int k = 0; k < 5; ++k){
+        aes_clear_ctx(&batch_ctx[k]);
+    }
+    printf("CBC batch          %s\n", batch_cbc_ok ? "OK" : "FAILED");
+    failed |= !batch_cbc_ok;
+
+    failed |= gcm_selftest();
+    failed |= xts_selftest();
+    failed |= iv_pool_selftest();
+    failed |= key_cache_selftest();
+    failed |= cmac_selftest();
+
+    aes_clear_ctx(&ctx);
+    printf(failed ? ">> FAILURE <<\n" : ">> SUCCESS <<\n");
+    return failed;
+}
+
+// Reading at most max_bytes bytes written in hex, returns number of bytes or -1
+int parse_hex_bytes(const char* hex, u_int8_t* out, int max_bytes){
+    int bytes = strlen(hex) / 2;
+    if(strlen(hex) % 2 != 0 || bytes > max_bytes){
+        return -1;
+    }
+    for(int i = 0; i < bytes; ++i){
+        unsigned int byte;
+        if(sscanf(&hex[i * 2], "%2x", &byte) != 1){
+            return -1;
+        }
+        out[i] = byte;
+    }
+    return bytes;
+}
+
+// Reading key written as 32, 48 or 64 hex characters (AES-128, AES-192, AES-256)
+// Returns key length in bytes or -1
+int parse_hex_key(const char* hex, u_int8_t key[32]){
+    int key_bytes = parse_hex_bytes(hex, key, 32);
+    if(key_bytes != 16 && key_bytes != 24 && key_bytes != 32){
+        return -1;
+    }
+    return key_bytes;
+}
+
+// Two paths name the same file when device and inode match - comparing strings misses
+// "./f" and "f", symlinks and hard links
+int same_file(const struct stat* a, const struct stat* b){
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+// Opening output of cbc_file / cbc_file_pipeline for writing, returns descriptor or -1
+// It's truncated only after checking that it isn't the input file under another name
+// Devices (/dev/null, terminal) aren't truncated, out_stat tells remove_output_file what it was
+int open_output_file(const char* out_path, const struct stat* in_stat, struct stat* out_stat){
+    int fd = open(out_path, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1 || fstat(fd, out_stat) == -1){
+        perror("Error while opening output file");
+        if(fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+    if(same_file(in_stat, out_stat)){
+        fprintf(stderr, "Err: Output file can't be the input file\n");
+        close(fd);
+        return -1;
+    }
+    if(S_ISREG(out_stat->st_mode) && ftruncate(fd, 0) == -1){
+        perror("Error while truncating output file");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Failed run (wrong key, broken padding, I/O error) mustn't leave partial plaintext or cipher behind
+void remove_output_file(const char* out_path, const struct stat* out_stat){
+    if(S_ISREG(out_stat->st_mode) && unlink(out_path) == -1){
+        perror("Error while removing output file");
+    }
+}
+
+// Size of buffer files are streamed through - memory use doesn't depend on file size
+#define STREAM_BUF_SIZE (64 * 1024)
+
+// Encrypting or decrypting file with CBC stream
+int cbc_file(const char* key_hex, const char* in_path, const char* out_path, int decrypt){
+    u_int8_t key[32];
+    int key_bytes = parse_hex_key(key_hex, key);
+    if(key_bytes == -1){
+        fprintf(stderr, "Err: Key has to be 32, 48 or 64 hex characters\n");
+        return 1;
+    }
+
+    FILE* in = fopen(in_path, "rb");
+    struct stat in_stat, out_stat;
+    if(in == NULL || fstat(fileno(in), &in_stat) == -1){
+        perror("Error while opening input file");
+        if(in != NULL){
+            fclose(in);
+        }
+        return 1;
+    }
+    int out_fd = open_output_file(out_path, &in_stat, &out_stat);
+    FILE* out = out_fd == -1 ? NULL : fdopen(out_fd, "wb");
+    if(out == NULL){
+        if(out_fd != -1){
+            perror("Error while opening output file");
+            close(out_fd);
+            remove_output_file(out_path, &out_stat);
+        }
+        fclose(in);
+        return 1;
+    }
+
+    // Buffers hold plaintext, so they are per call (not static) and wiped before free
+    size_t buf_bytes = 2 * STREAM_BUF_SIZE + CBC_STREAM_OVERHEAD;
+    u_int8_t* in_buf = malloc(buf_bytes);
+    if(in_buf == NULL){
+        perror("Error while allocating memory");
+        secure_wipe(key, sizeof(key));
+        fclose(in);
+        fclose(out);
+        remove_output_file(out_path, &out_stat);
+        return 1;
+    }
+    u_int8_t* out_buf = in_buf + STREAM_BUF_SIZE;
+    aes_ctx ctx;
+    cbc_stream st;
+    u_int64_t out_bytes;
+    size_t n;
+    int ret = 0;
+
+    aes_init_ctx(&ctx, key, key_bytes);
+    if(cbc_stream_init(&st, &ctx, decrypt) == -1){
+        ret = 1;
+    }
+
+    while(ret == 0 && (n = fread(in_buf, 1, STREAM_BUF_SIZE, in)) > 0){
+        cbc_stream_update(&st, in_buf, n, out_buf, &out_bytes);
+        if(fwrite(out_buf, 1, out_bytes, out) != out_bytes){
+            perror("Error while writing data");
+            ret = 1;
+            break;
+        }
+    }
+    if(ferror(in)){
+        perror("Error while reading data");
+        ret = 1;
+    }
+
+    if(ret == 0){
+        if(cbc_stream_final(&st, out_buf, &out_bytes) == -1){
+            ret = 1;
+        }
+        else if(fwrite(out_buf, 1, out_bytes, out) != out_bytes){
+            perror("Error while writing data");
+            ret = 1;
+        }
+    }
+
+    aes_clear_ctx(&ctx);
+    secure_wipe(&st, sizeof(st));
+    secure_wipe(key, sizeof(key));
+    secure_wipe(in_buf, buf_bytes);
+    free(in_buf);
+    fclose(in);
+    if(fclose(out) != 0){
+        perror("Error while closing output file");
+        ret = 1;
+    }
+    if(ret != 0){
+        remove_output_file(out_path, &out_stat);
+    }
+    return ret;
+}
+
+// Pipelined file encryption
+/*
+cbc_file reads, encrypts and writes one buffer at a time, so disk waits for CPU and CPU waits for disk
+Pipeline keeps PIPE_SLOTS buffers in fixed pool and while chunk N is encrypted
+chunk N+1 (and further) is being read and chunk N-1 (and earlier) is being written
+
+Chunk i always uses slot i % PIPE_SLOTS and slot goes through states
+FREE -> (read) -> READ -> (cipher) -> CIPHERED -> (write) -> FREE
+so reading runs at most PIPE_SLOTS chunks ahead of writing and memory use doesn't depend on file size
+
+Cipher step is CBC stream (the same output as cbc_file), it has to go chunk after chunk,
+but reads and writes are done by kernel (io_uring) or other threads at the same time:
+- io_uring - reads and writes are submitted to kernel queue and calling thread only encrypts
+  and collects completions (no liburing, ring is set up with raw system calls)
+- fallback when io_uring isn't available (old kernel, disabled by seccomp or -DAES_NO_IO_URING) -
+  reader, cipher and writer threads passing slots to each other
+Buffers are aligned to pages, which direct I/O needs and which makes kernel copies cheaper
+*/
+#define PIPE_CHUNK_BYTES (1024 * 1024)
+#define PIPE_SLOTS 8
+#define PIPE_ALIGN 4096
+// Output of one chunk - update writes at most in_bytes + CBC_STREAM_OVERHEAD, final at most CBC_STREAM_OVERHEAD
+#define PIPE_OUT_BYTES (PIPE_CHUNK_BYTES + PIPE_ALIGN)
+
+enum {PIPE_FREE, PIPE_READING, PIPE_READ, PIPE_CIPHERED, PIPE_WRITING};
+
+typedef struct {
+    u_int8_t* in;
+    u_int8_t* out;
+    u_int64_t in_offset;
+    u_int64_t in_bytes;
+    u_int64_t out_offset;
+    u_int64_t out_bytes;
+    // Bytes already read / written (short reads and writes are continued)
+    u_int64_t done;
+    int state;
+} pipe_slot;
+
+typedef struct {
+    int in_fd;
+    int out_fd;
+    u_int64_t chunks;
+    u_int64_t in_size;
+    // Output offset of next ciphered chunk - cipher output isn't the same size as input (IV, padding)
+    u_int64_t out_offset;
+    cbc_stream st;
+    pipe_slot slots[PIPE_SLOTS];
+    // Fallback threads
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int error;
+} pipe_job;
+
+// Preparing slot for chunk i (empty file is one empty chunk, so padding still gets written)
+void pipe_slot_prepare(pipe_job* p, u_int64_t i){
+    pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+    slot->in_offset = i * PIPE_CHUNK_BYTES;
+    slot->in_bytes = p->in_size - slot->in_offset < PIPE_CHUNK_BYTES ? p->in_size - slot->in_offset : PIPE_CHUNK_BYTES;
+    slot->done = 0;
+}
+
+// Cipher step of chunk i - the last chunk gets stream final as well (padding)
+int pipe_cipher(pipe_job* p, u_int64_t i){
+    pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+    u_int64_t written, final_bytes = 0;
+    cbc_stream_update(&p->st, slot->in, slot->in_bytes, slot->out, &written);
+    if(i == p->chunks - 1 && cbc_stream_final(&p->st, slot->out + written, &final_bytes) == -1){
+        return -1;
+    }
+    slot->out_bytes = written + final_bytes;
+    slot->out_offset = p->out_offset;
+    slot->done = 0;
+    p->out_offset += slot->out_bytes;
+    return 0;
+}
+
+// Pipeline with reader, cipher and writer threads
+// One mutex and condition for all slots - there are 3 threads and every change is one slot state
+// error is written under the lock, but loops check it without the lock, so it's accessed atomically
+int pipe_failed(pipe_job* p){
+    return __atomic_load_n(&p->error, __ATOMIC_RELAXED);
+}
+
+void pipe_wait(pipe_job* p, pipe_slot* slot, int state){
+    pthread_mutex_lock(&p->lock);
+    while(slot->state != state && !pipe_failed(p)){
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipe_fail(pipe_job* p){
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->error, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipe_set(pipe_job* p, pipe_slot* slot, int state, int error){
+    pthread_mutex_lock(&p->lock);
+    slot->state = state;
+    __atomic_fetch_or(&p->error, error, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void* pipe_reader(void* arg){
+    pipe_job* p = (pipe_job*)arg;
+    for(u_int64_t i = 0; i < p->chunks && !pipe_failed(p); ++i){
+        pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+        pipe_wait(p, slot, PIPE_FREE);
+        pipe_slot_prepare(p, i);
+        int error = 0;
+        while(!pipe_failed(p) && slot->done < slot->in_bytes){
+            ssize_t n = pread(p->in_fd, slot->in + slot->done, slot->in_bytes - slot->done, slot->in_offset + slot->done);
+            if(n <= 0){
+                if(n == -1 && errno == EINTR){
+                    continue;
+                }
+                perror("Error while reading data");
+                error = 1;
+                break;
+            }
+            slot->done += n;
+        }
+        pipe_set(p, slot, PIPE_READ, error);
+    }
+    return NULL;
+}
+
+void* pipe_cipher_worker(void* arg){
+    pipe_job* p = (pipe_job*)arg;
+    for(u_int64_t i = 0; i < p->chunks && !pipe_failed(p); ++i){
+        pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+        pipe_wait(p, slot, PIPE_READ);
+        if(pipe_failed(p)){
+            break;
+        }
+        int error = pipe_cipher(p, i) == -1;
+        pipe_set(p, slot, PIPE_CIPHERED, error);
+    }
+    return NULL;
+}
+
+// Writer is the calling thread
+int pipe_run_threads(pipe_job* p){
+    pthread_t reader, cipher;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    // Stages wait for each other, so one of them can't be run later by calling thread like in aes_run_jobs
+    int created = 0;
+    if(pthread_create(&reader, NULL, pipe_reader, p) == 0){
+        ++created;
+        if(pthread_create(&cipher, NULL, pipe_cipher_worker, p) == 0){
+            ++created;
+        }
+    }
+    if(created < 2){
+        perror("pthread_create");
+        pipe_fail(p);
+    }
+
+    for(u_int64_t i = 0; i < p->chunks && !pipe_failed(p); ++i){
+        pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+        pipe_wait(p, slot, PIPE_CIPHERED);
+        int error = 0;
+        while(!pipe_failed(p) && slot->done < slot->out_bytes){
+            ssize_t n = pwrite(p->out_fd, slot->out + slot->done, slot->out_bytes - slot->done, slot->out_offset + slot->done);
+            if(n <= 0){
+                if(n == -1 && errno == EINTR){
+                    continue;
+                }
+                perror("Error while writing data");
+                error = 1;
+                break;
+            }
+            slot->done += n;
+        }
+        pipe_set(p, slot, PIPE_FREE, error);
+    }
+
+    if(created > 0){
+        pthread_join(reader, NULL);
+    }
+    if(created > 1){
+        pthread_join(cipher, NULL);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+    return pipe_failed(p) ? -1 : 0;
+}
+
+#ifdef AES_IO_URING
+// io_uring rings shared with kernel
+typedef struct {
+    int fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_bytes;
+    size_t cq_ring_bytes;
+    struct io_uring_sqe* sqes;
+    size_t sqes_bytes;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    // SQEs filled but not submitted yet
+    unsigned pending;
+} pipe_ring;
+
+// io_uring_setup works since Linux 5.1, but IORING_OP_READ / IORING_OP_WRITE came in 5.6
+// Kernel is asked which operations it has (kernels older than the probe itself fail the call)
+int pipe_ring_has_ops(int fd){
+    size_t bytes = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, bytes);
+    if(probe == NULL){
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_WRITE &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+// Setting up ring for entries operations, returns 0 or -1 (io_uring or its read / write not available)
+int pipe_ring_init(pipe_ring* r, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(r->fd < 0){
+        return -1;
+    }
+    if(!pipe_ring_has_ops(r->fd)){
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels keep both rings in one mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_ring_bytes > r->sq_ring_bytes){
+            r->sq_ring_bytes = r->cq_ring_bytes;
+        }
+        r->cq_ring_bytes = r->sq_ring_bytes;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        r->cq_ring = mmap(NULL, r->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED){
+        if(r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring){
+            munmap(r->cq_ring, r->cq_ring_bytes);
+        }
+        munmap(r->sq_ring, r->sq_ring_bytes);
+        close(r->fd);
+        return -1;
+    }
+
+    u_int8_t* sq = (u_int8_t*)r->sq_ring;
+    u_int8_t* cq = (u_int8_t*)r->cq_ring;
+    r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + params.sq_off.array);
+    r->cq_head = (unsigned*)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void pipe_ring_clear(pipe_ring* r){
+    munmap(r->sqes, r->sqes_bytes);
+    if(r->cq_ring != r->sq_ring){
+        munmap(r->cq_ring, r->cq_ring_bytes);
+    }
+    munmap(r->sq_ring, r->sq_ring_bytes);
+    close(r->fd);
+}
+
+// Queueing read or write of slot (rest of it after short operation), user_data is slot index
+void pipe_ring_queue(pipe_ring* r, int op, int fd, u_int8_t* buf, u_int64_t bytes, u_int64_t offset, u_int64_t slot){
+    // Only this thread writes SQ tail, kernel reads it after release store below
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (u_int64_t)(uintptr_t)buf;
+    sqe->len = bytes;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->pending;
+}
+
+// Submitting queued operations and waiting for at least wait_for completions
+int pipe_ring_enter(pipe_ring* r, unsigned wait_for){
+    for(;;){
+        int n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(n >= 0){
+            r->pending -= n;
+            return 0;
+        }
+        if(errno != EINTR){
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+void pipe_uring_queue_slot(pipe_ring* r, pipe_job* p, u_int64_t i){
+    pipe_slot* slot = &p->slots[i % PIPE_SLOTS];
+    if(slot->state == PIPE_READING){
+        pipe_ring_queue(r, IORING_OP_READ, p->in_fd, slot->in + slot->done, slot->in_bytes - slot->done, slot->in_offset + slot->done, i % PIPE_SLOTS);
+    }
+    else {
+        pipe_ring_queue(r, IORING_OP_WRITE, p->out_fd, slot->out + slot->done, slot->out_bytes - slot->done, slot->out_offset + slot->done, i % PIPE_SLOTS);
+    }
+}
+
+// Pipeline with io_uring - returns 0, -1 on error or 1 when io_uring isn't available (nothing was done)
+int pipe_run_uring(pipe_job* p){
+    pipe_ring r;
+    if(pipe_ring_init(&r, PIPE_SLOTS) == -1){
+        return 1;
+    }
+
+    // Every slot has at most one operation in flight, so ring never overflows
+    u_int64_t next_read = 0, next_cipher = 0, written = 0;
+    int ret = 0;
+    while(written < p->chunks && ret == 0){
+        // Reading ahead into every free slot
+        while(next_read < p->chunks && next_read < written + PIPE_SLOTS){
+            pipe_slot* slot = &p->slots[next_read % PIPE_SLOTS];
+            pipe_slot_prepare(p, next_read);
+            slot->state = PIPE_READING;
+            if(slot->in_bytes == 0){
+                slot->state = PIPE_READ;
             }
-            // Else we calculate padding as 16 - size of last block
             else {
-                padding_value = 16 - last_block_size;
+                pipe_uring_queue_slot(&r, p, next_read);
             }
-            // We copy what is left of original message (if last block size is zero it means there's nothing more to copy)
-            memcpy(data_block, &mes[i * 16], last_block_size);
-            
-            // We add padding bytes
-            for(int p = last_block_size; p < 16; ++p){
-                data_block[p] = padding_value;
+            ++next_read;
+        }
+
+        // Kernel starts queued reads and writes before we spend time encrypting
+        if(r.pending > 0 && pipe_ring_enter(&r, 0) == -1){
+            ret = -1;
+            break;
+        }
+
+        // Collecting completions
+        int progress = 0;
+        unsigned head = *r.cq_head;
+        while(head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe* cqe = &r.cqes[head & *r.cq_mask];
+            pipe_slot* slot = &p->slots[cqe->user_data];
+            int res = cqe->res;
+            ++head;
+            // Chunk index of this slot - it's between written and next_read
+            u_int64_t i = written + (cqe->user_data + PIPE_SLOTS - written % PIPE_SLOTS) % PIPE_SLOTS;
+            progress = 1;
+            if(res <= 0){
+                // Other operations in flight usually fail the same way, first error is enough
+                if(ret == 0){
+                    errno = res < 0 ? -res : EIO;
+                    perror(slot->state == PIPE_READING ? "Error while reading data" : "Error while writing data");
+                }
+                // Nothing of this slot is in flight anymore
+                slot->state = PIPE_FREE;
+                ret = -1;
+                continue;
+            }
+            slot->done += res;
+            if(slot->state == PIPE_READING){
+                if(slot->done < slot->in_bytes){
+                    pipe_uring_queue_slot(&r, p, i);
+                }
+                else {
+                    slot->state = PIPE_READ;
+                }
+            }
+            else {
+                if(slot->done < slot->out_bytes){
+                    pipe_uring_queue_slot(&r, p, i);
+                }
+                else {
+                    slot->state = PIPE_FREE;
+                }
             }
-        
-        } 
-        // If it's not last block of data - we regulary copy 16 bytes from message
-        else {
-            memcpy(data_block, &mes[i * 16], 16);
         }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
 
-        // Performing XOR with previous data block
-        for(int j = 0; j < 16; ++j){
-            data_block[j] = data_block[j] ^ previous_block[j];
+        // Slots are written in order, write completions can come in any order
+        while(written < next_cipher && p->slots[written % PIPE_SLOTS].state == PIPE_FREE){
+            ++written;
         }
 
-        // Encrypting the XORed value
-        aes_encrypt_128(key, data_block);
+        // Cipher step for every chunk which is already read
+        while(ret == 0 && next_cipher < next_read && p->slots[next_cipher % PIPE_SLOTS].state == PIPE_READ){
+            pipe_slot* slot = &p->slots[next_cipher % PIPE_SLOTS];
+            if(pipe_cipher(p, next_cipher) == -1){
+                ret = -1;
+                break;
+            }
+            slot->state = PIPE_WRITING;
+            if(slot->out_bytes == 0){
+                slot->state = PIPE_FREE;
+            }
+            else {
+                pipe_uring_queue_slot(&r, p, next_cipher);
+            }
+            ++next_cipher;
+            progress = 1;
+        }
 
-        // Copying encrypted block data into output (starting from the right place) and into previous block
-        memcpy(&output[output_counter * 16], data_block, 16);
-        memcpy(previous_block, data_block, 16);
+        // Nothing changed - sleeping until kernel finishes something (something is always in flight then)
+        if(ret == 0 && !progress && written < p->chunks && pipe_ring_enter(&r, 1) == -1){
+            ret = -1;
+        }
+    }
 
-        // Incrementing output counter
-        ++output_counter;
+    // Operations still in flight use our buffers, they have to finish before buffers are freed
+    if(ret == -1){
+        u_int64_t in_flight = 0;
+        for(int s = 0; s < PIPE_SLOTS; ++s){
+            in_flight += p->slots[s].state == PIPE_READING || p->slots[s].state == PIPE_WRITING;
+        }
+        // Failed operations were already marked as free, waiting for the rest is enough
+        while(in_flight > 0 && pipe_ring_enter(&r, 1) == 0){
+            unsigned head = *r.cq_head;
+            while(head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE) && in_flight > 0){
+                ++head;
+                --in_flight;
+            }
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        }
     }
 
-    return output;
+    pipe_ring_clear(&r);
+    return ret;
 }
+#endif
 
-// CBC decryption
-u_int8_t* cbc_decrypt_128(const u_int8_t* key, u_int8_t* cipher, u_int32_t cipher_bytes, u_int32_t* mes_bytes){
-    // Just like in CBC encryption - creating control variables
-    u_int8_t previous_block_encrypted[16], current_block[16];
-    u_int32_t cipher_blocks = cipher_bytes/16, mes_blocks = cipher_blocks - 1;
-    u_int8_t* output = malloc((cipher_blocks - 1) * 16);
-    if(output == NULL){
-        perror("Error while allocating memory");
-        return NULL;
+// Encrypting or decrypting file with CBC stream like cbc_file, but with pipelined I/O
+int cbc_file_pipeline(const char* key_hex, const char* in_path, const char* out_path, int decrypt){
+    u_int8_t key[32];
+    int key_bytes = parse_hex_key(key_hex, key);
+    if(key_bytes == -1){
+        fprintf(stderr, "Err: Key has to be 32, 48 or 64 hex characters\n");
+        return 1;
     }
 
-    // Extract IV as a previous block - IV is not encrypted
-    memcpy(previous_block_encrypted, cipher, 16);
+    int in_fd = open(in_path, O_RDONLY);
+    if(in_fd == -1){
+        perror("Error while opening input file");
+        return 1;
+    }
+    struct stat in_stat;
+    if(fstat(in_fd, &in_stat) == -1){
+        perror("Error while reading input file size");
+        close(in_fd);
+        return 1;
+    }
+    // Chunks are read at offsets computed from file size - pipe or FIFO would look like an empty file
+    if(!S_ISREG(in_stat.st_mode)){
+        fprintf(stderr, "Err: Pipeline input has to be a regular file\n");
+        close(in_fd);
+        return 1;
+    }
+    struct stat out_stat;
+    int out_fd = open_output_file(out_path, &in_stat, &out_stat);
+    if(out_fd == -1){
+        close(in_fd);
+        return 1;
+    }
+    // Kernel can read ahead more aggressively
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    // Decrypting message
-    for(int i = 0; i < mes_blocks; ++i) {
-        // Copying next cipher block as current block
-        memcpy(current_block, &cipher[(i + 1) * 16], 16);
+    // One aligned allocation for the whole pool - input and output buffer for every slot
+    pipe_job* p = calloc(1, sizeof(pipe_job));
+    u_int8_t* pool = NULL;
+    if(p == NULL || posix_memalign((void**)&pool, PIPE_ALIGN, (size_t)PIPE_SLOTS * (PIPE_CHUNK_BYTES + PIPE_OUT_BYTES)) != 0){
+        perror("Error while allocating memory");
+        free(p);
+        close(in_fd);
+        close(out_fd);
+        remove_output_file(out_path, &out_stat);
+        return 1;
+    }
+    for(int s = 0; s < PIPE_SLOTS; ++s){
+        p->slots[s].in = pool + (size_t)s * (PIPE_CHUNK_BYTES + PIPE_OUT_BYTES);
+        p->slots[s].out = p->slots[s].in + PIPE_CHUNK_BYTES;
+        p->slots[s].state = PIPE_FREE;
+    }
+    p->in_fd = in_fd;
+    p->out_fd = out_fd;
+    p->in_size = in_stat.st_size;
+    p->chunks = p->in_size == 0 ? 1 : (p->in_size + PIPE_CHUNK_BYTES - 1) / PIPE_CHUNK_BYTES;
 
-        // Decrypting current block
-        aes_decrypt_128(key, current_block);
-        
-        // XORing current block with encrypted previous block (on firts iteration it's unencrypted IV)
-        for(int j = 0; j < 16; ++j) {
-            current_block[j] = current_block[j] ^ previous_block_encrypted[j];
+    aes_ctx ctx;
+    aes_init_ctx(&ctx, key, key_bytes);
+    int ret = cbc_stream_init(&p->st, &ctx, decrypt);
+    if(ret == 0){
+#ifdef AES_IO_URING
+        ret = pipe_run_uring(p);
+        if(ret == 1){
+            ret = pipe_run_threads(p);
         }
+#else
+        ret = pipe_run_threads(p);
+#endif
+    }
+
+    aes_clear_ctx(&ctx);
+    secure_wipe(key, sizeof(key));
+    secure_wipe(pool, (size_t)PIPE_SLOTS * (PIPE_CHUNK_BYTES + PIPE_OUT_BYTES));
+    secure_wipe(p, sizeof(*p));
+    free(pool);
+    free(p);
+    close(in_fd);
+    if(close(out_fd) != 0){
+        perror("Error while closing output file");
+        ret = -1;
+    }
+    if(ret != 0){
+        remove_output_file(out_path, &out_stat);
+    }
+    return ret != 0;
+}
+
+// Memory-mapped encryption of files
+/*
+Files are mapped into memory and CTR / XTS run directly over mapped pages, so the only data
+movement is cipher's own loads and stores (no read / write copies through user buffers)
+- out_path NULL (or the same as in_path) encrypts file in place, otherwise output file is created
+  with the same size - both modes keep data length, so in place works without moving anything
+- CTR - counter starts at iv for the first byte of file, encryption and decryption are the same
+- XTS - MMAP_SECTOR_BYTES sectors numbered from 0 (sector number is its offset / sector size)
+
+Data is processed in windows - while one window is encrypted kernel is already asked (MADV_WILLNEED)
+to read the next one, MADV_SEQUENTIAL lets it drop pages behind us early
+Output space is reserved up front (posix_fallocate), because full disk would otherwise show up
+as SIGBUS on a store into mapped page instead of an error
+With huge_pages mappings are marked MADV_HUGEPAGE - fewer TLB misses and page faults where kernel
+supports transparent huge pages for the file (tmpfs, some file systems), ignored elsewhere
+*/
+#define MMAP_WINDOW_BYTES (64ULL << 20)
+#define MMAP_SECTOR_BYTES 4096
 
-        // Copying decrypted block into output
-        memcpy(&output[i * 16], current_block, 16);
+typedef enum {MMAP_CTR, MMAP_XTS_ENCRYPT, MMAP_XTS_DECRYPT} mmap_mode;
 
-        // Copying next cipher block (current block but encrypted) into previous block encrypted
-        memcpy(previous_block_encrypted, &cipher[(i + 1) * 16], 16);
+typedef struct {
+    int fd;
+    u_int8_t* data;
+    u_int64_t bytes;
+} mmap_file;
+
+// Mapping opened file (bytes > 0), returns 0 or -1
+int mmap_file_map(mmap_file* f, int writable, int huge_pages){
+    f->data = mmap(NULL, f->bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f->fd, 0);
+    if(f->data == MAP_FAILED){
+        perror("mmap");
+        f->data = NULL;
+        return -1;
+    }
+    // Hints only - mapping works the same when kernel doesn't take them
+    madvise(f->data, f->bytes, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if(huge_pages){
+        madvise(f->data, f->bytes, MADV_HUGEPAGE);
     }
+#endif
+    return 0;
+}
 
-    // Handling padding
-    u_int8_t padding = output[mes_blocks * 16 - 1];
+void mmap_file_close(mmap_file* f){
+    if(f->data != NULL){
+        munmap(f->data, f->bytes);
+    }
+    if(f->fd != -1){
+        close(f->fd);
+    }
+}
 
-    if(padding == 0 || padding > 16){
-        fprintf(stderr, "Err: Incorrect padding value\n");
-        free(output);
-        return NULL;
+// Running mode over [offset, offset + bytes) of mapped data
+int mmap_crypt_window(mmap_mode mode, const aes_ctx* ctx, const xts_ctx* x, const u_int8_t iv[16], const u_int8_t* in, u_int8_t* out, u_int64_t offset, u_int64_t bytes, int threads){
+    if(mode == MMAP_CTR){
+        // Window starts at block offset / 16, windows are multiples of 16 bytes
+        u_int8_t counter[16];
+        memcpy(counter, iv, 16);
+        ctr_add_128(counter, offset / 16);
+        return ctr_crypt(ctx, counter, in + offset, out + offset, bytes, threads);
+    }
+    if(mode == MMAP_XTS_ENCRYPT){
+        return xts_encrypt(x, offset / MMAP_SECTOR_BYTES, MMAP_SECTOR_BYTES, in + offset, out + offset, bytes, threads);
     }
+    return xts_decrypt(x, offset / MMAP_SECTOR_BYTES, MMAP_SECTOR_BYTES, in + offset, out + offset, bytes, threads);
+}
 
-    u_int32_t out_encrypted_bytes = mes_blocks * 16 - padding;
-    u_int8_t* tmp_output;
-    tmp_output = realloc(output, out_encrypted_bytes);
-    if(tmp_output == NULL && out_encrypted_bytes > 0){
-        perror("Error while reallocating memory");
-        free(output);
-        return NULL;
+// Encrypting / decrypting file through memory mapping
+// key is AES key for CTR (16, 24 or 32 bytes, iv is initial counter) or XTS key (32 or 64 bytes, iv unused)
+// Returns 0 or -1
+int mmap_crypt_file(const char* in_path, const char* out_path, mmap_mode mode, const u_int8_t* key, int key_bytes, const u_int8_t iv[16], int threads, int huge_pages){
+    int in_place = out_path == NULL;
+    mmap_file in = {-1, NULL, 0}, out = {-1, NULL, 0};
+    aes_ctx ctx;
+    xts_ctx x;
+    int ret = -1;
+
+    if(mode == MMAP_CTR ? aes_init_ctx(&ctx, key, key_bytes) : xts_init_ctx(&x, key, key_bytes)){
+        return -1;
+    }
+
+    in.fd = open(in_path, in_place ? O_RDWR : O_RDONLY);
+    struct stat in_stat;
+    if(in.fd == -1 || fstat(in.fd, &in_stat) == -1){
+        perror("Error while opening input file");
+        goto cleanup;
+    }
+    in.bytes = in_stat.st_size;
+    // XTS can't encrypt sector shorter than one block (see xts_crypt)
+    if(mode != MMAP_CTR && in.bytes % MMAP_SECTOR_BYTES != 0 && in.bytes % MMAP_SECTOR_BYTES < 16){
+        fprintf(stderr, "Err: XTS needs last %d byte sector to have at least 16 bytes\n", MMAP_SECTOR_BYTES);
+        goto cleanup;
+    }
+
+    if(!in_place){
+        // Without O_TRUNC - output can be the input under another name and it's truncated only when it isn't
+        out.fd = open(out_path, O_RDWR | O_CREAT, 0644);
+        struct stat out_stat;
+        if(out.fd == -1 || fstat(out.fd, &out_stat) == -1){
+            perror("Error while opening output file");
+            goto cleanup;
+        }
+        if(same_file(&in_stat, &out_stat)){
+            // Output descriptor is opened for writing, so it replaces read-only input one
+            close(in.fd);
+            in.fd = out.fd;
+            out.fd = -1;
+            in_place = 1;
+        }
+    }
+    if(!in_place){
+        if(ftruncate(out.fd, 0) == -1){
+            perror("Error while truncating output file");
+            goto cleanup;
+        }
+        out.bytes = in.bytes;
+        if(out.bytes > 0){
+            int err = posix_fallocate(out.fd, 0, out.bytes);
+            // Some file systems can't reserve space, then file is only extended
+            if(err == EINVAL || err == EOPNOTSUPP){
+                err = ftruncate(out.fd, out.bytes) == -1 ? errno : 0;
+            }
+            if(err != 0){
+                errno = err;
+                perror("Error while reserving space for output file");
+                goto cleanup;
+            }
+        }
+    }
+    if(in.bytes == 0){
+        ret = 0;
+        goto cleanup;
+    }
+
+    if(mmap_file_map(&in, in_place, huge_pages) == -1 || (!in_place && mmap_file_map(&out, 1, huge_pages) == -1)){
+        goto cleanup;
+    }
+    u_int8_t* dst = in_place ? in.data : out.data;
+
+    ret = 0;
+    for(u_int64_t offset = 0; offset < in.bytes && ret == 0; offset += MMAP_WINDOW_BYTES){
+        u_int64_t bytes = in.bytes - offset < MMAP_WINDOW_BYTES ? in.bytes - offset : MMAP_WINDOW_BYTES;
+        // Read-ahead of the next window runs while this one is encrypted
+        if(offset + bytes < in.bytes){
+            u_int64_t next = in.bytes - offset - bytes < MMAP_WINDOW_BYTES ? in.bytes - offset - bytes : MMAP_WINDOW_BYTES;
+            madvise(in.data + offset + bytes, next, MADV_WILLNEED);
+        }
+        ret = mmap_crypt_window(mode, &ctx, &x, iv, in.data, dst, offset, bytes, threads);
+    }
+
+cleanup:
+    mmap_file_close(&in);
+    mmap_file_close(&out);
+    if(mode == MMAP_CTR){
+        aes_clear_ctx(&ctx);
     }
     else {
-        output = tmp_output;
+        xts_clear_ctx(&x);
     }
-    if(mes_bytes != NULL){
-        *mes_bytes = out_encrypted_bytes;
+    return ret;
+}
+
+// Benchmark (aes_bench.c) includes this file, so main is left out there
+#ifndef AES_NO_MAIN
+// Command line of memory-mapped modes, all CPUs are used
+int mmap_main(int argc, char* argv[]){
+    int huge_pages = strcmp(argv[argc - 1], "--huge") == 0;
+    int ctr = strcmp(argv[1], "mmap-ctr") == 0;
+    int args = argc - huge_pages - 2 - ctr;
+    if(args != 2 && args != 3){
+        fprintf(stderr, "Err: Incorrect number of arguments\n");
+        return 1;
     }
 
-    return output;
+    u_int8_t key[64], iv[16] = {0};
+    int key_bytes = parse_hex_bytes(argv[2], key, 64);
+    if(ctr && (parse_hex_bytes(argv[3], iv, 16) != 16 || (key_bytes != 16 && key_bytes != 24 && key_bytes != 32))){
+        fprintf(stderr, "Err: Key has to be 32, 48 or 64 and IV 32 hex characters\n");
+        return 1;
+    }
+    if(!ctr && key_bytes != 32 && key_bytes != 64){
+        fprintf(stderr, "Err: XTS key has to be 64 or 128 hex characters\n");
+        return 1;
+    }
+
+    const char* in_path = argv[3 + ctr];
+    const char* out_path = args == 3 ? argv[4 + ctr] : NULL;
+    mmap_mode mode = ctr ? MMAP_CTR : strcmp(argv[1], "mmap-xts-decrypt") == 0 ? MMAP_XTS_DECRYPT : MMAP_XTS_ENCRYPT;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = mmap_crypt_file(in_path, out_path, mode, key, key_bytes, iv, threads > 0 ? threads : 1, huge_pages);
+    secure_wipe(key, sizeof(key));
+    return ret != 0;
 }
 
-int main(){
+int main(int argc, char* argv[]){
+    if(argc > 1){
+        if(strcmp(argv[1], "selftest") == 0){
+            return aes_selftest();
+        }
+        if((strcmp(argv[1], "encrypt") == 0 || strcmp(argv[1], "decrypt") == 0) && argc == 5){
+            return cbc_file(argv[2], argv[3], argv[4], strcmp(argv[1], "decrypt") == 0);
+        }
+        // The same output as encrypt / decrypt, with reading, encryption and writing running at the same time
+        if((strcmp(argv[1], "pipe-encrypt") == 0 || strcmp(argv[1], "pipe-decrypt") == 0) && argc == 5){
+            return cbc_file_pipeline(argv[2], argv[3], argv[4], strcmp(argv[1], "pipe-decrypt") == 0);
+        }
+        // Memory-mapped CTR / XTS, without output file the input file is encrypted in place
+        if(strcmp(argv[1], "mmap-ctr") == 0 || strcmp(argv[1], "mmap-xts-encrypt") == 0 || strcmp(argv[1], "mmap-xts-decrypt") == 0){
+            return mmap_main(argc, argv);
+        }
+        fprintf(stderr, "Usage: %s selftest\n", argv[0]);
+        fprintf(stderr, "       %s encrypt | decrypt | pipe-encrypt | pipe-decrypt <key_hex> <in> <out>\n", argv[0]);
+        fprintf(stderr, "       %s mmap-ctr <key_hex> <iv_hex> <file> [out] [--huge]\n", argv[0]);
+        fprintf(stderr, "       %s mmap-xts-encrypt | mmap-xts-decrypt <xts_key_hex> <file> [out] [--huge]\n", argv[0]);
+        return 1;
+    }
+
     unsigned char mes[16] = {
         'a', 'a', 'b', 'b', 'c', 'c', 'd', 'd',
         'e', 'e', 'f', 'f', 'g', 'g', 'h', 'h'
@@ -664,9 +5973,15 @@ int main(){
     printf("Szyfrogram (hex): ");
     print_hex(&output[16], 32);
 
-    aes_decrypt_128(key, mes);
+    // One block without any mode - encrypting and decrypting it back gives the message again
+    unsigned char block[16];
+    memcpy(block, mes, 16);
+    aes_encrypt_128(key, block);
+    printf("Blok ECB (hex):   ");
+    print_hex(block, 16);
+    aes_decrypt_128(key, block);
     printf("Wiadomość (hex):  ");
-    print_hex(mes, 16);
+    print_hex(block, 16);
 
     unsigned char* output_decrypted = cbc_decrypt_128(key, output, 48, NULL);
 
@@ -677,4 +5992,5 @@ int main(){
     free(output_decrypted);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
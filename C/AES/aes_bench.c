@@ -0,0 +1,447 @@
+// Benchmark of AES engines and modes
+/*
+Build: gcc -O2 -pthread aes_bench.c -o aes_bench
+Usage: ./aes_bench [max_bytes] [max_threads]
+
+1. Known-answer tests (FIPS-197, SP 800-38A, GCM, XTS) run first - numbers from broken code are worthless,
+   so benchmark doesn't start when any of them fails
+2. Engines - one block functions and 8 block batches on 4 MiB buffer
+3. Modes - ECB, CBC encryption, CBC decryption (batched and block by block), CTR, GCM and XTS (4 KiB sectors) on messages from 16 B up to max_bytes
+   (1 GiB by default), parallel modes with 1, 2, 4 ... max_threads threads (8 by default)
+4. Small records - allocating API against caller buffers
+5. Many short messages under different keys - raw key API, key schedule cache, one by one with contexts and batch CBC
+
+Results are in cycles/byte (TSC, on other CPUs ns/byte) and GB/s measured with wall clock
+*/
+#define AES_NO_MAIN
+#include "aes.c"
+
+#ifdef AES_X86
+#define BENCH_UNIT "cycles/B"
+#else
+#define BENCH_UNIT "ns/B"
+#endif
+
+// Every measurement processes at least this many bytes (small messages are repeated)
+#define BENCH_MIN_TOTAL_BYTES (32ULL << 20)
+#define BENCH_ENGINE_BYTES (4U << 20)
+
+// Everything that benchmarked function may need - one structure so all of them have the same signature
+typedef struct {
+    const aes_ctx* ctx;
+    const gcm_ctx* gcm;
+    const xts_ctx* xts;
+    u_int8_t* in;
+    u_int8_t* out;
+    u_int64_t bytes;
+    int threads;
+    void (*block_fn)(const aes_ctx*, u_int8_t*);
+    void (*batch_fn)(const aes_ctx*, u_int8_t*, size_t);
+} bench_args;
+
+typedef struct {
+    double per_byte;
+    double gb_per_s;
+} bench_result;
+
+u_int64_t bench_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Running fn enough times to process BENCH_MIN_TOTAL_BYTES (first call only warms up caches and pages)
+bench_result bench_run(void (*fn)(const bench_args*), const bench_args* args){
+    u_int64_t reps = BENCH_MIN_TOTAL_BYTES / args->bytes;
+    if(reps < 1){
+        reps = 1;
+    }
+
+    fn(args);
+
+    u_int64_t start_ns = bench_ns();
+    u_int64_t start = aes_cycles();
+    for(u_int64_t r = 0; r < reps; ++r){
+        fn(args);
+    }
+    u_int64_t end = aes_cycles();
+    u_int64_t end_ns = bench_ns();
+
+    bench_result result;
+    double total = (double)args->bytes * reps;
+    result.per_byte = (double)(end - start) / total;
+    result.gb_per_s = end_ns > start_ns ? total / (end_ns - start_ns) : 0.0;
+    return result;
+}
+
+// Engines
+void bench_engine_block(const bench_args* a){
+    for(u_int64_t i = 0; i < a->bytes; i += 16){
+        a->block_fn(a->ctx, &a->out[i]);
+    }
+}
+
+void bench_engine_batch(const bench_args* a){
+    for(u_int64_t i = 0; i < a->bytes; i += 128){
+        a->batch_fn(a->ctx, &a->out[i], 8);
+    }
+}
+
+// Modes - IV / counter values don't matter for speed, input isn't valid cipher for decryption
+// but CBC decryption of raw blocks doesn't check padding
+void bench_ecb(const bench_args* a){
+    aes_encrypt_blocks(a->ctx, a->out, a->bytes / 16);
+}
+
+void bench_cbc_encrypt(const bench_args* a){
+    u_int8_t iv[16] = {0};
+    cbc_encrypt_padded(a->ctx, iv, a->in, a->bytes, a->out);
+}
+
+void bench_cbc_decrypt(const bench_args* a){
+    u_int8_t iv[16] = {0};
+    cbc_decrypt_blocks_mt(a->ctx, iv, a->in, a->out, a->bytes / 16, a->threads);
+}
+
+// One block after another - what CBC decryption costs without batching (speedup reference for CBC decrypt)
+void bench_cbc_decrypt_serial(const bench_args* a){
+    u_int8_t previous[16] = {0};
+    for(u_int64_t i = 0; i < a->bytes; i += 16){
+        memcpy(&a->out[i], &a->in[i], 16);
+        aes_decrypt_block(a->ctx, &a->out[i]);
+        cbc_xor_block(&a->out[i], &a->out[i], previous);
+        memcpy(previous, &a->in[i], 16);
+    }
+}
+
+void bench_ctr(const bench_args* a){
+    u_int8_t iv[16] = {0};
+    ctr_crypt(a->ctx, iv, a->in, a->out, a->bytes, a->threads);
+}
+
+void bench_gcm(const bench_args* a){
+    u_int8_t iv[12] = {0}, tag[16];
+    gcm_encrypt(a->gcm, iv, 12, NULL, 0, a->in, a->out, a->bytes, tag);
+}
+
+// Disk-like 4 KiB sectors, shorter messages are one sector
+#define BENCH_XTS_SECTOR_BYTES 4096
+
+void bench_xts(const bench_args* a){
+    u_int64_t sector_bytes = a->bytes < BENCH_XTS_SECTOR_BYTES ? a->bytes : BENCH_XTS_SECTOR_BYTES;
+    xts_encrypt(a->xts, 0, sector_bytes, a->in, a->out, a->bytes, a->threads);
+}
+
+// Printing size as B / KiB / MiB / GiB
+void bench_format_size(char* text, size_t text_size, u_int64_t bytes){
+    const char* units[4] = {"B", "KiB", "MiB", "GiB"};
+    int unit = 0;
+    while(bytes >= 1024 && bytes % 1024 == 0 && unit < 3){
+        bytes /= 1024;
+        ++unit;
+    }
+    snprintf(text, text_size, "%llu %s", (unsigned long long)bytes, units[unit]);
+}
+
+void bench_print(const char* name, u_int64_t bytes, int threads, bench_result r){
+    char size[32];
+    bench_format_size(size, sizeof(size), bytes);
+    printf("%-16s %9s %7d %10.2f %9.3f\n", name, size, threads, r.per_byte, r.gb_per_s);
+}
+
+void bench_engines(const aes_ctx* ctx, u_int8_t* buf){
+    bench_args args = {0};
+    args.ctx = ctx;
+    args.out = buf;
+    args.bytes = BENCH_ENGINE_BYTES;
+
+    struct {
+        const char* name;
+        void (*block_fn)(const aes_ctx*, u_int8_t*);
+        void (*batch_fn)(const aes_ctx*, u_int8_t*, size_t);
+        int needs_ni;
+    } engines[] = {
+        {"byte enc", aes_encrypt_block_bytes, NULL, 0},
+        {"byte dec", aes_decrypt_block_bytes, NULL, 0},
+        {"T-table enc", aes_encrypt_block_ttable, NULL, 0},
+        {"T-table dec", aes_decrypt_block_ttable, NULL, 0},
+        {"bitslice x8 enc", NULL, aes_encrypt_blocks_bitslice, 0},
+        {"bitslice x8 dec", NULL, aes_decrypt_blocks_bitslice, 0},
+        {"AES-NI enc", aes_encrypt_block_ni, NULL, 1},
+        {"AES-NI dec", aes_decrypt_block_ni, NULL, 1},
+        {"AES-NI x8 enc", NULL, aes_encrypt_blocks_ni, 1},
+        {"AES-NI x8 dec", NULL, aes_decrypt_blocks_ni, 1}
+    };
+
+    printf("\n%-16s %9s %7s %10s %9s\n", "engine", "bytes", "threads", BENCH_UNIT, "GB/s");
+    for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e){
+        if(engines[e].needs_ni && !aes_use_ni){
+            continue;
+        }
+        args.block_fn = engines[e].block_fn;
+        args.batch_fn = engines[e].batch_fn;
+        bench_result r = bench_run(args.block_fn != NULL ? bench_engine_block : bench_engine_batch, &args);
+        bench_print(engines[e].name, args.bytes, 1, r);
+    }
+}
+
+void bench_modes(const aes_ctx* ctx, const gcm_ctx* gcm, const xts_ctx* xts, u_int8_t* in, u_int8_t* out, u_int64_t max_bytes, int max_threads){
+    struct {
+        const char* name;
+        void (*fn)(const bench_args*);
+        int threaded;
+    } modes[] = {
+        {"ECB", bench_ecb, 0},
+        {"CBC encrypt", bench_cbc_encrypt, 0},
+        {"CBC decrypt", bench_cbc_decrypt, 1},
+        {"CBC dec serial", bench_cbc_decrypt_serial, 0},
+        {"CTR", bench_ctr, 1},
+        {"GCM encrypt", bench_gcm, 0},
+        {"XTS encrypt", bench_xts, 1}
+    };
+    bench_args args = {0};
+    args.ctx = ctx;
+    args.gcm = gcm;
+    args.xts = xts;
+    args.in = in;
+    args.out = out;
+
+    printf("\n%-16s %9s %7s %10s %9s\n", "mode", "bytes", "threads", BENCH_UNIT, "GB/s");
+    for(u_int64_t bytes = 16; bytes <= max_bytes; bytes *= 4){
+        args.bytes = bytes;
+        for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m){
+            int last_threads = modes[m].threaded ? max_threads : 1;
+            for(int threads = 1; threads <= last_threads; threads *= 2){
+                args.threads = threads;
+                bench_print(modes[m].name, bytes, threads, bench_run(modes[m].fn, &args));
+            }
+        }
+    }
+}
+
+// 64 byte records - cost of malloc / realloc per record against caller buffers
+void bench_records(const aes_ctx* ctx, u_int8_t* buf){
+    const int records = 100000;
+    const u_int32_t record_bytes = 64;
+    u_int8_t record[64 + 32], plain[64 + 32];
+
+    u_int64_t start = aes_cycles();
+    for(int r = 0; r < records; ++r){
+        u_int8_t* cipher = cbc_encryption_ctx(ctx, buf, record_bytes);
+        u_int8_t* out = cbc_decrypt_ctx(ctx, cipher, cbc_encrypted_size(record_bytes), NULL);
+        free(cipher);
+        free(out);
+    }
+    u_int64_t end = aes_cycles();
+    printf("\nCBC 64 B records, malloc : %8.2f %s\n", (double)(end - start) / ((u_int64_t)records * record_bytes), BENCH_UNIT);
+
+    start = aes_cycles();
+    for(int r = 0; r < records; ++r){
+        int64_t cipher_bytes = cbc_encrypt_into(ctx, buf, record_bytes, record, sizeof(record));
+        cbc_decrypt_into(ctx, record, cipher_bytes, plain, sizeof(plain));
+    }
+    end = aes_cycles();
+    printf("CBC 64 B records, into   : %8.2f %s\n", (double)(end - start) / ((u_int64_t)records * record_bytes), BENCH_UNIT);
+}
+
+// Timing fn(arg) repeated reps times over total_bytes of data per repetition
+bench_result bench_time(void (*fn)(void*), void* arg, u_int64_t total_bytes, int reps){
+    fn(arg);
+
+    u_int64_t start_ns = bench_ns();
+    u_int64_t start = aes_cycles();
+    for(int r = 0; r < reps; ++r){
+        fn(arg);
+    }
+    u_int64_t end = aes_cycles();
+    u_int64_t end_ns = bench_ns();
+
+    bench_result result;
+    double total = (double)total_bytes * reps;
+    result.per_byte = (double)(end - start) / total;
+    result.gb_per_s = end_ns > start_ns ? total / (end_ns - start_ns) : 0.0;
+    return result;
+}
+
+#define BENCH_BATCH_MESSAGES 2048
+#define BENCH_BATCH_KEYS 8
+
+typedef struct {
+    u_int8_t keys[BENCH_BATCH_KEYS][16];
+    aes_ctx ctxs[BENCH_BATCH_KEYS];
+    cbc_batch_job jobs[BENCH_BATCH_MESSAGES];
+    cmac_ctx cmacs[BENCH_BATCH_KEYS];
+    cmac_batch_job cmac_jobs[BENCH_BATCH_MESSAGES];
+    key_cache cache;
+} bench_batch_state;
+
+// Every message as separate cbc_encryption_128 call (key expansion and allocation per message)
+void bench_batch_raw(void* arg){
+    bench_batch_state* st = arg;
+    for(int m = 0; m < BENCH_BATCH_MESSAGES; ++m){
+        free(cbc_encryption_128(st->keys[m % BENCH_BATCH_KEYS], (u_int8_t*)st->jobs[m].in, st->jobs[m].in_bytes));
+    }
+}
+
+// Raw keys through key schedule cache - expansion is paid only on the first use of a key
+void bench_batch_cached(void* arg){
+    bench_batch_state* st = arg;
+    for(int m = 0; m < BENCH_BATCH_MESSAGES; ++m){
+        const aes_ctx* ctx = key_cache_acquire(&st->cache, st->keys[m % BENCH_BATCH_KEYS], 16);
+        cbc_encrypt_padded(ctx, st->jobs[m].iv, st->jobs[m].in, st->jobs[m].in_bytes, st->jobs[m].out);
+        key_cache_release(&st->cache, ctx);
+    }
+}
+
+void bench_batch_serial(void* arg){
+    bench_batch_state* st = arg;
+    for(int m = 0; m < BENCH_BATCH_MESSAGES; ++m){
+        cbc_encrypt_padded(st->jobs[m].ctx, st->jobs[m].iv, st->jobs[m].in, st->jobs[m].in_bytes, st->jobs[m].out);
+    }
+}
+
+void bench_batch_lanes(void* arg){
+    bench_batch_state* st = arg;
+    cbc_encrypt_batch(st->jobs, BENCH_BATCH_MESSAGES);
+}
+
+void bench_cmac_serial(void* arg){
+    bench_batch_state* st = arg;
+    for(int m = 0; m < BENCH_BATCH_MESSAGES; ++m){
+        const cmac_batch_job* job = &st->cmac_jobs[m];
+        cmac_compute(job->ctx, job->in, job->in_bytes, job->tag);
+    }
+}
+
+void bench_cmac_lanes(void* arg){
+    bench_batch_state* st = arg;
+    cmac_batch(st->cmac_jobs, BENCH_BATCH_MESSAGES);
+}
+
+void bench_batch(u_int8_t* in, u_int8_t* out){
+    bench_batch_state* st = malloc(sizeof(bench_batch_state));
+    if(st == NULL){
+        perror("Error while allocating memory");
+        return;
+    }
+    if(key_cache_init(&st->cache, 1024) == -1){
+        free(st);
+        return;
+    }
+    for(int k = 0; k < BENCH_BATCH_KEYS; ++k){
+        for(int j = 0; j < 16; ++j){
+            st->keys[k][j] = (u_int8_t)(k * 16 + j);
+        }
+        aes_init_ctx_128(&st->ctxs[k], st->keys[k]);
+        cmac_init_ctx(&st->cmacs[k], &st->ctxs[k]);
+    }
+
+    printf("\n%-16s %9s %7s %10s %9s\n", "messages", "bytes", "keys", BENCH_UNIT, "GB/s");
+    for(u_int64_t bytes = 64; bytes <= 1024; bytes *= 4){
+        for(int m = 0; m < BENCH_BATCH_MESSAGES; ++m){
+            st->jobs[m].ctx = &st->ctxs[m % BENCH_BATCH_KEYS];
+            st->jobs[m].iv = &in[m * 16];
+            st->jobs[m].in = &in[m * bytes];
+            st->jobs[m].in_bytes = bytes;
+            st->jobs[m].out = &out[m * (bytes + 16)];
+            st->cmac_jobs[m].ctx = &st->cmacs[m % BENCH_BATCH_KEYS];
+            st->cmac_jobs[m].in = &in[m * bytes];
+            st->cmac_jobs[m].in_bytes = bytes;
+            st->cmac_jobs[m].tag = &out[m * 16];
+        }
+        u_int64_t total = bytes * BENCH_BATCH_MESSAGES;
+        int reps = (int)(BENCH_MIN_TOTAL_BYTES / 4 / total) + 1;
+        bench_print("raw key CBC", bytes, BENCH_BATCH_KEYS, bench_time(bench_batch_raw, st, total, reps / 4 + 1));
+        bench_print("key cache CBC", bytes, BENCH_BATCH_KEYS, bench_time(bench_batch_cached, st, total, reps));
+        bench_print("one by one CBC", bytes, BENCH_BATCH_KEYS, bench_time(bench_batch_serial, st, total, reps));
+        bench_print("batch CBC", bytes, BENCH_BATCH_KEYS, bench_time(bench_batch_lanes, st, total, reps));
+        bench_print("one by one CMAC", bytes, BENCH_BATCH_KEYS, bench_time(bench_cmac_serial, st, total, reps));
+        bench_print("batch CMAC", bytes, BENCH_BATCH_KEYS, bench_time(bench_cmac_lanes, st, total, reps));
+    }
+
+    for(int k = 0; k < BENCH_BATCH_KEYS; ++k){
+        cmac_clear_ctx(&st->cmacs[k]);
+        aes_clear_ctx(&st->ctxs[k]);
+    }
+    u_int64_t hits, misses;
+    key_cache_stats(&st->cache, &hits, &misses, NULL);
+    printf("key cache: %llu hits, %llu misses\n", (unsigned long long)hits, (unsigned long long)misses);
+    key_cache_destroy(&st->cache);
+    free(st);
+}
+
+int main(int argc, char* argv[]){
+    u_int64_t max_bytes = 1ULL << 30;
+    int max_threads = 8;
+    if(argc > 1){
+        max_bytes = strtoull(argv[1], NULL, 0);
+    }
+    if(argc > 2){
+        max_threads = atoi(argv[2]);
+    }
+    if(max_bytes < BENCH_ENGINE_BYTES || max_threads < 1){
+        fprintf(stderr, "Usage: %s [max_bytes (at least %u)] [max_threads]\n", argv[0], BENCH_ENGINE_BYTES);
+        return 1;
+    }
+
+    if(aes_selftest() != 0){
+        fprintf(stderr, "Err: Known-answer tests failed, not running benchmark\n");
+        return 1;
+    }
+
+    // Input and output buffers (CBC encryption writes one padding block more)
+    // When there is not enough memory we try smaller maximum size
+    u_int8_t* in = NULL;
+    u_int8_t* out = NULL;
+    while(max_bytes >= BENCH_ENGINE_BYTES){
+        in = malloc(max_bytes);
+        out = malloc(max_bytes + 16);
+        if(in != NULL && out != NULL){
+            break;
+        }
+        free(in);
+        free(out);
+        in = out = NULL;
+        max_bytes /= 2;
+    }
+    if(in == NULL){
+        perror("Error while allocating memory");
+        return 1;
+    }
+    for(u_int64_t i = 0; i < max_bytes; ++i){
+        in[i] = (u_int8_t)i;
+    }
+    memset(out, 0, max_bytes + 16);
+
+    u_int8_t key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+        0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    };
+    aes_ctx ctx;
+    gcm_ctx gcm;
+    xts_ctx xts;
+    aes_init_ctx_128(&ctx, key);
+    // Engine table calls bitsliced functions directly, also on machines where AES-NI is the backend
+    aes_bs_init_ctx(&ctx);
+    gcm_init_ctx(&gcm, &ctx);
+    // XTS-AES-128 needs two keys - data key and the same key with inverted bits as tweak key
+    u_int8_t xts_key[32];
+    for(int i = 0; i < 16; ++i){
+        xts_key[i] = key[i];
+        xts_key[16 + i] = ~key[i];
+    }
+    xts_init_ctx(&xts, xts_key, 32);
+
+    printf("\nAES-NI: %s, PCLMULQDQ: %s\n", aes_use_ni ? "yes" : "no", aes_use_pclmul ? "yes" : "no");
+    bench_engines(&ctx, out);
+    bench_modes(&ctx, &gcm, &xts, in, out, max_bytes, max_threads);
+    bench_records(&ctx, in);
+    bench_batch(in, out);
+
+    gcm_clear_ctx(&gcm);
+    xts_clear_ctx(&xts);
+    aes_clear_ctx(&ctx);
+    free(in);
+    free(out);
+    return 0;
+}
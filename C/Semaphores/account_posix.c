@@ -1,112 +1,502 @@
+// Bank ledger on POSIX semaphores, C11 atomics and flat combining
+/*
+Build: gcc -O2 -pthread account_posix.c -o account_posix -lm
+(-lm for pow in zipf distribution)
+Usage: ./account_posix (without arguments prints options)
+*/
 #include "posix_libs.h"
+#include <math.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
 
-sem_t* sem;
+#define CACHE_LINE 64
 
-int account = 0;
+// every account on its own cache line, so locking one account doesn't invalidate its neighbours
+typedef struct {
+    sem_t lock;
+    // atomic for the atomic engine, under the lock it's only read and written (relaxed)
+    atomic_long balance;
+} __attribute__((aligned(CACHE_LINE))) account_slot;
 
-void simulate_heavy_work(int min_ms, int max_ms) {
-    long duration_ms = min_ms + rand() % (max_ms - min_ms + 1);
+enum { DIST_UNIFORM, DIST_ZIPF };
 
+account_slot* accounts = NULL;
+int accounts_n = 1;
+
+int dist = DIST_UNIFORM;
+double zipf_s = 1.0;
+// zipf_cdf[k] - probability of picking one of accounts 0..k
+double* zipf_cdf = NULL;
+
+// refusing withdrawals which would make balance negative
+int overdraft_check = 0;
+// simulated work - sleep, 0:0 - none
+int work_min_ms = 10, work_max_ms = 300;
+// busy-spin in ns inside and outside the critical section
+long work_inside_ns = 0, work_outside_ns = 0;
+// measuring latency of every operation
+int bench = 0;
+
+/*
+HDR-style latency histogram - values below 2 * HIST_SUB are exact, above that every power of two
+is split into HIST_SUB buckets, so relative error stays below 1 / HIST_SUB for anything up to 2^63 ns
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB)
+
+// padded - every thread updates its own counters
+typedef struct {
+    int value;
+    int n;
+    int id;
+    // xorshift state, private to the thread
+    unsigned long long rng;
+    long refused;
+    // critical sections entered by this thread
+    long locks;
+    unsigned long long latency[HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE))) op_args;
+
+// returns 1 when the operation was applied, 0 when it was refused (overdraft), -1 on error
+typedef int (*apply_fn)(op_args* self, account_slot* account, long value);
+
+typedef struct {
+    const char* name;
+    apply_fn apply;
+} engine;
+
+typedef struct {
+    long expected;
+    long total;
+    long ops;
+    long refused;
+    long locks;
+    double seconds;
+    int err_flag;
+    // merged histograms of all threads (ns)
+    unsigned long long latency[HIST_BUCKETS];
+} run_result;
+
+// flat combining - thread publishes its operation in its own slot, whoever gets the lock applies all of them
+typedef struct {
+    // 1 - operation waits for combiner, set back to 0 when it's done
+    atomic_int pending;
+    int applied;
+    // owner waits while its slot is pending, so combiner can use its rng for the work inside
+    op_args* owner;
+    account_slot* account;
+    long value;
+} __attribute__((aligned(CACHE_LINE))) combine_slot;
+
+combine_slot* combine_slots = NULL;
+int combine_slots_n = 0;
+sem_t combine_lock;
+// set when run is aborted - spinning waiters of the combine engine never reach a cancellation point
+atomic_int run_stop;
+
+// xorshift64* - every thread has its own state, no lock like in rand()
+unsigned long long rng_next(unsigned long long* state) {
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// splitmix64 - spreading thread number into nonzero starting state
+unsigned long long rng_seed(unsigned long long n) {
+    unsigned long long z = n + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z != 0 ? z : 1;
+}
+
+int zipf_init(void) {
+    zipf_cdf = malloc(sizeof(double) * accounts_n);
+    if(zipf_cdf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    double sum = 0.0;
+    for(int k = 0; k < accounts_n; ++k) {
+        sum += 1.0 / pow(k + 1, zipf_s);
+        zipf_cdf[k] = sum;
+    }
+    for(int k = 0; k < accounts_n; ++k) {
+        zipf_cdf[k] /= sum;
+    }
+    // rounding can leave the last one just below 1
+    zipf_cdf[accounts_n - 1] = 1.0;
+    return 0;
+}
+
+int pick_account(unsigned long long* state) {
+    unsigned long long r = rng_next(state);
+    if(dist == DIST_UNIFORM) {
+        return (int)(r % accounts_n);
+    }
+
+    // first account with cdf >= u, account 0 is the hottest
+    double u = (r >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = accounts_n - 1;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int ledger_init(void) {
+    if(posix_memalign((void**)&accounts, CACHE_LINE, sizeof(account_slot) * accounts_n) != 0) {
+        perror("posix_memalign");
+        accounts = NULL;
+        return -1;
+    }
+    memset(accounts, 0, sizeof(account_slot) * accounts_n);
+
+    for(int k = 0; k < accounts_n; ++k) {
+        atomic_init(&accounts[k].balance, 0);
+        if(sem_init(&accounts[k].lock, 0, 1) == -1) {
+            perror("sem_init");
+            for(int j = 0; j < k; ++j) {
+                sem_destroy(&accounts[j].lock);
+            }
+            free(accounts);
+            accounts = NULL;
+            return -1;
+        }
+    }
+
+    if(dist == DIST_ZIPF && zipf_init() == -1) {
+        for(int k = 0; k < accounts_n; ++k) {
+            sem_destroy(&accounts[k].lock);
+        }
+        free(accounts);
+        accounts = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void ledger_destroy(void) {
+    if(accounts != NULL) {
+        for(int k = 0; k < accounts_n; ++k) {
+            sem_destroy(&accounts[k].lock);
+        }
+    }
+    free(accounts);
+    free(zipf_cdf);
+}
+
+void ledger_reset(void) {
+    for(int k = 0; k < accounts_n; ++k) {
+        atomic_store(&accounts[k].balance, 0);
+    }
+}
+
+long ledger_total(void) {
+    long total = 0;
+    for(int k = 0; k < accounts_n; ++k) {
+        total += atomic_load(&accounts[k].balance);
+    }
+    return total;
+}
+
+long long now_ns(void) {
     struct timespec ts;
-    ts.tv_sec = duration_ms / 1000;         
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hist_index(unsigned long long v) {
+    if(v < 2 * HIST_SUB) {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+// highest value which falls into bucket i
+unsigned long long hist_value(int i) {
+    if(i < 2 * HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    unsigned long long m = i - shift * HIST_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+// value below which fraction q of recorded values lies
+unsigned long long hist_percentile(const unsigned long long* hist, double q) {
+    unsigned long long total = 0;
+    for(int i = 0; i < HIST_BUCKETS; ++i) {
+        total += hist[i];
+    }
+    if(total == 0) {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(q * total + 0.5), seen = 0;
+    if(rank == 0) {
+        rank = 1;
+    }
+    for(int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist[i];
+        if(seen >= rank) {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+void spin_ns(long ns) {
+    if(ns <= 0) {
+        return;
+    }
+    long long end = now_ns() + ns;
+    while(now_ns() < end) {
+    }
+}
+
+// sleeping for random time from range, random number comes from the thread's own generator
+void simulate_heavy_work(unsigned long long* state, int min_ms, int max_ms) {
+    if(max_ms == 0) {
+        return;
+    }
+    long duration_ms = min_ms + rng_next(state) % (max_ms - min_ms + 1);
+
+    struct timespec ts;
+    ts.tv_sec = duration_ms / 1000;
     ts.tv_nsec = (duration_ms % 1000) * 1000000;
 
     full_nanosleep(&ts);
 }
 
-void* perform_account_op(void* arg) {
-    int* args = (int*)arg;
-    int value = args[0], n = args[1];
+// work which belongs to the critical section
+void work_inside(op_args* self) {
+    simulate_heavy_work(&self->rng, work_min_ms, work_max_ms);
+    spin_ns(work_inside_ns);
+}
 
-    for(int i = 0; i < n; ++i) {
-        if(sem_wait(sem) == -1) {
-            perror("sem_wait");
-            free(arg);
-            return (void*)(long)-1;
-        } 
+// sem_wait, read-modify-write, sem_post - work happens inside the critical section
+int apply_sem(op_args* self, account_slot* account, long value) {
+    if(sem_wait(&account->lock) == -1) {
+        perror("sem_wait");
+        return -1;
+    }
+    ++self->locks;
 
-        int tmp = account;
+    int applied = 1;
+    long tmp = atomic_load_explicit(&account->balance, memory_order_relaxed);
+    if(overdraft_check && tmp + value < 0) {
+        applied = 0;
+    }
+    else {
         tmp += value;
-        simulate_heavy_work(10,300);
-        account = tmp;
+    }
+    work_inside(self);
+    atomic_store_explicit(&account->balance, tmp, memory_order_relaxed);
 
-        if(sem_post(sem) == -1) {
-            perror("sem_post");
-            free(arg);
-            return (void*)(long)-1;
-        }
+    if(sem_post(&account->lock) == -1) {
+        perror("sem_post");
+        return -1;
     }
+    return applied;
+}
 
-    free(arg);
+// one lock-free instruction instead of two futex calls, there is no critical section so work goes before it
+int apply_atomic(op_args* self, account_slot* account, long value) {
+    work_inside(self);
 
-    return (void*)0;
+    if(!overdraft_check || value >= 0) {
+        atomic_fetch_add_explicit(&account->balance, value, memory_order_relaxed);
+        return 1;
+    }
+
+    // withdrawal with check - retrying until nobody changed balance between load and exchange
+    long old = atomic_load_explicit(&account->balance, memory_order_relaxed);
+    do {
+        if(old + value < 0) {
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&account->balance, &old, old + value,
+                                                   memory_order_relaxed, memory_order_relaxed));
+    return 1;
 }
 
-int main(int argc, char* argv[]) {
-    srand(time(NULL));
-    if(argc != 6) {
-        fprintf(stderr, "Usage: %s <thread_n> <in> <out> <n_in> <n_out>", argv[0]);
-        exit(1);
+int combine_init(int slots) {
+    if(posix_memalign((void**)&combine_slots, CACHE_LINE, sizeof(combine_slot) * slots) != 0) {
+        perror("posix_memalign");
+        combine_slots = NULL;
+        return -1;
     }
+    for(int i = 0; i < slots; ++i) {
+        atomic_init(&combine_slots[i].pending, 0);
+    }
+    if(sem_init(&combine_lock, 0, 1) == -1) {
+        perror("sem_init");
+        free(combine_slots);
+        combine_slots = NULL;
+        return -1;
+    }
+    return 0;
+}
 
-    int args[5] = {0};
-    for(int i = 0; i < 5; ++i) {
-        args[i] = atoi(argv[i+1]);
+void combine_destroy(void) {
+    if(combine_slots != NULL) {
+        sem_destroy(&combine_lock);
     }
+    free(combine_slots);
+}
 
-    sem_unlink(SEM_NAME);
+// one critical section for every published operation, called with combine_lock held
+void combine_pass(void) {
+    for(int i = 0; i < combine_slots_n; ++i) {
+        combine_slot* slot = &combine_slots[i];
+        if(!atomic_load_explicit(&slot->pending, memory_order_acquire)) {
+            continue;
+        }
 
-    sem = sem_open(SEM_NAME, O_CREAT | O_EXCL, 0666, 1);
-    if(sem == SEM_FAILED) {
-        perror("sem_open");
-        exit(1);
+        // only combiner touches balances in this engine, plain read-modify-write is enough
+        long tmp = atomic_load_explicit(&slot->account->balance, memory_order_relaxed);
+        slot->applied = !(overdraft_check && tmp + slot->value < 0);
+        // every operation's work stays in the critical section like in apply_sem, combiner only saves the lock handoffs
+        work_inside(slot->owner);
+        if(slot->applied) {
+            atomic_store_explicit(&slot->account->balance, tmp + slot->value, memory_order_relaxed);
+        }
+        atomic_store_explicit(&slot->pending, 0, memory_order_release);
+    }
+}
+
+// work inside is done by the combiner, for every published operation
+int apply_combine(op_args* self, account_slot* account, long value) {
+    combine_slot* slot = &combine_slots[self->id];
+    slot->owner = self;
+    slot->account = account;
+    slot->value = value;
+    atomic_store_explicit(&slot->pending, 1, memory_order_release);
+
+    // either some combiner takes our operation, or we become the combiner
+    while(atomic_load_explicit(&slot->pending, memory_order_acquire)) {
+        if(atomic_load_explicit(&run_stop, memory_order_relaxed)) {
+            return -1;
+        }
+        if(sem_trywait(&combine_lock) == 0) {
+            ++self->locks;
+            // cancelled combiner (nanosleep in work_inside) would keep combine_lock forever
+            int old_state;
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+            combine_pass();
+            pthread_setcancelstate(old_state, NULL);
+            if(sem_post(&combine_lock) == -1) {
+                perror("sem_post");
+                return -1;
+            }
+        }
+        else if(errno != EAGAIN) {
+            perror("sem_trywait");
+            return -1;
+        }
+        else {
+            sched_yield();
+        }
     }
+    return slot->applied;
+}
+
+const engine engines[] = {
+    {"sem", apply_sem},
+    {"atomic", apply_atomic},
+    {"combine", apply_combine}
+};
+const int engines_n = sizeof(engines) / sizeof(engines[0]);
+
+apply_fn apply = apply_sem;
+
+void* perform_account_op(void* arg) {
+    op_args* args = (op_args*)arg;
+    int value = args->value, n = args->n;
 
+    for(int i = 0; i < n; ++i) {
+        spin_ns(work_outside_ns);
+        account_slot* account = &accounts[pick_account(&args->rng)];
+
+        // latency of one operation - waiting for the lock, work inside and update
+        long long start = bench ? now_ns() : 0;
+        int applied = apply(args, account, value);
+        if(bench) {
+            ++args->latency[hist_index(now_ns() - start)];
+        }
+        if(applied == -1) {
+            return (void*)(long)-1;
+        }
+        args->refused += !applied;
+    }
+
+    return (void*)0;
+}
+
+// running all in and out threads with given engine on a cleared ledger
+int run_engine(const engine* e, const int args[5], run_result* r) {
     pthread_t* threads_in = NULL;
     pthread_t* threads_out = NULL;
-    int in_created = 0, out_created = 0, creat_flag = 0;
-    
+    // in thread i uses workers[2 * i], out thread workers[2 * i + 1]
+    op_args* workers = NULL;
+    int in_created = 0, out_created = 0, creat_flag = 0, ret = -1;
+    struct timespec start, end;
+
+    memset(r, 0, sizeof(*r));
+    ledger_reset();
+    atomic_store(&run_stop, 0);
+    apply = e->apply;
+    combine_slots_n = 2 * args[0];
+
     threads_in = malloc(sizeof(pthread_t) * args[0]);
-    if(threads_in == NULL) {
+    threads_out = malloc(sizeof(pthread_t) * args[0]);
+    if(threads_in == NULL || threads_out == NULL) {
         perror("malloc");
         goto cleanup;
     }
-
-    threads_out = malloc(sizeof(pthread_t) * args[0]);
-    if(threads_out == NULL) {
-        perror("malloc");
+    if(posix_memalign((void**)&workers, CACHE_LINE, sizeof(op_args) * 2 * args[0]) != 0) {
+        perror("posix_memalign");
+        workers = NULL;
         goto cleanup;
     }
+    memset(workers, 0, sizeof(op_args) * 2 * args[0]);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for(int i = 0; i < args[0]; ++i) {
-        int *args_in = malloc(sizeof(int) * 3);
-        if(args_in == NULL) {
-            perror("malloc");
-            goto cleanup;
-        }
-
-        args_in[0] = args[1];
-        args_in[1] = args[3];
+        op_args* args_in = &workers[2 * i];
+        args_in->value = args[1];
+        args_in->n = args[3];
+        args_in->id = 2 * i;
+        args_in->rng = rng_seed(2 * i);
         if(pthread_create(&threads_in[i], NULL, perform_account_op, args_in) != 0) {
             perror("pthread_create");
             creat_flag = 1;
-            free(args_in);
             goto cleanup;
         }
         ++in_created;
 
-        int *args_out = malloc(sizeof(int) * 2);
-        if(args_out == NULL) {
-            perror("malloc");
-            goto cleanup;
-        }
-
-        args_out[0] = -args[2];
-        args_out[1] = args[4];
+        op_args* args_out = &workers[2 * i + 1];
+        args_out->value = -args[2];
+        args_out->n = args[4];
+        args_out->id = 2 * i + 1;
+        args_out->rng = rng_seed(2 * i + 1);
         if(pthread_create(&threads_out[i], NULL, perform_account_op, args_out) != 0) {
             perror("pthread_create");
             creat_flag = 1;
-            free(args_out);
             goto cleanup;
         }
         ++out_created;
@@ -114,39 +504,42 @@ int main(int argc, char* argv[]) {
 
     void* ret_value;
     long status;
-    int err_flag = 0;
 
     for(int i = 0; i < args[0]; ++i) {
         pthread_join(threads_in[i], &ret_value);
         status = (long)ret_value;
         if(status == -1) {
             printf("Something went wrong in thread IN %d\n", i);
-            err_flag = 1;
+            r->err_flag = 1;
         }
 
         pthread_join(threads_out[i], &ret_value);
         status = (long)ret_value;
         if(status == -1) {
-            printf("Something went wrong in thread IN %d\n", i);
-            err_flag = 1;
+            printf("Something went wrong in thread OUT %d\n", i);
+            r->err_flag = 1;
         }
     }
-
-    int expected = (args[0] * args[1] * args[3]) - (args[0] * args[2] * args[4]);
-    printf("Finish.\n");
-    printf("Expected: %d\n", expected);
-    printf("Real account value:  %d\n", account);
-    printf("Error flag: %d\n", err_flag);
-
-    if(expected == account) {
-        printf(">> SUCCESS <<\n");
-    }
-    else {
-        printf(">> FAILURE <<\nCheck Error flag\n");
+    for(int i = 0; i < 2 * args[0]; ++i) {
+        r->refused += workers[i].refused;
+        r->locks += workers[i].locks;
+        for(int b = 0; b < HIST_BUCKETS; ++b) {
+            r->latency[b] += workers[i].latency[b];
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // accounts are picked at random, so only the sum over the whole ledger is known up front
+    // (refused operations are only withdrawals)
+    r->expected = ((long)args[0] * args[1] * args[3]) - ((long)args[0] * args[2] * args[4]) + r->refused * args[2];
+    r->total = ledger_total();
+    r->ops = (long)args[0] * (args[3] + args[4]);
+    r->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ret = 0;
 
     cleanup:
     if(creat_flag == 1) {
+        atomic_store(&run_stop, 1);
         for(int i = 0; i < in_created; ++i) {
             pthread_cancel(threads_in[i]);
         }
@@ -164,12 +557,156 @@ int main(int argc, char* argv[]) {
     }
     free(threads_in);
     free(threads_out);
-    if(sem_close(sem) == -1) {
-        perror("sem_close");
+    free(workers);
+    return ret;
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-e sem|atomic|combine|all] [-a accounts] [-d uniform|zipf] [-s zipf_exponent] [-w min_ms:max_ms] [-o] [-c]"
+                    " [-b] [-i inside_ns] [-x outside_ns] <thread_n> <in> <out> <n_in> <n_out>\n"
+                    "  -c  contention benchmark - every engine for 1, 2, 4 ... thread_n pairs of threads\n"
+                    "  -b  latency histograms (p50/p99/p99.9), no sleeping unless -w is given\n"
+                    "  -i  busy-spin inside the critical section, -x between operations\n", name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    // -1 - every engine one after another
+    int engine_id = 0, sweep = 0, work_set = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "e:a:d:s:w:ocbi:x:")) != -1) {
+        if(opt == 'e') {
+            engine_id = -2;
+            for(int e = 0; e < engines_n; ++e) {
+                if(strcmp(optarg, engines[e].name) == 0) {
+                    engine_id = e;
+                }
+            }
+            if(strcmp(optarg, "all") == 0) {
+                engine_id = -1;
+            }
+            if(engine_id == -2) {
+                usage(argv[0]);
+            }
+        }
+        else if(opt == 'a') {
+            accounts_n = atoi(optarg);
+        }
+        else if(opt == 'd' && strcmp(optarg, "uniform") == 0) {
+            dist = DIST_UNIFORM;
+        }
+        else if(opt == 'd' && strcmp(optarg, "zipf") == 0) {
+            dist = DIST_ZIPF;
+        }
+        else if(opt == 's') {
+            zipf_s = atof(optarg);
+        }
+        else if(opt == 'w') {
+            if(sscanf(optarg, "%d:%d", &work_min_ms, &work_max_ms) != 2 || work_min_ms < 0 || work_max_ms < work_min_ms) {
+                usage(argv[0]);
+            }
+            work_set = 1;
+        }
+        else if(opt == 'o') {
+            overdraft_check = 1;
+        }
+        else if(opt == 'c') {
+            sweep = 1;
+            engine_id = -1;
+        }
+        else if(opt == 'b') {
+            bench = 1;
+        }
+        else if(opt == 'i') {
+            work_inside_ns = atol(optarg);
+        }
+        else if(opt == 'x') {
+            work_outside_ns = atol(optarg);
+        }
+        else {
+            usage(argv[0]);
+        }
     }
-    if(sem_unlink(SEM_NAME) == -1) {
-        perror("unlink");
+    if(argc - optind != 5 || accounts_n < 1 || zipf_s < 0.0) {
+        usage(argv[0]);
+    }
+
+    int args[5] = {0};
+    for(int i = 0; i < 5; ++i) {
+        args[i] = atoi(argv[optind + i]);
+    }
+
+    if(args[0] < 1) {
+        usage(argv[0]);
+    }
+    // sleeping would be the only thing measured
+    if(bench && !work_set) {
+        work_min_ms = work_max_ms = 0;
+    }
+
+    if(ledger_init() == -1) {
         exit(1);
     }
+    if(combine_init(2 * args[0]) == -1) {
+        ledger_destroy();
+        exit(1);
+    }
+
+    int first = engine_id == -1 ? 0 : engine_id;
+    int last = engine_id == -1 ? engines_n - 1 : engine_id;
+    int failed = 0;
+
+    printf("Accounts: %d (%s), threads: %s%d in + %d out\n", accounts_n, dist == DIST_ZIPF ? "zipf" : "uniform",
+           sweep ? "up to " : "", args[0], args[0]);
+    // locks - critical sections entered, for combine one of them applies a whole batch
+    if(bench) {
+        printf("Work: %ld ns inside, %ld ns outside, latency in ns\n", work_inside_ns, work_outside_ns);
+        printf("%-8s %7s %10s %10s %10s %14s %10s %10s %10s %10s %s\n", "engine", "threads", "ops", "locks", "time s", "ops/sec",
+               "p50", "p99", "p99.9", "max", "check");
+    }
+    else {
+        printf("%-8s %7s %10s %10s %10s %10s %14s %12s %12s %s\n", "engine", "threads", "ops", "refused", "locks", "time s", "ops/sec",
+               "expected", "real", "check");
+    }
+
+    int run_args[5];
+    memcpy(run_args, args, sizeof(run_args));
+    for(int t = sweep ? 1 : args[0]; !failed; t *= 2) {
+        run_args[0] = t < args[0] ? t : args[0];
+
+        for(int e = first; e <= last; ++e) {
+            run_result r;
+            if(run_engine(&engines[e], run_args, &r) == -1) {
+                failed = 1;
+                break;
+            }
+
+            int ok = !r.err_flag && r.expected == r.total;
+            double ops_sec = r.seconds > 0 ? r.ops / r.seconds : 0.0;
+            if(bench) {
+                printf("%-8s %7d %10ld %10ld %10.3f %14.0f %10llu %10llu %10llu %10llu %s\n", engines[e].name, 2 * run_args[0], r.ops,
+                       r.locks, r.seconds, ops_sec, hist_percentile(r.latency, 0.5), hist_percentile(r.latency, 0.99),
+                       hist_percentile(r.latency, 0.999), hist_percentile(r.latency, 1.0), ok ? "OK" : "FAILED");
+            }
+            else {
+                printf("%-8s %7d %10ld %10ld %10ld %10.3f %14.0f %12ld %12ld %s\n", engines[e].name, 2 * run_args[0], r.ops, r.refused,
+                       r.locks, r.seconds, ops_sec, r.expected, r.total, ok ? "OK" : "FAILED");
+            }
+            failed |= !ok;
+        }
+        if(run_args[0] == args[0]) {
+            break;
+        }
+    }
+
+    if(!failed) {
+        printf(">> SUCCESS <<\n");
+    }
+    else {
+        printf(">> FAILURE <<\n");
+    }
+
+    combine_destroy();
+    ledger_destroy();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,7 +1,17 @@
 #include "libs.h"
+#include <time.h>
+
+enum { BACKEND_SYSV, BACKEND_MUTEX };
+
+// shm layout - balances first, mutexes of the mutex backend next to them
+typedef struct {
+    int accounts[2];
+    int backend;
+    pthread_mutex_t locks[2];
+} bank_shm;
 
 // shm and sem init
-int init(int* shm_id, int* sem_id_a) {
+int init(int* shm_id, int* sem_id_a, int backend, bank_shm** bank_ptr) {
     // key creation
     key_t key = ftok(KEYFILE, KEY_ID);
     if(key == -1) {
@@ -10,7 +20,7 @@ int init(int* shm_id, int* sem_id_a) {
     }
 
     // shm create
-    *shm_id = shmget(key, 2*sizeof(int), IPC_CREAT | 0666);
+    *shm_id = shmget(key, sizeof(bank_shm), IPC_CREAT | 0666);
     if(*shm_id == -1) {
         perror("shmget");
         return -1;
@@ -25,9 +35,21 @@ int init(int* shm_id, int* sem_id_a) {
     }
 
     // clearing the memory
-    int *account_ptr = (int*)ptr;
-    account_ptr[0] = 0;
-    account_ptr[1] = 0;
+    bank_shm *bank = (bank_shm*)ptr;
+    bank->accounts[0] = 0;
+    bank->accounts[1] = 0;
+    bank->backend = backend;
+
+    // mutexes start locked like sem 0 and 1, released after Enter
+    if(backend == BACKEND_MUTEX) {
+        for(int i = 0; i < 2; ++i) {
+            if(mutex_init_shared(&bank->locks[i]) == -1 || mutex_p(&bank->locks[i]) == -1) {
+                shmdt(ptr);
+                shmctl(*shm_id, IPC_RMID, NULL);
+                return -1;
+            }
+        }
+    }
 
     // sem create
     *sem_id_a = semget(key, 2, IPC_CREAT | 0666);
@@ -58,19 +80,14 @@ int init(int* shm_id, int* sem_id_a) {
         return -1;
     }
 
-    // detaching memory
-    if(shmdt(ptr) == -1) {
-        perror("shmdt");
-        semctl(*sem_id_a, 0, IPC_RMID);
-        shmctl(*shm_id, IPC_RMID, NULL);
-        return -1;
-    }
+    // memory stays attached - locked robust mutexes are remembered by address, so they have to be released through the same mapping
+    *bank_ptr = bank;
 
     return 1;
 }
 
 // connecting
-int connect_bank(int* shm_id, int* sem_id, int** account_ptr) {
+int connect_bank(int* shm_id, int* sem_id, bank_shm** bank_ptr) {
     // key creation
     key_t key = ftok(KEYFILE, KEY_ID);
     if(key == -1) {
@@ -79,7 +96,7 @@ int connect_bank(int* shm_id, int* sem_id, int** account_ptr) {
     }
 
     // connnecting to existing shm
-    *shm_id = shmget(key, 2*sizeof(int), 0666);
+    *shm_id = shmget(key, sizeof(bank_shm), 0666);
     if(*shm_id == -1) {
         perror("shmget");
         return -1;
@@ -92,8 +109,8 @@ int connect_bank(int* shm_id, int* sem_id, int** account_ptr) {
         return -1;
     }
 
-    // casting memory on int
-    *account_ptr = (int*)ptr;
+    // casting memory on bank
+    *bank_ptr = (bank_shm*)ptr;
 
     // connecitng to semaphore
     *sem_id = semget(key, 2, 0666);
@@ -106,8 +123,50 @@ int connect_bank(int* shm_id, int* sem_id, int** account_ptr) {
     return 1;
 }
 
-int cleanup(int shm_id, int sem_id, int *accounts) {
+// locking account n with backend chosen by role 0
+int bank_p(bank_shm* bank, int sem_id, int n) {
+    if(bank->backend == BACKEND_MUTEX) {
+        return mutex_p(&bank->locks[n]);
+    }
+    return sem_p(sem_id, n);
+}
+
+int bank_v(bank_shm* bank, int sem_id, int n) {
+    if(bank->backend == BACKEND_MUTEX) {
+        return mutex_v(&bank->locks[n]);
+    }
+    return sem_v(sem_id, n);
+}
+
+double elapsed(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void print_speed(int nops, const struct timespec* start) {
+    double seconds = elapsed(start);
+    printf("Czas: %.3f s, %.0f operacji/s\n", seconds, seconds > 0 ? nops / seconds : 0.0);
+}
+
+int cleanup(int shm_id, int sem_id, bank_shm *bank) {
     int ret_val = 1;
+    if (bank != NULL && bank != (void*)-1 && bank->backend == BACKEND_MUTEX) {
+        // destroying a mutex held by a running role 1 / 2 is undefined, so we wait for it first
+        // (mutex_p takes over a lock whose owner died in the critical section)
+        for (int i = 0; i < 2; ++i) {
+            if (mutex_p(&bank->locks[i]) == -1 || mutex_v(&bank->locks[i]) == -1) {
+                ret_val = -1;
+                continue;
+            }
+            int err = pthread_mutex_destroy(&bank->locks[i]);
+            if (err != 0) {
+                errno = err;
+                perror("Warning: pthread_mutex_destroy failed");
+                ret_val = -1;
+            }
+        }
+    }
     if (sem_id != -1) {
         if (semctl(sem_id, 0, IPC_RMID) == -1) {
             if (errno != EINVAL && errno != EIDRM) {
@@ -119,8 +178,8 @@ int cleanup(int shm_id, int sem_id, int *accounts) {
         }
     }
 
-    if (accounts != NULL && accounts != (void*)-1) {
-        if (shmdt(accounts) == -1) {
+    if (bank != NULL && bank != (void*)-1) {
+        if (shmdt(bank) == -1) {
             perror("Warning: shmdt failed");
             ret_val = -1;
         } else {
@@ -145,7 +204,8 @@ int cleanup(int shm_id, int sem_id, int *accounts) {
 int main(int argc, char* argv[]) {
     int shm_id, sem_id;
     if(argc < 2) {
-        fprintf(stderr, "Użycie: %s <typ_operacji> <?konto> <?ilość_operacji> <?wartość_operacji>\n", argv[0]);
+        fprintf(stderr, "Użycie: %s <typ_operacji> <?konto> <?ilość_operacji> <?wartość_operacji>\n"
+                        "       %s 0 <?sysv|mutex>\n", argv[0], argv[0]);
         exit(1);
     }
     int role = atoi(argv[1]);
@@ -154,42 +214,68 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
     switch(role) {
-        case 0:
-            if(init(&shm_id, &sem_id) == -1) {
+        case 0: {
+            // sysv - semop on every lock, mutex - robust process-shared mutexes in shm
+            int backend = BACKEND_SYSV;
+            if(argc > 2 && strcmp(argv[2], "mutex") == 0) {
+                backend = BACKEND_MUTEX;
+            }
+            else if(argc > 2 && strcmp(argv[2], "sysv") != 0) {
+                fprintf(stderr, "Nieznany rodzaj synchronizacji: %s\n", argv[2]);
+                exit(1);
+            }
+
+            bank_shm *bank;
+            if(init(&shm_id, &sem_id, backend, &bank) == -1) {
                 printf("Nie udało się utworzyć zasobów\n");
                 exit(1);
             }
-            printf("Utworzenie zasobów przebiegło poprawnie. Naciśnij Enter, aby zwolnić semafory...\n");
+            printf("Utworzenie zasobów przebiegło poprawnie (%s). Naciśnij Enter, aby zwolnić semafory...\n",
+                   backend == BACKEND_MUTEX ? "mutex" : "sysv");
             getchar();
-            if(sem_v(sem_id, 0) == -1) {
-                exit(1);
+            // with SEM_UNDO these tokens would be taken back when role 0 ends, even if nobody holds them
+            for(int i = 0; i < 2; ++i) {
+                int ret = backend == BACKEND_MUTEX ? mutex_v(&bank->locks[i]) : sem_release(sem_id, i);
+                if(ret == -1) {
+                    exit(1);
+                }
             }
-            if(sem_v(sem_id, 1) == -1) {
+
+            // detaching memory
+            if(shmdt(bank) == -1) {
+                perror("shmdt");
                 exit(1);
             }
+        }
         break;
         case 1: {
             int target = atoi(argv[2]);
             int nops = atoi(argv[3]);
             int val = atoi(argv[4]);
-            int *accounts;
+            bank_shm *bank;
+            struct timespec start = {0, 0};
 
-            if(connect_bank(&shm_id, &sem_id, &accounts) == -1) {
+            if(connect_bank(&shm_id, &sem_id, &bank) == -1) {
                 printf("Nie udało się uzyskać zasobow\n");
                 exit(1);
             }
 
             for(int i = 0; i < nops; ++i) {
-                if(sem_p(sem_id, target) == -1) {
+                if(bank_p(bank, sem_id, target) == -1) {
                     exit(1);
                 }
-                accounts[target] += val;
-                if(sem_v(sem_id, target) == -1) {
+                // time is measured from the first lock, not from waiting for role 0
+                if(i == 0) {
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                }
+                bank->accounts[target] += val;
+                if(bank_v(bank, sem_id, target) == -1) {
                     exit(1);
                 }
             }
+            print_speed(nops, &start);
 
-            if(shmdt(accounts) == -1) {
+            if(shmdt(bank) == -1) {
                 perror("shmdt");
                 exit(1);
             }
@@ -199,50 +285,56 @@ int main(int argc, char* argv[]) {
             int target = atoi(argv[2]);
             int nops = atoi(argv[3]);
             int val = atoi(argv[4]);
-            int *accounts;
+            bank_shm *bank;
+            struct timespec start = {0, 0};
 
-            if(connect_bank(&shm_id, &sem_id, &accounts) == -1) {
+            if(connect_bank(&shm_id, &sem_id, &bank) == -1) {
                 printf("Nie udało się uzyskać zasobow\n");
                 exit(1);
             }
 
             for(int i = 0; i < nops; ++i) {
-                if(sem_p(sem_id, 0) == -1) {
+                if(bank_p(bank, sem_id, 0) == -1) {
                     exit(1);
                 }
-                if(sem_p(sem_id, 1) == -1) {
+                if(bank_p(bank, sem_id, 1) == -1) {
                     exit(1);
                 }
+                // time is measured from the first lock, not from waiting for role 0
+                if(i == 0) {
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                }
                 if(target == 0){
-                    accounts[0] += val;
-                    accounts[1] -= val;
+                    bank->accounts[0] += val;
+                    bank->accounts[1] -= val;
                 }
                 else {
-                    accounts[1] += val;
-                    accounts[0] -= val;
+                    bank->accounts[1] += val;
+                    bank->accounts[0] -= val;
                 }
-                if(sem_v(sem_id, 0) == -1) {
+                if(bank_v(bank, sem_id, 0) == -1) {
                     exit(1);
                 }
-                if(sem_v(sem_id, 1) == -1) {
+                if(bank_v(bank, sem_id, 1) == -1) {
                     exit(1);
                 }
             }
+            print_speed(nops, &start);
 
-            if(shmdt(accounts) == -1) {
+            if(shmdt(bank) == -1) {
                 perror("shmdt");
                 exit(1);
             }
         }
         break;
         case 3: {
-            int *accounts;
-            if(connect_bank(&shm_id, &sem_id, &accounts) == -1) {
+            bank_shm *bank;
+            if(connect_bank(&shm_id, &sem_id, &bank) == -1) {
                 printf("Nie udało się uzyskać zasobow. Sprzątanie zakończone niepowodzeniem\n");
                 exit(1);
             }
-            printf("Końcowe salda: 0 -> %d, 1 -> %d\n", accounts[0], accounts[1]);
-            if(cleanup(shm_id, sem_id, accounts) == -1) {
+            printf("Końcowe salda: 0 -> %d, 1 -> %d\n", bank->accounts[0], bank->accounts[1]);
+            if(cleanup(shm_id, sem_id, bank) == -1) {
                 printf("Sprzątanie zakończone niepowidzeniem\n");
                 exit(1);
             }
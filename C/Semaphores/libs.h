@@ -13,6 +13,7 @@
 #include <sys/shm.h>
 #include <sys/ipc.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define KEYFILE "keyfile"
 #define KEY_ID 65
@@ -50,4 +51,67 @@ int sem_v(int semid, int sem_num) {
     return 0;
 }
 
+// V without SEM_UNDO - token stays after the process which gave it ends (starting the bank)
+int sem_release(int semid, int sem_num) {
+    struct sembuf sb;
+    sb.sem_num = sem_num;
+    sb.sem_op = 1;
+    sb.sem_flg = 0;
+
+    if(semop(semid, &sb, 1) == -1) {
+        perror("sem_release");
+        return -1;
+    }
+    return 0;
+}
+
+// process-shared robust mutex, it has to live in shared memory
+int mutex_init_shared(pthread_mutex_t* m) {
+    pthread_mutexattr_t attr;
+    int err = pthread_mutexattr_init(&attr);
+    if(err == 0) {
+        err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    if(err == 0) {
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    if(err == 0) {
+        err = pthread_mutex_init(m, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    if(err != 0) {
+        errno = err;
+        perror("mutex_init_shared");
+        return -1;
+    }
+    return 0;
+}
+
+// without contention it's one atomic instruction, the kernel (futex) is called only when somebody has to wait
+int mutex_p(pthread_mutex_t* m) {
+    int err = pthread_mutex_lock(m);
+    if(err == EOWNERDEAD) {
+        // owner died holding the lock (what SEM_UNDO does for semop) - we take it over
+        fprintf(stderr, "mutex_p: właściciel blokady zakończył się w sekcji krytycznej, odzyskiwanie\n");
+        err = pthread_mutex_consistent(m);
+    }
+    if(err != 0) {
+        errno = err;
+        perror("mutex_p");
+        return -1;
+    }
+    return 0;
+}
+
+int mutex_v(pthread_mutex_t* m) {
+    int err = pthread_mutex_unlock(m);
+    if(err != 0) {
+        errno = err;
+        perror("mutex_v");
+        return -1;
+    }
+    return 0;
+}
+
 #endif
\ No newline at end of file